@@ -0,0 +1,505 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <stdio.h>
+#include <string>
+#include <tuple>
+#include <unistd.h>
+#include <vector>
+
+#include "crc32.h"
+#include "file.h"
+#include "frame_reader.h"
+#include "input_source.h"
+#include "logger.h"
+#include "mpeg_ts.h"
+#include "mpeg_ts_demuxer.h"
+#include "mpeg_ts_parallel_demuxer.h"
+#include "stream_stats.h"
+#include "ts_analyzer.h"
+#include "ts_generator.h"
+#include "ts_sync.h"
+
+#define BENCH_MIN_TIME 0.05 // seconds per timed run; short stages are repeated to fill it
+#define BENCH_RUNS     5    // timed runs per stage, the fastest is reported
+#define BENCH_CHUNK       (1024 * 1024) // bytes per Input() in the frame delivery stages, as a file reader would give
+#define BENCH_DEPTH       32            // frames read ahead in the pull_read_ahead stage
+#define BENCH_CHECK_CHUNK (64 * 1024)   // parallel demuxer chunks in the check against a serial run
+
+static std::atomic<uint64_t> allocations{0};
+static volatile uint8_t checksum; // keeps the consumer work of the pull stages from being optimized out
+
+void *operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+// Counts frames through MpegTsDemuxer::SetFrameSink().
+class CountingSink : public FrameSink<CountingSink> {
+public:
+    void OnFrame(Frame &frame) { frames += !frame.data.empty(); }
+
+    uint64_t frames = 0;
+};
+
+// The generated stream as an InputSource, in windows like those of a FileSource.
+class MemorySource : public InputSource {
+public:
+    MemorySource(const uint8_t *data, size_t size) : data_(data), size_(size) {}
+
+    int Read(struct iovec *spans, int max) override {
+        if (offset_ == size_ || max < 1) {
+            return 0;
+        }
+        size_t size = std::min((size_t)INPUT_BATCH_SIZE, size_ - offset_);
+        spans[0] = {(void *)(data_ + offset_), size};
+        offset_ += size;
+        return 1;
+    }
+    bool Persistent() const override { return true; }
+
+private:
+    const uint8_t *data_;
+    size_t size_;
+    size_t offset_ = 0;
+};
+
+// What one pass of a stage went through.
+struct BenchWork {
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    uint64_t frames = 0; // frames delivered, or items parsed by the single-parser stages
+};
+
+struct BenchResult {
+    const char *stage;
+    BenchWork work;
+    double seconds;        // fastest pass
+    double allocsPerFrame; // averaged over every pass
+};
+
+static void Usage(const char *name) {
+    printf("Usage: %s [-p programs] [-n streams] [-d seconds] [-v bps] [-a bps] [-e bytes] [-f frames] [-A rate]"
+           " [-L rate] [-E rate] [-Y rate] [-s seed] [-r runs] [-j threads] [-g out.ts] [-l level]\n",
+           name);
+    printf("  -p N      programs, 1 for an SPTS (default 1)\n");
+    printf("  -n N      streams per program: one H.264, the rest AAC (default 2, at most %d)\n", GENERATOR_MAX_PIDS);
+    printf("  -d T      seconds of stream (default 10)\n");
+    printf("  -v/-a N   video and audio bitrates in bit/s (default 8000000 and 128000)\n");
+    printf("  -e N      bytes per video PES packet (default: the bitrate at 25 fps)\n");
+    printf("  -f N      ADTS frames per audio PES packet (default 1)\n");
+    printf("  -A rate   share of payload packets with an adaptation field (0-1)\n");
+    printf("  -L rate   share of packets dropped\n");
+    printf("  -E rate   share of packets with a flipped byte\n");
+    printf("  -Y rate   share of packets followed by stray bytes\n");
+    printf("  -s N      generator seed (default 1)\n");
+    printf("  -r N      timed runs per stage, the fastest is reported (default %d)\n", BENCH_RUNS);
+    printf("  -j N      threads for the parallel demuxer stage (default 0: one per CPU)\n");
+    printf("  -g file   also write the generated stream to a file\n");
+    printf("  -l level  log level (default error); logs go to stderr, results to stdout as JSON\n");
+}
+
+static double Now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static BenchResult Measure(const char *stage, int runs, const std::function<BenchWork()> &pass) {
+    BenchResult result = {stage, {}, 0, 0};
+    uint64_t frames = 0;
+    uint64_t allocs = 0;
+    for (int run = 0; run < runs; run++) {
+        int passes = 0;
+        uint64_t before = allocations.load(std::memory_order_relaxed);
+        double start = Now();
+        double elapsed;
+        do {
+            result.work = pass();
+            frames += result.work.frames;
+            passes++;
+            elapsed = Now() - start;
+        } while (elapsed < BENCH_MIN_TIME);
+        allocs += allocations.load(std::memory_order_relaxed) - before;
+
+        double seconds = elapsed / passes;
+        if (run == 0 || seconds < result.seconds) {
+            result.seconds = seconds;
+        }
+    }
+    result.allocsPerFrame = frames ? (double)allocs / frames : 0;
+    return result;
+}
+
+// Offsets of the packets of |data| that |select| picks, for the stages that run one parser.
+static std::vector<size_t> SelectPackets(const data_t &data, const std::function<bool(const uint8_t *)> &select) {
+    std::vector<size_t> offsets;
+    const uint8_t *begin = (const uint8_t *)data.data();
+    const uint8_t *end = begin + data.size();
+    for (const uint8_t *p = TsResync(begin, end, TS_PACKET_SIZE); p + TS_PACKET_SIZE <= end;) {
+        if (p[TS_PACKET_SIZE] != TS_SYNC_BYTE && p + TS_PACKET_SIZE < end) {
+            p = TsResync(p + 1, end, TS_PACKET_SIZE);
+            continue;
+        }
+        if (select(p)) {
+            offsets.push_back(p - begin);
+        }
+        p += TS_PACKET_SIZE;
+    }
+    return offsets;
+}
+
+// Start of the payload, or nullptr if the packet has none or a broken adaptation field.
+static const uint8_t *Payload(const uint8_t *packet) {
+    uint8_t control = (packet[3] >> 4) & 0x03;
+    if (!(control & 0x01)) {
+        return nullptr;
+    }
+    size_t offset = 4 + (control & 0x02 ? 1 + packet[4] : 0);
+    return offset < TS_PACKET_SIZE ? packet + offset : nullptr;
+}
+
+static uint16_t Pid(const uint8_t *packet) { return ((packet[1] & 0x1f) << 8) | packet[2]; }
+
+static void PrintResult(const BenchResult &result, bool last) {
+    const BenchWork &work = result.work;
+    printf("    {\"stage\": \"%s\", \"packets\": %lu, \"bytes\": %lu, \"frames\": %lu, \"seconds\": %.6f, "
+           "\"packets_per_s\": %.0f, \"mb_per_s\": %.1f, \"ns_per_packet\": %.2f, \"allocations_per_frame\": %.3f}%s\n",
+           result.stage, work.packets, work.bytes, work.frames, result.seconds, work.packets / result.seconds,
+           work.bytes / result.seconds / 1e6, result.seconds * 1e9 / (work.packets ? work.packets : 1),
+           result.allocsPerFrame, last ? "" : ",");
+}
+
+int main(int argc, char *argv[]) {
+    TsGeneratorConfig config;
+    int runs = BENCH_RUNS;
+    int threads = 0;
+    const char *generated = nullptr;
+    int level = TS_LOG_LEVEL_ERROR;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:n:d:v:a:e:f:A:L:E:Y:s:r:j:g:l:h")) != -1) {
+        switch (opt) {
+            case 'p':
+                config.programs = atoi(optarg);
+                break;
+            case 'n':
+                config.streams = atoi(optarg);
+                break;
+            case 'd':
+                config.duration = atof(optarg);
+                break;
+            case 'v':
+                config.videoBitrate = strtoul(optarg, nullptr, 10);
+                break;
+            case 'a':
+                config.audioBitrate = strtoul(optarg, nullptr, 10);
+                break;
+            case 'e':
+                config.videoPesSize = strtoul(optarg, nullptr, 10);
+                break;
+            case 'f':
+                config.audioFramesPerPes = atoi(optarg);
+                break;
+            case 'A':
+                config.adaptationRate = atof(optarg);
+                break;
+            case 'L':
+                config.lossRate = atof(optarg);
+                break;
+            case 'E':
+                config.errorRate = atof(optarg);
+                break;
+            case 'Y':
+                config.syncLossRate = atof(optarg);
+                break;
+            case 's':
+                config.seed = strtoul(optarg, nullptr, 10);
+                break;
+            case 'r':
+                runs = std::max(atoi(optarg), 1);
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            case 'g':
+                generated = optarg;
+                break;
+            case 'l':
+                level = Logger::ParseLevel(optarg);
+                if (level < 0) {
+                    Usage(argv[0]);
+                    return 1;
+                }
+                break;
+            default:
+                Usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (config.videoBitrate == 0 || config.duration <= 0) {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    Logger::SetLevel(level);
+    Logger::Start(stderr);
+
+    data_t data;
+    TsGenerator generator(config);
+    generator.Generate(data);
+    const TsGeneratorStats &stats = generator.GetStats();
+    if (generated) {
+        auto file = FileWriter::Open(generated);
+        if (!file || !file->Write(data)) {
+            TS_LOGE("Cannot write the generated stream");
+            Logger::Stop();
+            return 1;
+        }
+        file->Close();
+    }
+
+    const uint8_t *begin = (const uint8_t *)data.data();
+    const uint8_t *end = begin + data.size();
+    BenchWork stream;
+    stream.packets = stats.packets;
+    stream.bytes = data.size();
+    stream.frames = stats.frames;
+
+    std::vector<BenchResult> results;
+
+    results.push_back(Measure("sync", runs, [&]() {
+        BenchWork work;
+        for (const uint8_t *p = TsFindSyncByte(begin, end); p < end; p = TsFindSyncByte(p + TS_PACKET_SIZE, end)) {
+            work.packets++;
+            if (p + TS_PACKET_SIZE > end) {
+                break;
+            }
+        }
+        work.bytes = data.size();
+        return work;
+    }));
+
+    std::vector<size_t> adaptations = SelectPackets(data, [](const uint8_t *p) { return (p[3] & 0x20) && p[4] > 0; });
+    results.push_back(Measure("adaptation_field", runs, [&]() {
+        BenchWork work;
+        TS_Adaption adaptation;
+        for (size_t offset : adaptations) {
+            adaptation.Parse(begin + offset + 4, TS_PACKET_SIZE - 4);
+            work.frames += adaptation.PCR_flag;
+        }
+        work.packets = adaptations.size();
+        work.bytes = work.packets * TS_PACKET_SIZE;
+        return work;
+    }));
+
+    // The generator writes each section in one packet and PES headers whole into the first packet.
+    std::vector<size_t> pesStarts = SelectPackets(data, [&](const uint8_t *p) {
+        const uint8_t *payload = Payload(p);
+        return (p[1] & 0x40) && Pid(p) >= GENERATOR_STREAM_PID && Pid(p) < GENERATOR_PMT_PID && payload &&
+               end - payload >= TS_PES_MAX_HEADER_SIZE && !payload[0] && !payload[1] && payload[2] == 0x01;
+    });
+    // What the demuxer reads of every header, then every field, as TS_PES::Header() gives them.
+    results.push_back(Measure("pes_header", runs, [&]() {
+        BenchWork work;
+        TS_PES pes;
+        for (size_t offset : pesStarts) {
+            const uint8_t *payload = Payload(begin + offset);
+            work.bytes += pes.Parse(payload, begin + offset + TS_PACKET_SIZE - payload);
+        }
+        work.packets = work.frames = pesStarts.size();
+        return work;
+    }));
+    results.push_back(Measure("pes_header_full", runs, [&]() {
+        BenchWork work;
+        TS_PES_Header header;
+        for (size_t offset : pesStarts) {
+            const uint8_t *payload = Payload(begin + offset);
+            work.bytes += header.Parse(payload, begin + offset + TS_PACKET_SIZE - payload);
+        }
+        work.packets = work.frames = pesStarts.size();
+        return work;
+    }));
+
+    std::vector<size_t> sections = SelectPackets(data, [](const uint8_t *p) {
+        return (p[1] & 0x40) && (Pid(p) == PID_PAT || Pid(p) >= GENERATOR_PMT_PID) && Payload(p) && !Payload(p)[0];
+    });
+    results.push_back(Measure("psi", runs, [&]() {
+        BenchWork work;
+        TS_PAT pat;
+        TS_PMT pmt;
+        for (size_t offset : sections) {
+            const uint8_t *section = Payload(begin + offset) + 1; // after pointer_field
+            size_t size = begin + offset + TS_PACKET_SIZE - section;
+            size_t length = 3 + (((section[1] & 0x0f) << 8) | section[2]);
+            // Corrupted sections are dropped on their CRC before parsing, as the demuxer does.
+            if (length > size || Crc32Mpeg2(section, length) != 0) {
+                continue;
+            }
+            if (section[0] == TID_PAS) {
+                pat.Parse(section, length);
+            } else {
+                pmt.Parse(section, length);
+            }
+            work.frames++;
+        }
+        work.packets = sections.size();
+        work.bytes = work.packets * TS_PACKET_SIZE;
+        return work;
+    }));
+
+    // |features| < 0: a plain MpegTsDemuxer, otherwise the MpegTsDemuxerT that MpegTsDemuxer::Create() picks.
+    auto demux = [&](bool iov, bool scan, bool stats = false, bool analyze = false, int features = -1) {
+        BenchWork work;
+        auto instance = features < 0 ? std::make_unique<MpegTsDemuxer>()
+                                     : MpegTsDemuxer::Create(TS_PACKET_SIZE, (unsigned)features);
+        MpegTsDemuxer &demuxer = *instance;
+        if (stats) {
+            demuxer.SetStreamStats(std::make_shared<StreamStats>());
+        }
+        if (analyze) {
+            demuxer.SetAnalyzer(std::make_shared<TsAnalyzer>());
+        }
+        if (iov) {
+            demuxer.SetDemuxIovCallback(
+                [&](StreamType, int64_t, int64_t, const struct iovec *, size_t) { work.frames++; });
+        } else {
+            demuxer.SetDemuxCallback([&](StreamType, int64_t, int64_t, const uint8_t *, size_t) { work.frames++; });
+        }
+        if (scan) {
+            demuxer.SetNalScan(true);
+            demuxer.SetDemuxAudioCallback([](const AudioFrame &) {});
+        }
+        demuxer.Input(begin, data.size());
+        demuxer.Flush();
+        work.packets = stream.packets;
+        work.bytes = stream.bytes;
+        return work;
+    };
+    results.push_back(Measure("demux", runs, [&]() { return demux(false, false); }));
+    results.push_back(Measure("demux_zero_copy", runs, [&]() { return demux(true, false); }));
+    results.push_back(Measure("demux_nal_audio", runs, [&]() { return demux(false, true); }));
+    results.push_back(Measure("demux_stats", runs, [&]() { return demux(false, false, true); }));
+    results.push_back(Measure("demux_analyzer", runs, [&]() { return demux(false, false, false, true); }));
+    results.push_back(Measure("demux_specialized_all", runs,
+                              [&]() { return demux(false, false, false, false, DEMUX_FEATURES_ALL); }));
+    results.push_back(Measure("demux_specialized_es", runs,
+                              [&]() { return demux(false, false, false, false, DEMUX_FEATURES_ES); }));
+    results.push_back(Measure("demux_specialized_es_zero_copy", runs,
+                              [&]() { return demux(true, false, false, false, DEMUX_FEATURES_ES); }));
+
+    // Frame delivery alone, fed as a reader would: a std::function call per frame, a sink called per frame, a sink
+    // called once per Input().
+    auto deliver = [&](int mode) {
+        BenchWork work;
+        MpegTsDemuxer demuxer;
+        CountingSink sink;
+        if (mode == 0) {
+            demuxer.SetDemuxCallback([&](StreamType, int64_t, int64_t, const uint8_t *, size_t) { work.frames++; });
+        } else {
+            demuxer.SetFrameSink(&sink, mode == 2);
+        }
+        for (size_t offset = 0; offset < data.size(); offset += BENCH_CHUNK) {
+            demuxer.Input(begin + offset, std::min((size_t)BENCH_CHUNK, data.size() - offset));
+        }
+        demuxer.Flush();
+        work.frames += sink.frames;
+        work.packets = stream.packets;
+        work.bytes = stream.bytes;
+        return work;
+    };
+    results.push_back(Measure("deliver_callback", runs, [&]() { return deliver(0); }));
+    results.push_back(Measure("deliver_sink", runs, [&]() { return deliver(1); }));
+    results.push_back(Measure("deliver_sink_batched", runs, [&]() { return deliver(2); }));
+
+    // Frames pulled with FrameReader, each read through once as a consumer would, without and with read-ahead.
+    auto pull = [&](size_t depth) {
+        BenchWork work;
+        FrameReader reader(std::make_shared<MemorySource>(begin, data.size()), depth);
+        Frame frame;
+        uint8_t sum = 0;
+        while (reader.NextFrame(frame)) {
+            for (char c : frame.data) {
+                sum += (uint8_t)c;
+            }
+            work.frames++;
+        }
+        checksum = sum;
+        work.bytes = stream.bytes;
+        work.packets = stream.packets;
+        return work;
+    };
+    results.push_back(Measure("pull", runs, [&]() { return pull(0); }));
+    results.push_back(Measure("pull_read_ahead", runs, [&]() { return pull(BENCH_DEPTH); }));
+
+    results.push_back(Measure("demux_parallel", runs, [&]() {
+        BenchWork work;
+        MpegTsParallelDemuxer demuxer(threads);
+        demuxer.SetDemuxCallback([&](StreamType, int64_t, int64_t, const uint8_t *, size_t) { work.frames++; });
+        demuxer.Demux(begin, data.size());
+        work.packets = stream.packets;
+        work.bytes = stream.bytes;
+        return work;
+    }));
+
+    // Not a stage: the parallel demuxer must deliver the frames of a serial run, corruption (-L, -E, -Y) included.
+    // Small chunks put many cuts, and frames stitched across them, into even a short stream.
+    using FrameDigest = std::tuple<StreamType, int64_t, int64_t, size_t, uint32_t>;
+    auto digest = [](std::vector<FrameDigest> &to) {
+        return [&to](StreamType codec, int64_t pts, int64_t dts, const uint8_t *frame, size_t size) {
+            to.emplace_back(codec, pts, dts, size, Crc32Mpeg2(frame, size));
+        };
+    };
+    std::vector<FrameDigest> serialFrames;
+    std::vector<FrameDigest> parallelFrames;
+    {
+        MpegTsDemuxer demuxer;
+        demuxer.SetDemuxCallback(digest(serialFrames));
+        demuxer.Input(begin, data.size());
+        demuxer.Flush();
+
+        MpegTsParallelDemuxer parallel(threads);
+        parallel.SetChunkSize(BENCH_CHECK_CHUNK);
+        parallel.SetDemuxCallback(digest(parallelFrames));
+        parallel.Demux(begin, data.size());
+    }
+    bool parallelMatches = parallelFrames == serialFrames;
+    if (!parallelMatches) {
+        TS_LOGE("The parallel demuxer delivered %zu frames, other than the %zu of a serial run", parallelFrames.size(),
+                serialFrames.size());
+    }
+
+    printf("{\n");
+    printf("  \"config\": {\"programs\": %d, \"streams\": %d, \"duration\": %.3f, \"video_bitrate\": %u, "
+           "\"audio_bitrate\": %u, \"video_pes_size\": %zu, \"audio_frames_per_pes\": %d, \"adaptation_rate\": %g, "
+           "\"loss_rate\": %g, \"error_rate\": %g, \"sync_loss_rate\": %g, \"seed\": %u, \"runs\": %d},\n",
+           config.programs, config.streams, config.duration, config.videoBitrate, config.audioBitrate,
+           config.videoPesSize, config.audioFramesPerPes, config.adaptationRate, config.lossRate, config.errorRate,
+           config.syncLossRate, config.seed, runs);
+    printf("  \"stream\": {\"bytes\": %lu, \"packets\": %lu, \"frames\": %lu, \"dropped\": %lu, \"errors\": %lu, "
+           "\"sync_losses\": %lu},\n",
+           stream.bytes, stream.packets, stream.frames, stats.dropped, stats.errors, stats.syncLosses);
+    printf("  \"parallel_matches_serial\": %s,\n", parallelMatches ? "true" : "false");
+    printf("  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        PrintResult(results[i], i + 1 == results.size());
+    }
+    printf("  ]\n}\n");
+
+    Logger::Stop();
+    return parallelMatches ? 0 : 1;
+}
@@ -0,0 +1,270 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#include "ts_generator.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#define TIMESTAMP_MASK    ((1LL << 33) - 1)
+#define TS_PAYLOAD_SIZE   (TS_PACKET_SIZE - 4)
+#define PTS_DELAY         63000 // PTS runs 700 ms ahead of the PCR
+#define VIDEO_FRAME_RATE  25
+#define AUDIO_SAMPLE_RATE 48000
+#define AUDIO_FRAME_SIZE  1024 // samples per ADTS frame
+
+static void WriteHeader(uint8_t *packet, uint16_t pid, bool start, uint8_t adaptationFieldControl, uint8_t counter) {
+    packet[0] = TS_SYNC_BYTE;
+    packet[1] = (start ? 0x40 : 0) | (pid >> 8);
+    packet[2] = pid & 0xff;
+    packet[3] = (adaptationFieldControl << 4) | (counter & 0x0f);
+}
+
+void TsGenerator::Generate(data_t &out) {
+    int programs = std::max(config_.programs, 1);
+    int streams = std::min(std::max(config_.streams, 1), GENERATOR_MAX_PIDS);
+
+    pat_.transport_stream_id = 1;
+    pat_.version_number = 0;
+    pat_.current_next_indicator = 1;
+    pat_.programs.clear();
+    streams_.clear();
+    for (int i = 0; i < programs; i++) {
+        TS_PAT_Program program;
+        program.program_number = i + 1;
+        program.program_map_PID = GENERATOR_PMT_PID + i;
+        program.pmt = std::make_shared<TS_PMT>();
+        program.pmt->program_number = i + 1;
+        program.pmt->version_number = 0;
+        program.pmt->PCR_PID = GENERATOR_STREAM_PID + 16 * i;
+
+        for (int j = 0; j < streams; j++) {
+            Stream stream = {};
+            stream.pid = GENERATOR_STREAM_PID + 16 * i + j;
+            stream.codecId = j == 0 ? STREAM_TYPE_VIDEO_H264 : STREAM_TYPE_AUDIO_AAC;
+            if (j == 0) {
+                stream.interval = config_.videoPesSize ? config_.videoPesSize * 8.0 / config_.videoBitrate
+                                                       : 1.0 / VIDEO_FRAME_RATE;
+            } else {
+                stream.interval = std::max(config_.audioFramesPerPes, 1) * (double)AUDIO_FRAME_SIZE / AUDIO_SAMPLE_RATE;
+            }
+            stream.pcr = j == 0;
+            stream.lastPcr = -1;
+            streams_.push_back(stream);
+
+            TS_PMT_Stream entry;
+            entry.stream_type = stream.codecId;
+            entry.elementary_PID = stream.pid;
+            entry.ES_info_length = 0;
+            program.pmt->streams.push_back(entry);
+        }
+        pat_.programs.push_back(program);
+    }
+    psiCounters_.assign(programs + 1, 0);
+
+    // The mux rate follows from the first PES packet of each stream, adaptation field stuffing allowed for.
+    double rate = (programs + 1) / GENERATOR_PSI_PERIOD;
+    for (auto &stream : streams_) {
+        StartPes(stream);
+        rate += stream.packets / stream.interval;
+    }
+    rate *= GENERATOR_HEADROOM * (1 + config_.adaptationRate * 8 / TS_PAYLOAD_SIZE);
+    slotTime_ = 1 / rate;
+    slots_ = 0;
+
+    // Each packet is due at its share of its PES packet's interval and goes out in the first free slot from then,
+    // earliest first.
+    double lastPsi = -1;
+    while (true) {
+        Stream *stream = nullptr;
+        double due = 0;
+        for (auto &candidate : streams_) {
+            if (candidate.offset == candidate.pes.size()) {
+                StartPes(candidate);
+            }
+            double time = candidate.next + candidate.interval * candidate.sent / candidate.packets;
+            if (!stream || time < due) {
+                stream = &candidate;
+                due = time;
+            }
+        }
+        if (due >= config_.duration) {
+            break;
+        }
+
+        double now = slots_ * slotTime_;
+        if (lastPsi < 0 || now - lastPsi >= GENERATOR_PSI_PERIOD) {
+            WritePsi(out);
+            lastPsi = now;
+        } else if (due > now) {
+            WriteNull(out);
+        } else {
+            WritePacket(*stream, now, out);
+        }
+    }
+}
+
+void TsGenerator::StartPes(Stream &stream) {
+    bool video = stream.codecId == STREAM_TYPE_VIDEO_H264;
+    stream.next = stream.count * stream.interval;
+    stream.randomAccess = !video || stream.count % GENERATOR_GOP == 0;
+
+    TS_PES_Header pes;
+    pes.stream_id = video ? 0xe0 : 0xc0;
+    pes.data_alignment_indicator = 1;
+    pes.DTS = ((int64_t)(stream.next * 90000) + PTS_DELAY) & TIMESTAMP_MASK;
+    pes.PTS = video ? (pes.DTS + 90000 / VIDEO_FRAME_RATE) & TIMESTAMP_MASK : pes.DTS;
+    pes.PTS_DTS_flags = video ? 0x03 : 0x02;
+    size_t headerSize = video ? 19 : 14;
+
+    data_t &data = stream.pes;
+    data.resize(headerSize);
+    if (video) {
+        size_t size = config_.videoPesSize ? config_.videoPesSize : config_.videoBitrate / 8 / VIDEO_FRAME_RATE;
+        FillVideo(data, std::max<size_t>(size, 64), stream.randomAccess);
+    } else {
+        size_t size = (size_t)(config_.audioBitrate / 8.0 * AUDIO_FRAME_SIZE / AUDIO_SAMPLE_RATE);
+        for (int i = 0; i < std::max(config_.audioFramesPerPes, 1); i++) {
+            FillAudio(data, std::max<size_t>(size, 16));
+        }
+    }
+
+    size_t pesLength = data.size() - 6;
+    pes.PES_packet_length = pesLength > 0xffff ? 0 : pesLength;
+    pes.Serialize((uint8_t *)&data[0]);
+
+    stream.offset = 0;
+    stream.sent = 0;
+    stream.packets = (data.size() + TS_PAYLOAD_SIZE - 1) / TS_PAYLOAD_SIZE;
+    stream.count++;
+}
+
+void TsGenerator::FillVideo(data_t &data, size_t size, bool keyframe) {
+    size_t end = data.size() + size;
+    data.append("\x00\x00\x00\x01\x09\xf0", 6); // access unit delimiter
+    if (keyframe) {
+        data.append("\x00\x00\x00\x01\x67", 5); // SPS
+        AppendRandom(data, 16);
+        data.append("\x00\x00\x00\x01\x68", 5); // PPS
+        AppendRandom(data, 4);
+        data.append("\x00\x00\x00\x01\x65", 5); // IDR slice
+    } else {
+        data.append("\x00\x00\x00\x01\x41", 5);
+    }
+    AppendRandom(data, end > data.size() ? end - data.size() : 1);
+}
+
+void TsGenerator::FillAudio(data_t &data, size_t size) {
+    // MPEG-4 AAC LC, 48 kHz, stereo, no CRC, one raw data block.
+    uint8_t header[7] = {0xff, 0xf1, 0x4c, (uint8_t)(0x80 | ((size >> 11) & 0x03)), (uint8_t)((size >> 3) & 0xff),
+                         (uint8_t)(((size & 0x07) << 5) | 0x1f), 0xfc};
+    data.append((const char *)header, sizeof(header));
+    AppendRandom(data, size - sizeof(header));
+}
+
+void TsGenerator::AppendRandom(data_t &data, size_t size) {
+    size_t offset = data.size();
+    data.resize(offset + size);
+    for (size_t i = 0; i < size; i++) {
+        // Zero bytes are left out so payloads never hold a start code.
+        uint8_t byte = random_() & 0xff;
+        data[offset + i] = byte ? byte : 0x80;
+    }
+}
+
+void TsGenerator::WritePsi(data_t &out) {
+    uint8_t packet[TS_PACKET_SIZE];
+    for (size_t i = 0; i < psiCounters_.size(); i++) {
+        uint16_t pid = i == 0 ? (uint16_t)PID_PAT : pat_.programs[i - 1].program_map_PID;
+        WriteHeader(packet, pid, true, 0x01, psiCounters_[i]++);
+        packet[4] = 0; // pointer_field
+        size_t size = i == 0 ? pat_.Serialize(packet + 5, TS_PAYLOAD_SIZE - 1)
+                             : pat_.programs[i - 1].pmt->Serialize(packet + 5, TS_PAYLOAD_SIZE - 1);
+        memset(packet + 5 + size, 0xff, TS_PAYLOAD_SIZE - 1 - size);
+        Emit(packet, out);
+    }
+}
+
+void TsGenerator::WritePacket(Stream &stream, double now, data_t &out) {
+    uint8_t packet[TS_PACKET_SIZE];
+    bool start = stream.offset == 0;
+    stats_.frames += start;
+    // On the last packet of the stream before the period would pass.
+    double spacing = std::max(stream.interval / stream.packets, slotTime_);
+    bool pcr = stream.pcr && (stream.lastPcr < 0 || now + spacing - stream.lastPcr > GENERATOR_PCR_PERIOD);
+    uint8_t flags = (start && stream.randomAccess ? 0x40 : 0) | (pcr ? 0x10 : 0);
+
+    // adaptation_field_length, -1 for no adaptation field.
+    int length = -1;
+    if (flags || Chance(config_.adaptationRate)) {
+        length = 1 + (pcr ? 6 : 0) + (flags ? 0 : random_() % 8);
+    }
+    size_t space = TS_PAYLOAD_SIZE - (length >= 0 ? 1 + length : 0);
+    size_t remaining = stream.pes.size() - stream.offset;
+    if (remaining < space) {
+        // Stuffing fills the last packet; from no adaptation field, a 1-byte one is just the length.
+        length += space - remaining;
+        space = remaining;
+    }
+
+    WriteHeader(packet, stream.pid, start, length >= 0 ? 0x03 : 0x01, stream.continuityCounter++);
+    uint8_t *q = packet + 4;
+    if (length >= 0) {
+        q[0] = length;
+        if (length > 0) {
+            q[1] = flags;
+            memset(q + 2, 0xff, length - 1);
+        }
+        if (pcr) {
+            int64_t clock = llround(now * 27000000);
+            int64_t base = (clock / 300) & TIMESTAMP_MASK;
+            int extension = clock % 300;
+            q[2] = (base >> 25) & 0xff;
+            q[3] = (base >> 17) & 0xff;
+            q[4] = (base >> 9) & 0xff;
+            q[5] = (base >> 1) & 0xff;
+            q[6] = ((base & 0x01) << 7) | 0x7e | (extension >> 8);
+            q[7] = extension & 0xff;
+            stream.lastPcr = now;
+        }
+        q += 1 + length;
+    }
+
+    memcpy(q, stream.pes.data() + stream.offset, space);
+    stream.offset += space;
+    stream.sent++;
+    Emit(packet, out);
+}
+
+void TsGenerator::WriteNull(data_t &out) {
+    uint8_t packet[TS_PACKET_SIZE];
+    WriteHeader(packet, PID_NULL, false, 0x01, 0);
+    memset(packet + 4, 0xff, TS_PAYLOAD_SIZE);
+    Emit(packet, out);
+}
+
+void TsGenerator::Emit(const uint8_t *packet, data_t &out) {
+    slots_++;
+    if (Chance(config_.lossRate)) {
+        stats_.dropped++;
+        return;
+    }
+
+    size_t offset = out.size();
+    out.append((const char *)packet, TS_PACKET_SIZE);
+    stats_.packets++;
+    if (Chance(config_.errorRate)) {
+        out[offset + 4 + random_() % TS_PAYLOAD_SIZE] ^= 1 << (random_() % 8);
+        stats_.errors++;
+    }
+    if (Chance(config_.syncLossRate)) {
+        AppendRandom(out, 1 + random_() % 16);
+        stats_.syncLosses++;
+    }
+}
+
+bool TsGenerator::Chance(double rate) {
+    // No draw at a zero rate, so enabling one kind of corruption leaves the rest of the stream as it was.
+    return rate > 0 && random_() < rate * 4294967296.0;
+}
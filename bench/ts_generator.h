@@ -0,0 +1,98 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#ifndef MPEG_TS_MEDIA_BENCH_TS_GENERATOR_H
+#define MPEG_TS_MEDIA_BENCH_TS_GENERATOR_H
+
+#include "mpeg_ts.h"
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#define GENERATOR_PMT_PID    0x1000 // + program index
+#define GENERATOR_STREAM_PID 0x0100 // + 16 * program index + stream index
+#define GENERATOR_MAX_PIDS   16     // streams per program
+#define GENERATOR_PSI_PERIOD 0.1    // seconds between PAT/PMT
+#define GENERATOR_PCR_PERIOD 0.03   // seconds between PCRs, well under the 0.04 of TR 101 290
+#define GENERATOR_HEADROOM   1.05   // mux rate over that of the streams and tables, the rest is null packets
+#define GENERATOR_GOP        25     // video frames per keyframe
+
+struct TsGeneratorConfig {
+    int programs = 1;                // 1 for an SPTS
+    int streams = 2;                 // per program: an H.264 stream, then AAC ones
+    double duration = 10;            // seconds
+    uint32_t videoBitrate = 8000000; // bit/s
+    uint32_t audioBitrate = 128000;
+    size_t videoPesSize = 0;         // bytes per access unit, 0 for the bitrate at 25 fps
+    int audioFramesPerPes = 1;       // ADTS frames of 1024 samples at 48 kHz
+    double adaptationRate = 0;       // share of payload packets that also carry an adaptation field
+    double lossRate = 0;             // share of packets dropped, which breaks continuity
+    double errorRate = 0;            // share of packets with a byte flipped after the header
+    double syncLossRate = 0;         // share of packets followed by a few stray bytes
+    uint32_t seed = 1;
+};
+
+struct TsGeneratorStats {
+    uint64_t packets = 0; // written, PSI and null packets included
+    uint64_t frames = 0;  // PES packets
+    uint64_t dropped = 0;
+    uint64_t errors = 0;
+    uint64_t syncLosses = 0;
+};
+
+// Deterministic synthetic transport stream for benchmarks: the same config and seed always give the same bytes.
+//
+// Every program has one H.264 stream (access unit delimiter, SPS/PPS and an IDR slice every GENERATOR_GOP frames,
+// other slices in between) carrying the PCR, followed by AAC streams of ADTS frames. Payloads are pseudo-random and
+// hold no start codes. Packets of all streams are interleaved at their bitrates, with the PAT and PMTs repeated
+// every GENERATOR_PSI_PERIOD, and sent at a constant rate: the PCR is the time of the packet's slot, and slots
+// nothing is due for get a null packet.
+class TsGenerator {
+public:
+    explicit TsGenerator(const TsGeneratorConfig &config) : config_(config), random_(config.seed) {}
+
+    // Appends the whole stream to |out|.
+    void Generate(data_t &out);
+
+    const TsGeneratorStats &GetStats() const { return stats_; }
+
+private:
+    struct Stream {
+        uint16_t pid;
+        StreamType codecId;
+        double interval;   // seconds per PES packet
+        double next;       // time of the PES packet being sent
+        uint64_t count;    // PES packets started
+        data_t pes;        // header and payload
+        size_t offset;     // sent so far
+        size_t packets;    // in the PES packet
+        size_t sent;       // packets of it sent
+        bool randomAccess; // of the PES packet being sent
+        uint8_t continuityCounter;
+        bool pcr; // the program's PCR goes out in adaptation fields of this stream
+        double lastPcr;
+    };
+
+    void StartPes(Stream &stream);
+    void FillVideo(data_t &data, size_t size, bool keyframe);
+    void FillAudio(data_t &data, size_t size);
+    void AppendRandom(data_t &data, size_t size);
+    void WritePsi(data_t &out);
+    void WritePacket(Stream &stream, double now, data_t &out);
+    void WriteNull(data_t &out);
+    void Emit(const uint8_t *packet, data_t &out);
+    bool Chance(double rate);
+
+private:
+    TsGeneratorConfig config_;
+    std::mt19937 random_; // fully specified, unlike the distributions, so output is the same everywhere
+    std::vector<Stream> streams_;
+    TS_PAT pat_;
+    std::vector<uint8_t> psiCounters_; // PAT, then the PMTs
+    double slotTime_ = 0;              // seconds per packet at the mux rate
+    uint64_t slots_ = 0;               // packets sent, dropped ones included
+    TsGeneratorStats stats_;
+};
+
+#endif // MPEG_TS_MEDIA_BENCH_TS_GENERATOR_H
@@ -0,0 +1,237 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#include "audio_framer.h"
+#include "logger.h"
+#include "mpeg_ts.h"
+#include <algorithm>
+#include <cstring>
+
+#define TIMESTAMP_MASK ((1LL << 33) - 1)
+
+static const uint32_t adtsSampleRates[13] = {96000, 88200, 64000, 48000, 44100, 32000, 24000,
+                                             22050, 16000, 12000, 11025, 8000,  7350};
+
+// kbit/s by bitrate_index: MPEG-1 layers I, II, III, then MPEG-2/2.5 layer I and layers II/III.
+static const uint16_t mpegBitrates[5][15] = {
+    {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+    {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},
+    {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320},
+    {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+    {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+};
+
+bool AudioFramer::Supports(uint8_t codec) {
+    return codec == STREAM_TYPE_AUDIO_AAC || codec == STREAM_TYPE_AUDIO_MPEG1 || codec == STREAM_TYPE_AUDIO_MPEG2;
+}
+
+bool AudioFramer::ParseHeader(uint8_t codec, const uint8_t *data, Header &header) {
+    if (codec == STREAM_TYPE_AUDIO_AAC) {
+        // syncword, layer '00'
+        if (data[0] != 0xff || (data[1] & 0xf6) != 0xf0) {
+            return false;
+        }
+
+        uint8_t rateIndex = (data[2] >> 2) & 0x0f;
+        header.size = ((data[3] & 0x03) << 11) | (data[4] << 3) | (data[5] >> 5);
+        if (rateIndex >= 13 || header.size < (data[1] & 0x01 ? 7u : 9u)) {
+            return false;
+        }
+        header.sampleRate = adtsSampleRates[rateIndex];
+        header.samples = 1024 * ((data[6] & 0x03) + 1); // number_of_raw_data_blocks_in_frame + 1
+        header.channels = ((data[2] & 0x01) << 2) | (data[3] >> 6);
+        return true;
+    }
+
+    // 11-bit sync; version 3 is MPEG-1, 2 MPEG-2 and 0 MPEG-2.5; layer 3 is layer I and 1 layer III.
+    if (data[0] != 0xff || (data[1] & 0xe0) != 0xe0) {
+        return false;
+    }
+    uint8_t version = (data[1] >> 3) & 0x03;
+    uint8_t layer = (data[1] >> 1) & 0x03;
+    uint8_t bitrateIndex = data[2] >> 4;
+    uint8_t rateIndex = (data[2] >> 2) & 0x03;
+    uint32_t padding = (data[2] >> 1) & 0x01;
+    if (version == 1 || layer == 0 || bitrateIndex == 0 || bitrateIndex == 15 || rateIndex == 3) {
+        return false; // reserved values; free format is not supported
+    }
+
+    static const uint32_t sampleRates[3] = {44100, 48000, 32000};
+    bool mpeg1 = version == 3;
+    header.sampleRate = sampleRates[rateIndex] >> (mpeg1 ? 0 : version == 2 ? 1 : 2);
+    uint32_t bitrate = mpegBitrates[mpeg1 ? 3 - layer : (layer == 3 ? 3 : 4)][bitrateIndex] * 1000;
+    if (layer == 3) {
+        header.samples = 384;
+        header.size = (12 * bitrate / header.sampleRate + padding) * 4;
+    } else if (layer == 2 || mpeg1) {
+        header.samples = 1152;
+        header.size = 144 * bitrate / header.sampleRate + padding;
+    } else {
+        header.samples = 576;
+        header.size = 72 * bitrate / header.sampleRate + padding;
+    }
+    header.channels = (data[3] >> 6) == 3 ? 1 : 2;
+    return header.size >= AUDIO_HEADER_SIZE;
+}
+
+void AudioFramer::Split(uint16_t pid, uint8_t codec, int64_t pts, const struct iovec *iov, size_t iovcnt,
+                        const AudioFrameCallback &callback) {
+    if (!Supports(codec)) {
+        return;
+    }
+
+    iov_ = iov;
+    iovcnt_ = iovcnt;
+    starts_.clear();
+    size_ = 0;
+    for (size_t i = 0; i < iovcnt; i++) {
+        starts_.push_back(size_);
+        size_ += iov[i].iov_len;
+    }
+
+    uint8_t head[AUDIO_HEADER_SIZE];
+    Header header;
+    size_t pos = 0;
+    if (!carry_.empty() && carryHeader_.size && StartsFrame(codec, 0)) {
+        // A PES packet that starts with a frame means the rest of the cut one was lost, unless the bytes that would
+        // complete it are followed by a frame too.
+        if (!StartsFrame(codec, carryHeader_.size - carry_.size())) {
+            TS_LOGW("Audio frame on PID 0x%04x cut short, dropped", pid);
+            carry_.clear();
+        }
+    }
+
+    if (!carry_.empty() && carryHeader_.size == 0) {
+        // The header itself was cut.
+        size_t need = std::min(AUDIO_HEADER_SIZE - carry_.size(), size_);
+        size_t old = carry_.size();
+        carry_.resize(old + need);
+        Gather(0, need, (uint8_t *)&carry_[old]);
+        pos = need;
+        if (carry_.size() < AUDIO_HEADER_SIZE) {
+            return;
+        }
+        if (!ParseHeader(codec, (const uint8_t *)carry_.data(), carryHeader_)) {
+            carry_.clear();
+            pos = 0;
+        }
+    }
+
+    if (!carry_.empty()) {
+        size_t need = std::min(carryHeader_.size - carry_.size(), size_ - pos);
+        size_t old = carry_.size();
+        carry_.resize(old + need);
+        Gather(pos, need, (uint8_t *)&carry_[old]);
+        pos += need;
+        if (carry_.size() < carryHeader_.size) {
+            return;
+        }
+
+        struct iovec span = {&carry_[0], carry_.size()};
+        AudioFrame frame = {pid, codec, carryPts_, carryHeader_.sampleRate, carryHeader_.samples,
+                            carryHeader_.channels, &span, 1};
+        callback(frame);
+        carry_.clear();
+    }
+
+    // The PTS belongs to the first frame that starts in the packet; the others follow at the frame duration.
+    uint64_t samples = 0;
+    uint32_t sampleRate = 0;
+    while (pos < size_) {
+        if (size_ - pos < AUDIO_HEADER_SIZE) {
+            carry_.resize(size_ - pos);
+            Gather(pos, carry_.size(), (uint8_t *)&carry_[0]);
+            carryHeader_.size = 0;
+            carryPts_ = sampleRate ? (pts + (int64_t)(samples * 90000 / sampleRate)) & TIMESTAMP_MASK : pts;
+            return;
+        }
+
+        Gather(pos, AUDIO_HEADER_SIZE, head);
+        if (!ParseHeader(codec, head, header)) {
+            size_t next = FindSync(pos + 1);
+            TS_LOGW("Skipped %zu bytes on PID 0x%04x to the next audio frame", next - pos, pid);
+            pos = next;
+            continue;
+        }
+
+        if (header.sampleRate != sampleRate) {
+            // Keep the time already covered when the rate changes.
+            if (sampleRate) {
+                pts = (pts + (int64_t)(samples * 90000 / sampleRate)) & TIMESTAMP_MASK;
+            }
+            samples = 0;
+            sampleRate = header.sampleRate;
+        }
+        int64_t framePts = (pts + (int64_t)(samples * 90000 / sampleRate)) & TIMESTAMP_MASK;
+        samples += header.samples;
+
+        if (size_ - pos < header.size) {
+            carry_.resize(size_ - pos);
+            Gather(pos, carry_.size(), (uint8_t *)&carry_[0]);
+            carryHeader_ = header;
+            carryPts_ = framePts;
+            return;
+        }
+
+        Slice(pos, header.size);
+        AudioFrame frame = {pid, codec, framePts, header.sampleRate, header.samples, header.channels, spans_.data(),
+                            spans_.size()};
+        callback(frame);
+        pos += header.size;
+    }
+}
+
+bool AudioFramer::StartsFrame(uint8_t codec, size_t pos) const {
+    uint8_t head[AUDIO_HEADER_SIZE];
+    Header header;
+    if (size_ < pos + AUDIO_HEADER_SIZE) {
+        return false;
+    }
+    Gather(pos, AUDIO_HEADER_SIZE, head);
+    // The rate and channels do not change within a stream, which rules out most sync words in frame data.
+    return ParseHeader(codec, head, header) && header.sampleRate == carryHeader_.sampleRate &&
+           header.channels == carryHeader_.channels;
+}
+
+size_t AudioFramer::Span(size_t pos) const {
+    return std::upper_bound(starts_.begin(), starts_.end(), pos) - starts_.begin() - 1;
+}
+
+void AudioFramer::Gather(size_t pos, size_t size, uint8_t *out) const {
+    for (size_t i = Span(pos); size > 0; i++) {
+        size_t offset = pos - starts_[i];
+        size_t n = std::min(size, iov_[i].iov_len - offset);
+        memcpy(out, (const uint8_t *)iov_[i].iov_base + offset, n);
+        out += n;
+        pos += n;
+        size -= n;
+    }
+}
+
+void AudioFramer::Slice(size_t pos, size_t size) {
+    spans_.clear();
+    for (size_t i = Span(pos); size > 0; i++) {
+        size_t offset = pos - starts_[i];
+        size_t n = std::min(size, iov_[i].iov_len - offset);
+        spans_.push_back({(uint8_t *)iov_[i].iov_base + offset, n});
+        pos += n;
+        size -= n;
+    }
+}
+
+size_t AudioFramer::FindSync(size_t pos) const {
+    if (pos >= size_) {
+        return size_;
+    }
+
+    for (size_t i = Span(pos); i < iovcnt_; i++) {
+        size_t offset = pos > starts_[i] ? pos - starts_[i] : 0;
+        const uint8_t *base = (const uint8_t *)iov_[i].iov_base;
+        const void *found = memchr(base + offset, 0xff, iov_[i].iov_len - offset);
+        if (found) {
+            return starts_[i] + ((const uint8_t *)found - base);
+        }
+    }
+    return size_;
+}
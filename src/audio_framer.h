@@ -0,0 +1,77 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#ifndef MPEG_TS_MEDIA_SRC_AUDIO_FRAMER_H
+#define MPEG_TS_MEDIA_SRC_AUDIO_FRAMER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <sys/uio.h>
+#include <vector>
+
+#define AUDIO_HEADER_SIZE 7 // enough for an ADTS header; MPEG audio needs 4
+
+// One audio frame (an ADTS frame, or an MPEG-1/2 audio frame of any layer) out of a PES packet.
+struct AudioFrame {
+    uint16_t pid;
+    uint8_t codecId;         // StreamType
+    int64_t pts;             // 90 kHz: the PES PTS for the first frame, then advanced by the frames before it
+    uint32_t sampleRate;
+    uint16_t samples;        // per channel
+    uint8_t channels;        // 0 when not signalled in the header
+    const struct iovec *iov; // the whole frame, header included, in place unless it began in the last PES packet
+    size_t iovcnt;
+};
+
+// Splits the PES packets of an AAC (ADTS) or MPEG audio stream into frames. Frames are handed out in place; only a
+// frame cut by the end of a PES packet is copied, to be completed from the next one.
+class AudioFramer {
+public:
+    using AudioFrameCallback = std::function<void(const AudioFrame &frame)>;
+
+    // True for the stream types this splits.
+    static bool Supports(uint8_t codec);
+
+    // |iov| is a whole PES payload and |pts| its PTS.
+    void Split(uint16_t pid, uint8_t codec, int64_t pts, const struct iovec *iov, size_t iovcnt,
+               const AudioFrameCallback &callback);
+
+    // Forgets a partial frame, e.g. after a seek.
+    void Reset() { carry_.clear(); }
+
+private:
+    struct Header {
+        size_t size;
+        uint32_t sampleRate;
+        uint16_t samples;
+        uint8_t channels;
+    };
+
+    static bool ParseHeader(uint8_t codec, const uint8_t *data, Header &header);
+
+    // Copies [pos, pos + size) of the payload, which may cross spans, into |out|.
+    void Gather(size_t pos, size_t size, uint8_t *out) const;
+    // Points spans_ at [pos, pos + size) of the payload.
+    void Slice(size_t pos, size_t size);
+    // True if a frame like the cut one starts at |pos|.
+    bool StartsFrame(uint8_t codec, size_t pos) const;
+    // Next 0xff at or after |pos|, or the payload size.
+    size_t FindSync(size_t pos) const;
+    size_t Span(size_t pos) const;
+
+private:
+    const struct iovec *iov_ = nullptr;
+    size_t iovcnt_ = 0;
+    size_t size_ = 0;
+    std::vector<size_t> starts_; // payload offset of each span
+    std::vector<struct iovec> spans_;
+
+    std::string carry_; // start of a frame cut by the end of the last PES packet
+    Header carryHeader_ = {};
+    int64_t carryPts_ = 0;
+};
+
+#endif // MPEG_TS_MEDIA_SRC_AUDIO_FRAMER_H
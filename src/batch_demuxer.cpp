@@ -0,0 +1,273 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#include "batch_demuxer.h"
+#include "logger.h"
+#include "mpeg_ts_demuxer.h"
+#include "ts_sync.h"
+#include "work_stealing_pool.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unordered_map>
+
+// File name extension for the elementary stream of |codec|, or nullptr if it is not written out. |head| is the
+// start of the first frame.
+static const char *OutputSuffix(uint8_t codec, const uint8_t *head) {
+    switch (codec) {
+        case STREAM_TYPE_VIDEO_H264:
+            return "h264";
+        case STREAM_TYPE_VIDEO_HEVC:
+            return "h265";
+        case STREAM_TYPE_AUDIO_AAC:
+            return "aac";
+        case STREAM_TYPE_AUDIO_MPEG1:
+        case STREAM_TYPE_AUDIO_MPEG2: {
+            uint8_t layer = (head[1] >> 1) & 0x03;
+            return layer == 0b11 ? "mp1" : layer == 0b10 ? "mp2" : "mp3";
+        }
+        case STREAM_TYPE_VIDEO_MPEG1:
+            return "mpeg1video";
+        case STREAM_TYPE_VIDEO_MPEG2:
+            return "mpeg2video";
+        default:
+            return nullptr;
+    }
+}
+
+static bool HasSuffix(const std::string &name, const char *suffix) {
+    size_t n = strlen(suffix);
+    return name.size() > n && strcasecmp(name.c_str() + name.size() - n, suffix) == 0;
+}
+
+bool BatchDemuxer::AddInput(const std::string &input) {
+    if (!input.empty() && input[0] == '@') {
+        return AddList(input.substr(1));
+    }
+
+    struct stat st;
+    if (stat(input.c_str(), &st) != 0) {
+        TS_LOGE("Cannot find batch input %s, errno %d", input.c_str(), errno);
+        return false;
+    }
+    return S_ISDIR(st.st_mode) ? AddDirectory(input) : AddFile(input);
+}
+
+bool BatchDemuxer::AddFile(const std::string &path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+        TS_LOGE("Batch input %s is not a regular file", path.c_str());
+        return false;
+    }
+
+    size_t slash = path.find_last_of('/');
+    std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+    size_t dot = name.find_last_of('.');
+    if (dot != std::string::npos && dot > 0) {
+        name.resize(dot);
+    }
+    inputs_.push_back({path, name, (uint64_t)st.st_size});
+    return true;
+}
+
+bool BatchDemuxer::AddDirectory(const std::string &path) {
+    DIR *dir = opendir(path.c_str());
+    if (!dir) {
+        TS_LOGE("Cannot read batch input directory %s, errno %d", path.c_str(), errno);
+        return false;
+    }
+
+    std::vector<std::string> names;
+    while (struct dirent *entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (HasSuffix(name, ".ts") || HasSuffix(name, ".m2ts") || HasSuffix(name, ".mts")) {
+            names.push_back(name);
+        }
+    }
+    closedir(dir);
+
+    std::sort(names.begin(), names.end());
+    size_t count = inputs_.size();
+    for (auto &name : names) {
+        AddFile(path + "/" + name);
+    }
+    return inputs_.size() > count;
+}
+
+bool BatchDemuxer::AddList(const std::string &path) {
+    auto list = FileReader::Open(path);
+    if (!list) {
+        return false;
+    }
+
+    // One file or directory per line; blank lines and lines starting with # are skipped.
+    size_t count = inputs_.size();
+    const char *p = (const char *)list->data;
+    const char *end = p + list->size;
+    while (p < end) {
+        const char *eol = std::find(p, end, '\n');
+        std::string line(p, eol);
+        p = eol + 1;
+
+        while (!line.empty() && isspace((unsigned char)line.back())) {
+            line.pop_back();
+        }
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        struct stat st;
+        if (stat(line.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+            AddDirectory(line);
+        } else {
+            AddFile(line);
+        }
+    }
+    return inputs_.size() > count;
+}
+
+bool BatchDemuxer::Run(const ProgressCallback &progress) {
+    if (mkdir(config_.outputDir.c_str(), 0755) != 0 && errno != EEXIST) {
+        TS_LOGE("Cannot create output directory %s, errno %d", config_.outputDir.c_str(), errno);
+        return false;
+    }
+
+    // Same names are told apart by the order the inputs were added in, which does not depend on scheduling.
+    std::unordered_map<std::string, size_t> names;
+    uint64_t totalBytes = 0;
+    for (auto &input : inputs_) {
+        size_t n = names[input.name]++;
+        if (n > 0) {
+            input.name += "." + std::to_string(n);
+        }
+        totalBytes += input.size;
+    }
+
+    std::vector<size_t> order(inputs_.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [this](size_t a, size_t b) { return inputs_[a].size < inputs_[b].size; });
+
+    files_ = 0;
+    failed_ = 0;
+    bytes_ = 0;
+    auto start = std::chrono::steady_clock::now();
+    auto report = [&]() {
+        BatchProgress state;
+        state.files = files_.load(std::memory_order_relaxed);
+        state.totalFiles = inputs_.size();
+        state.failed = failed_.load(std::memory_order_relaxed);
+        state.bytes = bytes_.load(std::memory_order_relaxed);
+        state.totalBytes = totalBytes;
+        state.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (progress) {
+            progress(state);
+        }
+    };
+
+    {
+        WorkStealingPool pool(config_.threads);
+        TS_LOGI("Batch: %zu files, %lu bytes on %d threads", inputs_.size(), totalBytes, pool.Threads());
+
+        // Dealt smallest first: every thread runs its newest task first, so each starts on its largest file.
+        for (size_t i : order) {
+            pool.Submit([this, i]() {
+                if (!Demux(inputs_[i])) {
+                    failed_.fetch_add(1, std::memory_order_relaxed);
+                }
+                files_.fetch_add(1, std::memory_order_relaxed);
+            });
+        }
+
+        auto next = start + std::chrono::milliseconds(BATCH_PROGRESS_INTERVAL);
+        while (files_.load(std::memory_order_relaxed) < inputs_.size()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            if (std::chrono::steady_clock::now() >= next) {
+                report();
+                next += std::chrono::milliseconds(BATCH_PROGRESS_INTERVAL);
+            }
+        }
+    }
+    report();
+    return failed_ == 0;
+}
+
+bool BatchDemuxer::Demux(const Input &input) {
+    auto file = FileReader::Open(input.path);
+    if (!file) {
+        TS_LOGE("Cannot open %s", input.path.c_str());
+        return false;
+    }
+
+    // Only elementary streams are written, so the demuxer can be the one built for the packet size without the rest.
+    const uint8_t *sync = nullptr;
+    size_t packetSize = TsDetectPacketSize(file->data, std::min(file->size, (size_t)BATCH_CHUNK_SIZE), &sync);
+    size_t start = packetSize ? sync - file->data : 0;
+    auto instance = MpegTsDemuxer::Create(packetSize, DEMUX_FEATURES_ES);
+    MpegTsDemuxer &demuxer = *instance;
+    if (config_.zeroCopy) {
+        demuxer.SetFrameMode(FRAME_MODE_IOVEC);
+    }
+
+    bool ok = true;
+    std::unordered_map<uint16_t, std::shared_ptr<FileWriter>> outputs; // null for streams not written out
+    demuxer.SetDemuxFrameCallback([&](Frame &frame) {
+        auto it = outputs.find(frame.pid);
+        if (it == outputs.end()) {
+            uint8_t head[2] = {};
+            if (!frame.iov.empty()) {
+                for (size_t i = 0, n = 0; i < frame.iov.size() && n < sizeof(head); i++) {
+                    for (size_t j = 0; j < frame.iov[i].iov_len && n < sizeof(head); j++) {
+                        head[n++] = ((const uint8_t *)frame.iov[i].iov_base)[j];
+                    }
+                }
+            } else {
+                memcpy(head, frame.data.data(), std::min(frame.data.size(), sizeof(head)));
+            }
+
+            std::shared_ptr<FileWriter> output;
+            const char *suffix = OutputSuffix(frame.codecId, head);
+            if (suffix) {
+                char pid[16];
+                snprintf(pid, sizeof(pid), "-0x%04x.", frame.pid);
+                output = FileWriter::Open(config_.outputDir + "/" + input.name + pid + suffix, config_.output);
+                ok = ok && output;
+            } else {
+                TS_LOGW("Unsupported stream type 0x%02x on PID 0x%04x", frame.codecId, frame.pid);
+            }
+            it = outputs.emplace(frame.pid, output).first;
+        }
+
+        if (!it->second) {
+            return;
+        }
+        if (!frame.iov.empty()) {
+            ok = it->second->Writev(frame.iov.data(), frame.iov.size()) && ok;
+        } else {
+            ok = it->second->Write((const uint8_t *)frame.data.data(), frame.data.size()) && ok;
+        }
+    });
+
+    bytes_.fetch_add(start, std::memory_order_relaxed);
+    for (size_t offset = start; offset < file->size; offset += BATCH_CHUNK_SIZE) {
+        size_t size = std::min((size_t)BATCH_CHUNK_SIZE, file->size - offset);
+        demuxer.Input(file->data + offset, size);
+        bytes_.fetch_add(size, std::memory_order_relaxed);
+    }
+    demuxer.Flush();
+
+    if (!ok) {
+        TS_LOGE("Writing the outputs of %s failed", input.path.c_str());
+    }
+    return ok;
+}
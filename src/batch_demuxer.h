@@ -0,0 +1,76 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#ifndef MPEG_TS_MEDIA_SRC_BATCH_DEMUXER_H
+#define MPEG_TS_MEDIA_SRC_BATCH_DEMUXER_H
+
+#include "file.h"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#define BATCH_CHUNK_SIZE        (16 * 1024 * 1024) // bytes of a file handed to its demuxer at a time
+#define BATCH_PROGRESS_INTERVAL 1000               // ms between progress reports
+
+struct BatchConfig {
+    int threads = 0; // 0: one per CPU
+    std::string outputDir = ".";
+    bool zeroCopy = false; // write frames straight from the mapped input
+    FileWriterConfig output;
+};
+
+struct BatchProgress {
+    size_t files; // done, failed ones included
+    size_t totalFiles;
+    size_t failed;
+    uint64_t bytes; // input demuxed so far
+    uint64_t totalBytes;
+    double seconds; // since Run() started
+};
+
+// Demuxes many transport stream files at once, each with a demuxer of its own, on a WorkStealingPool. The largest
+// files go first so that the pool does not end on one long file.
+//
+// Elementary streams are written to |outputDir| as <name>-<PID>.<codec>, e.g. seg-00042-0x0100.h264, where <name>
+// is the input file name without its extension. Later inputs with the name of an earlier one get .1, .2... appended,
+// so the same inputs always give the same outputs.
+class BatchDemuxer {
+public:
+    using ProgressCallback = std::function<void(const BatchProgress &progress)>;
+
+    explicit BatchDemuxer(const BatchConfig &config) : config_(config) {}
+
+    // A transport stream file, a directory (its files ending in .ts, .m2ts or .mts, in name order, not recursing) or,
+    // with a leading @, a list of inputs, one per line. Returns false if nothing could be added.
+    bool AddInput(const std::string &input);
+    size_t InputCount() const { return inputs_.size(); }
+
+    // Demuxes everything, calling |progress| on the calling thread every BATCH_PROGRESS_INTERVAL ms and once at the
+    // end. Returns false if any input failed.
+    bool Run(const ProgressCallback &progress);
+
+private:
+    struct Input {
+        std::string path;
+        std::string name; // output file prefix
+        uint64_t size;
+    };
+
+    bool AddFile(const std::string &path);
+    bool AddDirectory(const std::string &path);
+    bool AddList(const std::string &path);
+    bool Demux(const Input &input);
+
+private:
+    BatchConfig config_;
+    std::vector<Input> inputs_;
+
+    std::atomic<size_t> files_{0};
+    std::atomic<size_t> failed_{0};
+    std::atomic<uint64_t> bytes_{0};
+};
+
+#endif // MPEG_TS_MEDIA_SRC_BATCH_DEMUXER_H
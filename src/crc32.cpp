@@ -0,0 +1,48 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#include "crc32.h"
+
+#define CRC32_MPEG2_POLY 0x04C11DB7
+
+struct Crc32Tables {
+    // table[k][b]: CRC contribution of byte b followed by k zero bytes.
+    uint32_t table[8][256];
+
+    Crc32Tables() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i << 24;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc & 0x80000000) ? (crc << 1) ^ CRC32_MPEG2_POLY : crc << 1;
+            }
+            table[0][i] = crc;
+        }
+
+        for (int k = 1; k < 8; k++) {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t prev = table[k - 1][i];
+                table[k][i] = (prev << 8) ^ table[0][prev >> 24];
+            }
+        }
+    }
+};
+
+static const Crc32Tables tables;
+
+uint32_t Crc32Mpeg2(const uint8_t *data, size_t size, uint32_t crc) {
+    const auto &t = tables.table;
+
+    while (size >= 8) {
+        uint32_t hi = crc ^ ((uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 | (uint32_t)data[2] << 8 | data[3]);
+        crc = t[7][hi >> 24] ^ t[6][(hi >> 16) & 0xff] ^ t[5][(hi >> 8) & 0xff] ^ t[4][hi & 0xff] ^ t[3][data[4]] ^
+              t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+        data += 8;
+        size -= 8;
+    }
+
+    while (size-- > 0) {
+        crc = (crc << 8) ^ t[0][(crc >> 24) ^ *data++];
+    }
+    return crc;
+}
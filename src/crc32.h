@@ -0,0 +1,18 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#ifndef MPEG_TS_MEDIA_SRC_CRC32_H
+#define MPEG_TS_MEDIA_SRC_CRC32_H
+
+#include <cstddef>
+#include <cstdint>
+
+#define CRC32_MPEG2_INIT 0xffffffff
+
+// CRC-32/MPEG-2 as used by PSI sections (ISO/IEC 13818-1 Annex A): polynomial 0x04C11DB7, MSB first, no final
+// XOR. Run over a whole section, CRC_32 field included, it yields 0 when the section is intact.
+// Slicing-by-8: eight bytes per step through eight 256-entry tables.
+uint32_t Crc32Mpeg2(const uint8_t *data, size_t size, uint32_t crc = CRC32_MPEG2_INIT);
+
+#endif // MPEG_TS_MEDIA_SRC_CRC32_H
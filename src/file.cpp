@@ -1,98 +1,357 @@
-//
-// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
-//
-
-#include "file.h"
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <unistd.h>
-
-std::shared_ptr<FileReader> FileReader::Open(const std::string &filename) {
-    int fd = open(filename.c_str(), O_RDWR);
-    if (fd < 0) {
-        perror("open");
-        return nullptr;
-    }
-
-    struct stat sb {};
-    if (fstat(fd, &sb) == -1) {
-        perror("fstat");
-        return nullptr;
-    }
-
-    void *memAddr = mmap(nullptr, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
-    if (memAddr == MAP_FAILED) {
-        perror("mmap");
-        return nullptr;
-    }
-
-    madvise(memAddr, sb.st_size, MADV_SEQUENTIAL);
-
-    return std::shared_ptr<FileReader>(new FileReader((uint8_t *)memAddr, sb.st_size, fd));
-}
-
-void FileReader::Close() {
-    if (data) {
-        munmap(data, size);
-        close(fd_);
-    }
-    data = nullptr;
-    size = 0;
-    fd_  = 0;
-}
-
-FileReader::~FileReader() {
-    Close();
-}
-
-std::shared_ptr<FileWriter> FileWriter::Open(const std::string &filename) {
-    FILE *fd = fopen(filename.c_str(), "wb");
-    if (!fd) {
-        return nullptr;
-    }
-
-    return std::shared_ptr<FileWriter>(new FileWriter(fd));
-}
-
-bool FileWriter::Write(const uint8_t *data, size_t size) {
-    if (fd_) {
-        size_t ret = fwrite(data, 1, size, fd_);
-        if (ret != size) {
-            totalSize_ += ret;
-            if (totalSize_ >= 4096) {
-                Flush();
-            }
-            return true;
-        }
-    }
-
-    return false;
-}
-
-bool FileWriter::Write(const char *data, size_t size) {
-    return Write((const uint8_t *)data, size);
-}
-
-bool FileWriter::Write(const std::string &str) {
-    return Write(str.c_str(), str.size());
-}
-
-void FileWriter::Flush() {
-    if (fd_) {
-        fflush(fd_);
-    }
-    totalSize_ = 0;
-}
-
-void FileWriter::Close() {
-    Flush();
-    if (fd_) {
-        fclose(fd_);
-        fd_ = nullptr;
-    }
-}
-
-FileWriter::~FileWriter() {
-    Close();
-}
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#include "file.h"
+#include "logger.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+std::shared_ptr<FileReader> FileReader::Open(const std::string &filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        return nullptr;
+    }
+
+    struct stat sb {};
+    if (fstat(fd, &sb) == -1) {
+        perror("fstat");
+        close(fd);
+        return nullptr;
+    }
+
+    if (!S_ISREG(sb.st_mode) || sb.st_size == 0) {
+        fprintf(stderr, "%s: not a regular file or empty, cannot be mapped\n", filename.c_str());
+        close(fd);
+        return nullptr;
+    }
+
+    void *memAddr = mmap(nullptr, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (memAddr == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return nullptr;
+    }
+
+    madvise(memAddr, sb.st_size, MADV_SEQUENTIAL);
+
+    return std::shared_ptr<FileReader>(new FileReader((uint8_t *)memAddr, sb.st_size, fd));
+}
+
+void FileReader::Close() {
+    if (data) {
+        munmap(data, size);
+        close(fd_);
+    }
+    data = nullptr;
+    size = 0;
+    fd_  = 0;
+}
+
+FileReader::~FileReader() {
+    Close();
+}
+
+std::shared_ptr<FileWriter> FileWriter::Open(const std::string &filename) {
+    FILE *fd = fopen(filename.c_str(), "wb");
+    if (!fd) {
+        return nullptr;
+    }
+
+    return std::shared_ptr<FileWriter>(new FileWriter(fd));
+}
+
+std::shared_ptr<FileWriter> FileWriter::Open(const std::string &filename, const FileWriterConfig &config) {
+    if (!config.async) {
+        return Open(filename);
+    }
+
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    int fd = open(filename.c_str(), flags | (config.direct ? O_DIRECT : 0), 0644);
+    if (fd < 0 && config.direct && errno == EINVAL) {
+        TS_LOGW("O_DIRECT is not supported here, writing through the page cache");
+        fd = open(filename.c_str(), flags, 0644);
+    }
+    if (fd < 0) {
+        perror("open");
+        return nullptr;
+    }
+
+    return std::shared_ptr<FileWriter>(new FileWriter(fd, config));
+}
+
+FileWriter::FileWriter(int fd, const FileWriterConfig &config) : rawFd_(fd), flusher_(config.flusher) {
+    if (!flusher_) {
+        flusher_ = std::make_shared<FileFlusher>();
+    }
+
+    // Whole buffers keep O_DIRECT writes aligned; only the last one of the file may be short.
+    bufferSize_ = std::max(config.bufferSize, (size_t)FILE_WRITER_ALIGNMENT);
+    bufferSize_ = (bufferSize_ + FILE_WRITER_ALIGNMENT - 1) / FILE_WRITER_ALIGNMENT * FILE_WRITER_ALIGNMENT;
+    size_t count = std::max(config.bufferCount, (size_t)2);
+    for (size_t i = 0; i < count; i++) {
+        void *buffer = nullptr;
+        if (posix_memalign(&buffer, FILE_WRITER_ALIGNMENT, bufferSize_) != 0) {
+            break;
+        }
+        buffers_.push_back((uint8_t *)buffer);
+    }
+    free_ = buffers_;
+    if (!free_.empty()) {
+        current_ = free_.back();
+        free_.pop_back();
+    }
+
+    direct_ = config.direct && (fcntl(fd, F_GETFL) & O_DIRECT);
+    preallocate_ = config.preallocate;
+}
+
+bool FileWriter::Write(const uint8_t *data, size_t size) {
+    if (rawFd_ >= 0) {
+        return WriteAsync(data, size);
+    }
+    if (fd_) {
+        return fwrite(data, 1, size, fd_) == size;
+    }
+
+    return false;
+}
+
+bool FileWriter::WriteAsync(const uint8_t *data, size_t size) {
+    while (size > 0 && current_) {
+        size_t n = std::min(size, bufferSize_ - used_);
+        memcpy(current_ + used_, data, n);
+        used_ += n;
+        data += n;
+        size -= n;
+        if (used_ == bufferSize_) {
+            Submit();
+        }
+    }
+
+    return current_ && !failed_.load(std::memory_order_relaxed);
+}
+
+void FileWriter::Submit() {
+    flusher_->Queue(this, current_, used_);
+    current_ = nullptr;
+    used_ = 0;
+
+    std::unique_lock<std::mutex> lock(freeMutex_);
+    if (free_.empty()) {
+        // Storage is behind by every buffer there is: this is the backpressure.
+        auto start = std::chrono::steady_clock::now();
+        freeCv_.wait(lock, [this]() { return !free_.empty(); });
+        auto waited = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+
+        std::lock_guard<std::mutex> statsLock(flusher_->mutex_);
+        flusher_->stats_.stalls++;
+        flusher_->stats_.stallTime += waited.count();
+    }
+    current_ = free_.back();
+    free_.pop_back();
+}
+
+void FileWriter::WriteBuffer(const uint8_t *buffer, size_t size) {
+    if (failed_.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    if (preallocate_ > 0 && written_ + size > allocated_) {
+        size_t length = std::max(preallocate_, (size_t)(written_ + size - allocated_));
+        if (fallocate(rawFd_, FALLOC_FL_KEEP_SIZE, allocated_, length) == 0) {
+            allocated_ += length;
+        } else {
+            preallocate_ = 0;
+        }
+    }
+
+    // A short last buffer cannot go through O_DIRECT, and neither can anything after it.
+    if (direct_ && size % FILE_WRITER_ALIGNMENT != 0) {
+        fcntl(rawFd_, F_SETFL, fcntl(rawFd_, F_GETFL) & ~O_DIRECT);
+        direct_ = false;
+    }
+
+    while (size > 0) {
+        ssize_t n = write(rawFd_, buffer, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            failed_.store(true, std::memory_order_relaxed);
+            return;
+        }
+        buffer += n;
+        size -= n;
+        written_ += n;
+    }
+}
+
+void FileWriter::Release(uint8_t *buffer) {
+    std::lock_guard<std::mutex> lock(freeMutex_);
+    free_.push_back(buffer);
+    freeCv_.notify_one();
+}
+
+bool FileWriter::Write(const char *data, size_t size) {
+    return Write((const uint8_t *)data, size);
+}
+
+bool FileWriter::Write(const std::string &str) {
+    return Write(str.c_str(), str.size());
+}
+
+bool FileWriter::Writev(const struct iovec *iov, size_t iovcnt) {
+    if (rawFd_ >= 0) {
+        bool ok = true;
+        for (size_t i = 0; i < iovcnt; i++) {
+            ok = WriteAsync((const uint8_t *)iov[i].iov_base, iov[i].iov_len) && ok;
+        }
+        return ok;
+    }
+    if (!fd_) {
+        return false;
+    }
+
+    // Anything buffered by stdio has to reach the file first.
+    fflush(fd_);
+    int fd = fileno(fd_);
+
+    while (iovcnt > 0) {
+        ssize_t ret = writev(fd, iov, iovcnt < IOV_MAX ? (int)iovcnt : IOV_MAX);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("writev");
+            return false;
+        }
+
+        size_t done = ret;
+        while (done > 0 && done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (done > 0) {
+            // Finish the partially written span before going on with the next batch.
+            const uint8_t *p = (const uint8_t *)iov->iov_base + done;
+            size_t left = iov->iov_len - done;
+            while (left > 0) {
+                ssize_t n = write(fd, p, left);
+                if (n < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    perror("write");
+                    return false;
+                }
+                p += n;
+                left -= n;
+            }
+            iov++;
+            iovcnt--;
+        }
+    }
+
+    return true;
+}
+
+void FileWriter::Flush() {
+    if (fd_) {
+        fflush(fd_);
+    }
+
+    if (rawFd_ >= 0 && current_) {
+        if (used_ > 0) {
+            Submit();
+        }
+        std::unique_lock<std::mutex> lock(freeMutex_);
+        freeCv_.wait(lock, [this]() { return free_.size() + 1 == buffers_.size(); });
+    }
+}
+
+void FileWriter::Close() {
+    Flush();
+    if (fd_) {
+        fclose(fd_);
+        fd_ = nullptr;
+    }
+
+    if (rawFd_ >= 0) {
+        close(rawFd_);
+        rawFd_ = -1;
+        for (auto buffer : buffers_) {
+            free(buffer);
+        }
+        buffers_.clear();
+        free_.clear();
+        current_ = nullptr;
+        flusher_.reset();
+    }
+}
+
+FileWriter::~FileWriter() {
+    Close();
+}
+
+FileFlusher::FileFlusher() {
+    thread_ = std::thread(&FileFlusher::Run, this);
+}
+
+FileFlusher::~FileFlusher() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+}
+
+FileWriterStats FileFlusher::GetStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+void FileFlusher::Queue(FileWriter *writer, uint8_t *buffer, size_t size) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_.push_back({writer, buffer, size});
+        stats_.buffers++;
+        stats_.peakQueued = std::max(stats_.peakQueued, jobs_.size());
+    }
+    cv_.notify_one();
+}
+
+void FileFlusher::Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        cv_.wait(lock, [this]() { return stop_ || !jobs_.empty(); });
+        if (jobs_.empty()) {
+            return;
+        }
+
+        Job job = jobs_.front();
+        jobs_.pop_front();
+        lock.unlock();
+        job.writer->WriteBuffer(job.buffer, job.size);
+        lock.lock();
+        // Counted before the buffer goes back, so the figures are complete once the writer has flushed.
+        stats_.bytes += job.size;
+        lock.unlock();
+        job.writer->Release(job.buffer);
+        lock.lock();
+    }
+}
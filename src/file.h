@@ -1,51 +1,147 @@
-//
-// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
-//
-
-#ifndef FLV_MEDIA_FILE_H
-#define FLV_MEDIA_FILE_H
-
-#include <cstddef>
-#include <memory>
-#include <stdint.h>
-#include <string>
-
-class FileReader {
-public:
-    static std::shared_ptr<FileReader> Open(const std::string &filename);
-    void Close();
-
-    ~FileReader();
-
-private:
-    FileReader(uint8_t *data, size_t size, int fd) : data(data), size(size), fd_(fd) {}
-    FileReader() = default;
-
-public:
-    uint8_t *data = nullptr;
-    size_t size = 0;
-
-private:
-    int fd_ = 0;
-};
-
-class FileWriter {
-public:
-    static std::shared_ptr<FileWriter> Open(const std::string &filename);
-    bool Write(const uint8_t *data, size_t size);
-    bool Write(const char *data, size_t size);
-    bool Write(const std::string &str);
-    void Flush();
-    void Close();
-
-    ~FileWriter();
-
-private:
-    explicit FileWriter(FILE *fd) : fd_(fd) {}
-
-private:
-    FILE *fd_ = nullptr;
-    size_t totalSize_ = 0;
-};
-
-#endif // FLV_MEDIA_FILE_H
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#ifndef FLV_MEDIA_FILE_H
+#define FLV_MEDIA_FILE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <sys/uio.h>
+#include <thread>
+#include <vector>
+
+class FileReader {
+public:
+    static std::shared_ptr<FileReader> Open(const std::string &filename);
+    void Close();
+    int Fd() const { return fd_; }
+
+    ~FileReader();
+
+private:
+    FileReader(uint8_t *data, size_t size, int fd) : data(data), size(size), fd_(fd) {}
+    FileReader() = default;
+
+public:
+    uint8_t *data = nullptr;
+    size_t size = 0;
+
+private:
+    int fd_ = 0;
+};
+
+#define FILE_WRITER_BUFFER_SIZE  (4 * 1024 * 1024) // async mode: bytes per buffer
+#define FILE_WRITER_BUFFER_COUNT 4                 // async mode: buffers per file, one filling while others wait
+#define FILE_WRITER_ALIGNMENT    4096              // buffer and O_DIRECT alignment
+
+struct FileWriterStats {
+    uint64_t bytes = 0;     // written to storage
+    uint64_t buffers = 0;   // handed to the thread
+    uint64_t stalls = 0;    // writes that found every buffer queued and had to wait
+    uint64_t stallTime = 0; // microseconds spent waiting
+    size_t peakQueued = 0;  // most buffers waiting at once
+};
+
+class FileWriter;
+
+// Background thread that writes the full buffers of one or more async FileWriters to storage, in the order they
+// were queued. The writers keep it alive; it stops once the last of them is closed.
+class FileFlusher {
+public:
+    FileFlusher();
+    ~FileFlusher();
+
+    FileWriterStats GetStats();
+
+private:
+    friend class FileWriter;
+
+    struct Job {
+        FileWriter *writer;
+        uint8_t *buffer;
+        size_t size;
+    };
+
+    void Queue(FileWriter *writer, uint8_t *buffer, size_t size);
+    void Run();
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Job> jobs_;
+    bool stop_ = false;
+    FileWriterStats stats_;
+    std::thread thread_;
+};
+
+struct FileWriterConfig {
+    bool async = false;                   // hand full buffers to a FileFlusher instead of writing on the caller
+    std::shared_ptr<FileFlusher> flusher; // shared by several files; each file gets a thread of its own if null
+    size_t bufferSize = FILE_WRITER_BUFFER_SIZE;
+    size_t bufferCount = FILE_WRITER_BUFFER_COUNT;
+    bool direct = false;    // O_DIRECT, bypassing the page cache where the file system allows it
+    size_t preallocate = 0; // fallocate this many bytes at a time ahead of the data, 0 for none
+};
+
+// Writes through stdio, or in async mode copies into large aligned buffers that a FileFlusher writes out. Writes
+// in async mode only block once every buffer is queued, which FileWriterStats records as a stall. Neither mode is
+// thread-safe.
+class FileWriter {
+public:
+    static std::shared_ptr<FileWriter> Open(const std::string &filename);
+    static std::shared_ptr<FileWriter> Open(const std::string &filename, const FileWriterConfig &config);
+    bool Write(const uint8_t *data, size_t size);
+    bool Write(const char *data, size_t size);
+    bool Write(const std::string &str);
+    bool Writev(const struct iovec *iov, size_t iovcnt);
+    // In async mode, returns once everything written so far is on its way to storage.
+    void Flush();
+    // Descriptor for writing past the buffers (copy_file_range, splice); call Flush() before using it.
+    int Fd() const { return fd_ ? fileno(fd_) : rawFd_; }
+    void Close();
+
+    ~FileWriter();
+
+private:
+    friend class FileFlusher;
+
+    explicit FileWriter(FILE *fd) : fd_(fd) {}
+    FileWriter(int fd, const FileWriterConfig &config);
+
+    bool WriteAsync(const uint8_t *data, size_t size);
+    void Submit();
+    // Called on the flusher thread.
+    void WriteBuffer(const uint8_t *buffer, size_t size);
+    void Release(uint8_t *buffer);
+
+private:
+    FILE *fd_ = nullptr;
+
+    // Async mode.
+    int rawFd_ = -1;
+    std::shared_ptr<FileFlusher> flusher_;
+    size_t bufferSize_ = 0;
+    std::vector<uint8_t *> buffers_; // all of them, for freeing
+    std::vector<uint8_t *> free_;
+    std::mutex freeMutex_;
+    std::condition_variable freeCv_;
+    uint8_t *current_ = nullptr;
+    size_t used_ = 0;
+    std::atomic<bool> failed_{false};
+
+    // Only touched on the flusher thread.
+    bool direct_ = false;
+    size_t preallocate_ = 0;
+    uint64_t written_ = 0;
+    uint64_t allocated_ = 0;
+};
+
+#endif // FLV_MEDIA_FILE_H
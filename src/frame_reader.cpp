@@ -0,0 +1,132 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#include "frame_reader.h"
+#include "logger.h"
+#include <algorithm>
+
+FrameReader::~FrameReader() {
+    if (thread_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        consumed_.notify_one();
+        thread_.join();
+    }
+}
+
+bool FrameReader::NextFrame(Frame &frame) {
+    if (!started_) {
+        started_ = true;
+        demuxer_.SetFrameMode(FRAME_MODE_COPY);
+        demuxer_.SetFrameSink(&sink_);
+        if (depth_ > 0) {
+            thread_ = std::thread(&FrameReader::Run, this);
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (depth_ == 0) {
+        // The sink takes the lock as frames complete.
+        while (ready_.empty() && !end_) {
+            lock.unlock();
+            bool more = Step();
+            lock.lock();
+            end_ = !more;
+        }
+    } else if (ready_.empty() && !end_) {
+        consumerWaiting_ = true;
+        produced_.wait(lock, [this]() { return !ready_.empty() || end_; });
+        consumerWaiting_ = false;
+    }
+    if (ready_.empty()) {
+        return false;
+    }
+
+    frame.Swap(*ready_.front());
+    spare_.push_back(std::move(ready_.front()));
+    ready_.pop_front();
+    if (producerWaiting_) {
+        consumed_.notify_one();
+    }
+    return true;
+}
+
+void FrameReader::Sink::OnFrame(Frame &frame) {
+    std::unique_ptr<Frame> slot;
+    {
+        std::lock_guard<std::mutex> lock(reader_->mutex_);
+        if (!reader_->spare_.empty()) {
+            slot = std::move(reader_->spare_.back());
+            reader_->spare_.pop_back();
+        }
+    }
+    if (!slot) {
+        slot = std::make_unique<Frame>();
+    }
+
+    // The stream carries on with the buffers the caller gave back, cleared by the demuxer.
+    slot->Swap(frame);
+    std::unique_lock<std::mutex> lock(reader_->mutex_);
+    if (reader_->depth_ > 0 && !reader_->stop_ && reader_->ready_.size() >= reader_->depth_) {
+        // One step can complete several frames; the demuxer waits in the middle of it rather than go past depth_.
+        reader_->producerWaiting_ = true;
+        reader_->consumed_.wait(lock, [this]() { return reader_->stop_ || reader_->ready_.size() < reader_->depth_; });
+        reader_->producerWaiting_ = false;
+    }
+    reader_->ready_.push_back(std::move(slot));
+    if (reader_->consumerWaiting_) {
+        reader_->produced_.notify_one();
+    }
+}
+
+bool FrameReader::Step() {
+    while (span_ == spanCount_) {
+        int count = source_->Read(spans_, FRAME_READER_SPANS);
+        if (count <= 0) {
+            if (count < 0) {
+                TS_LOGE("Reading the input failed");
+            }
+            demuxer_.Flush();
+            return false;
+        }
+        spanCount_ = count;
+        span_ = 0;
+        offset_ = 0;
+    }
+
+    const struct iovec &span = spans_[span_];
+    size_t size = std::min(span.iov_len - offset_, (size_t)FRAME_READER_STEP);
+    demuxer_.Input((const uint8_t *)span.iov_base + offset_, size);
+    offset_ += size;
+    if (offset_ == span.iov_len) {
+        span_++;
+        offset_ = 0;
+    }
+    return true;
+}
+
+void FrameReader::Run() {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (!stop_ && ready_.size() >= depth_) {
+                producerWaiting_ = true;
+                consumed_.wait(lock, [this]() { return stop_ || ready_.size() < depth_; });
+                producerWaiting_ = false;
+            }
+            if (stop_) {
+                return;
+            }
+        }
+
+        if (!Step()) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            end_ = true;
+            produced_.notify_one();
+            return;
+        }
+    }
+}
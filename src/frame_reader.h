@@ -0,0 +1,80 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#ifndef MPEG_TS_MEDIA_SRC_FRAME_READER_H
+#define MPEG_TS_MEDIA_SRC_FRAME_READER_H
+
+#include "input_source.h"
+#include "mpeg_ts_demuxer.h"
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define FRAME_READER_STEP  (64 * TS_PACKET_SIZE) // bytes demuxed at a time while looking for the next frame
+#define FRAME_READER_SPANS 64                    // spans asked of the source per Read()
+
+// Pull-style demuxing: NextFrame() hands out one frame at a time, demuxing the source only as far as the next
+// complete one. With a read-ahead depth, a thread of the reader's own keeps up to that many frames ready, never more:
+// it stops in the middle of a step that completes more, so the caller's decoding or writing overlaps with demuxing
+// without a queue of its own.
+class FrameReader {
+public:
+    // |depth| 0: no thread, everything happens in NextFrame().
+    explicit FrameReader(std::shared_ptr<InputSource> source, size_t depth = 0)
+        : source_(std::move(source)), depth_(depth), sink_(this) {}
+    ~FrameReader();
+
+    // For the demuxer's options and its other callbacks, set before the first NextFrame(). Frames are assembled in
+    // Frame::data and delivered only through NextFrame(); pipelined mode is not supported. Callbacks run on the
+    // read-ahead thread when there is one.
+    MpegTsDemuxer &Demuxer() { return demuxer_; }
+
+    // Swaps the next frame into |frame|, which owns its data: it may be moved out. Buffers left in |frame| are
+    // reused for later frames. Returns false at the end of the source or on a read error.
+    bool NextFrame(Frame &frame);
+
+private:
+    class Sink : public FrameSink<Sink> {
+    public:
+        explicit Sink(FrameReader *reader) : reader_(reader) {}
+        // Waits on the read-ahead thread while depth_ frames are ready.
+        void OnFrame(Frame &frame);
+
+    private:
+        FrameReader *reader_;
+    };
+
+    // Feeds the demuxer up to FRAME_READER_STEP bytes, flushing it at the end. Returns false once there is no more.
+    bool Step();
+    void Run();
+
+private:
+    std::shared_ptr<InputSource> source_;
+    size_t depth_;
+    MpegTsDemuxer demuxer_;
+    Sink sink_;
+    bool started_ = false;
+
+    // Read position, in the spans of the last Read(), which stay valid until the next one.
+    struct iovec spans_[FRAME_READER_SPANS];
+    int spanCount_ = 0;
+    int span_ = 0;
+    size_t offset_ = 0;
+
+    std::mutex mutex_;
+    std::condition_variable produced_;
+    std::condition_variable consumed_;
+    std::deque<std::unique_ptr<Frame>> ready_;
+    std::vector<std::unique_ptr<Frame>> spare_; // handed back by NextFrame(), with the caller's old buffers
+    bool end_ = false;
+    bool stop_ = false;
+    bool consumerWaiting_ = false; // notifications only go to a side that sleeps
+    bool producerWaiting_ = false;
+    std::thread thread_;
+};
+
+#endif // MPEG_TS_MEDIA_SRC_FRAME_READER_H
@@ -0,0 +1,328 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#include "input_source.h"
+#include "logger.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define READ_POLL_INTERVAL 100 // ms, how often a blocked reader checks for shutdown
+
+std::shared_ptr<InputSource> InputSource::Open(const std::string &uri, int timeoutMs) {
+    if (uri == "-") {
+        return ReadSource::Open(uri);
+    }
+
+    bool rtp = uri.compare(0, 6, "rtp://") == 0;
+    if (rtp || uri.compare(0, 6, "udp://") == 0) {
+        std::string hostPort = uri.substr(6);
+        size_t colon = hostPort.rfind(':');
+        if (colon == std::string::npos) {
+            fprintf(stderr, "Missing port in %s\n", uri.c_str());
+            return nullptr;
+        }
+
+        int port = atoi(hostPort.c_str() + colon + 1);
+        if (port <= 0 || port > 65535) {
+            fprintf(stderr, "Invalid port in %s\n", uri.c_str());
+            return nullptr;
+        }
+
+        std::shared_ptr<InputSource> source = UdpSource::Open(hostPort.substr(0, colon), (uint16_t)port, timeoutMs);
+        if (source && rtp) {
+            source = std::make_shared<RtpSource>(source);
+        }
+        return source;
+    }
+
+    struct stat sb {};
+    if (stat(uri.c_str(), &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+        return FileSource::Open(uri);
+    }
+    return ReadSource::Open(uri);
+}
+
+std::shared_ptr<FileSource> FileSource::Open(const std::string &filename) {
+    auto file = FileReader::Open(filename);
+    if (!file) {
+        return nullptr;
+    }
+
+    return std::shared_ptr<FileSource>(new FileSource(std::move(file)));
+}
+
+int FileSource::Read(struct iovec *spans, int max) {
+    if (max <= 0 || offset_ >= file_->size) {
+        return 0;
+    }
+
+    size_t size = std::min((size_t)INPUT_BATCH_SIZE, file_->size - offset_);
+    spans[0].iov_base = file_->data + offset_;
+    spans[0].iov_len = size;
+    offset_ += size;
+    return 1;
+}
+
+std::shared_ptr<ReadSource> ReadSource::Open(const std::string &filename) {
+    if (filename == "-") {
+        return std::make_shared<ReadSource>(STDIN_FILENO);
+    }
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        return nullptr;
+    }
+
+    return std::make_shared<ReadSource>(fd, true);
+}
+
+ReadSource::ReadSource(int fd, bool owned) : fd_(fd), owned_(owned), ring_(READ_BLOCK_COUNT) {
+    thread_ = std::thread([this]() { Run(); });
+}
+
+ReadSource::~ReadSource() {
+    stop_.store(true);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cond_.notify_all();
+    }
+    thread_.join();
+
+    if (owned_) {
+        close(fd_);
+    }
+}
+
+void ReadSource::Run() {
+    while (!stop_.load()) {
+        Block *block = ring_.Back();
+        if (!block) {
+            // The demuxer is behind; the pipe fills up and the writer waits.
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait(lock, [this]() { return stop_.load() || ring_.Back(); });
+            continue;
+        }
+
+        struct pollfd pfd = {fd_, POLLIN, 0};
+        int ready = poll(&pfd, 1, READ_POLL_INTERVAL);
+        if (ready == 0 || (ready < 0 && errno == EINTR)) {
+            continue;
+        }
+
+        ssize_t n = ready < 0 ? -1 : read(fd_, block->data, READ_BLOCK_SIZE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            if (n < 0) {
+                perror("read");
+                error_.store(true);
+            }
+            eof_.store(true);
+        } else {
+            block->size = n;
+            ring_.Push();
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        cond_.notify_all();
+        if (n <= 0) {
+            return;
+        }
+    }
+}
+
+int ReadSource::Read(struct iovec *spans, int max) {
+    if (popPending_) {
+        ring_.Pop();
+        popPending_ = false;
+        std::lock_guard<std::mutex> lock(mutex_);
+        cond_.notify_all();
+    }
+
+    if (max <= 0) {
+        return 0;
+    }
+
+    Block *block = ring_.Front();
+    if (!block) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [this, &block]() { return (block = ring_.Front()) || eof_.load(); });
+    }
+
+    if (!block) {
+        // The reader pushes its last block before it sets |eof_|.
+        block = ring_.Front();
+        if (!block) {
+            return error_.load() ? -1 : 0;
+        }
+    }
+
+    spans[0].iov_base = block->data;
+    spans[0].iov_len = block->size;
+    popPending_ = true;
+    return 1;
+}
+
+std::shared_ptr<UdpSource> UdpSource::Open(const std::string &address, uint16_t port, int timeoutMs) {
+    struct sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (!address.empty() && inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid IPv4 address %s\n", address.c_str());
+        return nullptr;
+    }
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return nullptr;
+    }
+
+    bool multicast = IN_MULTICAST(ntohl(addr.sin_addr.s_addr));
+    int on = 1;
+    int rcvbuf = UDP_RECV_BUFFER;
+    if (multicast) {
+        // Several receivers on one host may join the same group.
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    if (timeoutMs > 0) {
+        struct timeval tv = {timeoutMs / 1000, (timeoutMs % 1000) * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+
+    // Binding to the group address keeps out other groups sent to the same port.
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        close(fd);
+        return nullptr;
+    }
+
+    if (multicast) {
+        struct ip_mreq mreq {};
+        mreq.imr_multiaddr = addr.sin_addr;
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+            perror("IP_ADD_MEMBERSHIP");
+            close(fd);
+            return nullptr;
+        }
+    }
+
+    TS_LOGI("Receiving on UDP port %u%s", port, multicast ? ", multicast group joined" : "");
+    return std::shared_ptr<UdpSource>(new UdpSource(fd));
+}
+
+UdpSource::UdpSource(int fd) : fd_(fd), buffer_(new uint8_t[UDP_BATCH_COUNT * UDP_DATAGRAM_SIZE]) {
+    for (int i = 0; i < UDP_BATCH_COUNT; i++) {
+        iov_[i].iov_base = buffer_.get() + i * UDP_DATAGRAM_SIZE;
+        iov_[i].iov_len = UDP_DATAGRAM_SIZE;
+        msgs_[i] = {};
+        msgs_[i].msg_hdr.msg_iov = &iov_[i];
+        msgs_[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+UdpSource::~UdpSource() {
+    close(fd_);
+}
+
+int UdpSource::Read(struct iovec *spans, int max) {
+    int count = std::min(max, UDP_BATCH_COUNT);
+    if (count <= 0) {
+        return 0;
+    }
+
+    int n;
+    do {
+        // Wait for the first datagram only, then take whatever else is already queued.
+        n = recvmmsg(fd_, msgs_, count, MSG_WAITFORONE, nullptr);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            TS_LOGI("No data received before the timeout, stopping");
+            return 0;
+        }
+        perror("recvmmsg");
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (msgs_[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            TS_LOGW("Datagram larger than %d bytes truncated", UDP_DATAGRAM_SIZE);
+        }
+        spans[i].iov_base = iov_[i].iov_base;
+        spans[i].iov_len = msgs_[i].msg_len;
+    }
+    return n;
+}
+
+bool RtpSource::Strip(struct iovec &span) {
+    const uint8_t *p = (const uint8_t *)span.iov_base;
+    size_t size = span.iov_len;
+    if (size < 12 || (p[0] >> 6) != 2) {
+        return false;
+    }
+
+    size_t header = 12 + (p[0] & 0x0f) * 4; // CSRC list
+    if (p[0] & 0x10) {
+        if (header + 4 > size) {
+            return false;
+        }
+        header += 4 + ((p[header + 2] << 8) | p[header + 3]) * 4; // extension
+    }
+
+    size_t padding = (p[0] & 0x20) ? p[size - 1] : 0;
+    if (header + padding > size) {
+        return false;
+    }
+
+    uint16_t sequence = (p[2] << 8) | p[3];
+    if (haveSequence_ && sequence != sequence_) {
+        TS_LOGW("RTP sequence jumped from %u to %u, %u datagrams lost", sequence_, sequence,
+                (uint16_t)(sequence - sequence_));
+    }
+    haveSequence_ = true;
+    sequence_ = sequence + 1;
+
+    span.iov_base = (void *)(p + header);
+    span.iov_len = size - header - padding;
+    return true;
+}
+
+int RtpSource::Read(struct iovec *spans, int max) {
+    while (true) {
+        int n = datagrams_->Read(spans, max);
+        if (n <= 0) {
+            return n;
+        }
+
+        int kept = 0;
+        for (int i = 0; i < n; i++) {
+            if (Strip(spans[i])) {
+                spans[kept++] = spans[i];
+            } else {
+                TS_LOGW("Dropped a datagram that is not RTP (%zu bytes)", spans[i].iov_len);
+            }
+        }
+
+        if (kept > 0) {
+            return kept;
+        }
+    }
+}
@@ -0,0 +1,130 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#ifndef MPEG_TS_MEDIA_SRC_INPUT_SOURCE_H
+#define MPEG_TS_MEDIA_SRC_INPUT_SOURCE_H
+
+#include "file.h"
+#include "spsc_ring.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <thread>
+
+#define INPUT_BATCH_SIZE   (1 << 20)  // file source: bytes handed out per Read()
+#define READ_BLOCK_SIZE    (64 << 10) // read source: bytes per read(2)
+#define READ_BLOCK_COUNT   16         // read source: blocks buffered ahead of the demuxer
+#define UDP_BATCH_COUNT    64         // datagrams per recvmmsg(2)
+#define UDP_DATAGRAM_SIZE  2048       // enough for 7 packets of any size plus an RTP header
+#define UDP_RECV_BUFFER    (4 << 20)  // SO_RCVBUF, absorbs bursts while the demuxer is busy
+
+// Where the transport stream comes from. Each Read() hands out the next batch as spans of stream data, which
+// stay valid until the following Read() unless the source is Persistent(). Memory use is bounded by the source,
+// whatever the length of the stream.
+class InputSource {
+public:
+    virtual ~InputSource() = default;
+
+    // Fills up to |max| spans; returns how many, 0 at the end of the stream (or idle timeout), -1 on error.
+    virtual int Read(struct iovec *spans, int max) = 0;
+
+    // True if every span stays valid for the lifetime of the source, which zero-copy demuxing relies on.
+    virtual bool Persistent() const { return false; }
+
+    // "-" for stdin, "udp://[address]:port" or "rtp://[address]:port" (IPv4; a multicast address is joined,
+    // an empty one listens on every interface), otherwise a path: regular files are mapped, anything else
+    // (pipes, FIFOs, devices) is read. |timeoutMs| ends network sources after that long without data, 0 never.
+    static std::shared_ptr<InputSource> Open(const std::string &uri, int timeoutMs = 0);
+};
+
+// A regular file, mapped and handed out in INPUT_BATCH_SIZE windows.
+class FileSource : public InputSource {
+public:
+    static std::shared_ptr<FileSource> Open(const std::string &filename);
+
+    int Read(struct iovec *spans, int max) override;
+    bool Persistent() const override { return true; }
+
+private:
+    explicit FileSource(std::shared_ptr<FileReader> file) : file_(std::move(file)) {}
+
+private:
+    std::shared_ptr<FileReader> file_;
+    size_t offset_ = 0;
+};
+
+// Pipes, FIFOs and devices. A reader thread keeps read(2)-ing into a ring of blocks, so a capture tool writing
+// into the pipe is not held up while the demuxer works through a burst.
+class ReadSource : public InputSource {
+public:
+    static std::shared_ptr<ReadSource> Open(const std::string &filename); // "-" for stdin
+    explicit ReadSource(int fd, bool owned = false);
+    ~ReadSource() override;
+
+    int Read(struct iovec *spans, int max) override;
+
+private:
+    struct Block {
+        size_t size = 0;
+        uint8_t data[READ_BLOCK_SIZE];
+    };
+
+    void Run();
+
+private:
+    int fd_;
+    bool owned_;
+    SpscRing<Block> ring_;
+    bool popPending_ = false; // the block handed out last is released on the next Read()
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::atomic<bool> stop_{false};
+    std::atomic<bool> eof_{false};
+    std::atomic<bool> error_{false};
+    std::thread thread_;
+};
+
+// Datagrams from a UDP socket, one span each, received UDP_BATCH_COUNT at a time with recvmmsg(2).
+class UdpSource : public InputSource {
+public:
+    static std::shared_ptr<UdpSource> Open(const std::string &address, uint16_t port, int timeoutMs = 0);
+    ~UdpSource() override;
+
+    int Read(struct iovec *spans, int max) override;
+
+private:
+    explicit UdpSource(int fd);
+
+private:
+    int fd_;
+    std::unique_ptr<uint8_t[]> buffer_;
+    struct iovec iov_[UDP_BATCH_COUNT];
+    struct mmsghdr msgs_[UDP_BATCH_COUNT];
+};
+
+// Strips RFC 3550 headers (CSRCs, extension and padding included) from the datagrams of another source and
+// reports gaps in the sequence numbers. Datagrams that are not RTP version 2 are dropped.
+class RtpSource : public InputSource {
+public:
+    explicit RtpSource(std::shared_ptr<InputSource> datagrams) : datagrams_(std::move(datagrams)) {}
+
+    int Read(struct iovec *spans, int max) override;
+
+private:
+    bool Strip(struct iovec &span);
+
+private:
+    std::shared_ptr<InputSource> datagrams_;
+    bool haveSequence_ = false;
+    uint16_t sequence_ = 0; // expected next sequence number
+};
+
+#endif // MPEG_TS_MEDIA_SRC_INPUT_SOURCE_H
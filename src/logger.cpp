@@ -0,0 +1,155 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#include "logger.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <thread>
+
+// Bounded multi-producer ring (one sequence number per cell), single consumer in Drain().
+#define LOG_RING_SIZE 16384
+
+static LogEvent ring[LOG_RING_SIZE];
+static std::atomic<size_t> writePos{0};
+static size_t readPos = 0;
+
+static std::thread worker;
+static std::atomic<bool> running{false};
+static FILE *output = stdout;
+
+std::atomic<int> Logger::level_{TS_LOG_LEVEL_INFO};
+std::atomic<uint64_t> Logger::dropped_{0};
+
+static const char *LevelTag(int level) {
+    switch (level) {
+        case TS_LOG_LEVEL_ERROR:
+            return "E";
+        case TS_LOG_LEVEL_WARN:
+            return "W";
+        case TS_LOG_LEVEL_INFO:
+            return "I";
+        case TS_LOG_LEVEL_DEBUG:
+            return "D";
+        default:
+            return "T";
+    }
+}
+
+static bool InitRing() {
+    for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+        ring[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+static bool ringReady = InitRing();
+
+int Logger::ParseLevel(const char *name) {
+    static const char *names[] = {"none", "error", "warn", "info", "debug", "trace"};
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+        if (strcasecmp(name, names[i]) == 0) {
+            return i;
+        }
+    }
+
+    char *end = nullptr;
+    long level = strtol(name, &end, 10);
+    if (end == name || *end != '\0' || level < TS_LOG_LEVEL_NONE || level > TS_LOG_LEVEL_TRACE) {
+        return -1;
+    }
+    return (int)level;
+}
+
+LogText LogTextArg::Store(LogEvent &event, size_t &used, const char *value) {
+    // The last byte of the text is left '\0', for the strings that no longer fit.
+    size_t n = value ? strnlen(value, TS_LOG_TEXT_SIZE - 1 - used) : 0;
+    LogText text = {(uint16_t)used};
+    if (n > 0) {
+        memcpy(event.text + used, value, n);
+    }
+    event.text[used + n] = '\0';
+    used = std::min(used + n + 1, (size_t)TS_LOG_TEXT_SIZE - 1);
+    return text;
+}
+
+LogEvent *Logger::Acquire() {
+    size_t pos = writePos.load(std::memory_order_relaxed);
+    while (true) {
+        LogEvent *event = &ring[pos % LOG_RING_SIZE];
+        size_t seq = event->sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (writePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                return event;
+            }
+        } else if (diff < 0) {
+            // Full. Wait for the drain thread if there is one, otherwise the event is lost.
+            if (!running.load(std::memory_order_relaxed)) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return nullptr;
+            }
+            std::this_thread::yield();
+            pos = writePos.load(std::memory_order_relaxed);
+        } else {
+            pos = writePos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void Logger::Publish(LogEvent *event) {
+    size_t seq = event->sequence.load(std::memory_order_relaxed);
+    event->sequence.store(seq + 1, std::memory_order_release);
+}
+
+size_t Logger::Drain(FILE *out) {
+    char buf[1024];
+    size_t n = 0;
+    while (true) {
+        LogEvent *event = &ring[readPos % LOG_RING_SIZE];
+        if (event->sequence.load(std::memory_order_acquire) != readPos + 1) {
+            break;
+        }
+
+        event->format(*event, buf, sizeof(buf));
+        fprintf(out, "[%s] %s\n", LevelTag(event->level), buf);
+
+        event->sequence.store(readPos + LOG_RING_SIZE, std::memory_order_release);
+        readPos++;
+        n++;
+    }
+
+    if (n > 0) {
+        fflush(out);
+    }
+    return n;
+}
+
+void Logger::Start(FILE *out) {
+    if (running.exchange(true)) {
+        return;
+    }
+
+    output = out;
+    worker = std::thread([out]() {
+        while (running.load(std::memory_order_relaxed)) {
+            if (Drain(out) == 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+        }
+    });
+}
+
+void Logger::Stop() {
+    if (running.exchange(false)) {
+        worker.join();
+    }
+
+    Drain(output);
+    if (Dropped() > 0) {
+        fprintf(output, "[W] %lu log events dropped\n", Dropped());
+    }
+}
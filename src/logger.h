@@ -0,0 +1,172 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#ifndef MPEG_TS_MEDIA_SRC_LOGGER_H
+#define MPEG_TS_MEDIA_SRC_LOGGER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <new>
+#include <string>
+#include <tuple>
+#include <type_traits>
+
+#define TS_LOG_LEVEL_NONE  0
+#define TS_LOG_LEVEL_ERROR 1
+#define TS_LOG_LEVEL_WARN  2
+#define TS_LOG_LEVEL_INFO  3
+#define TS_LOG_LEVEL_DEBUG 4
+#define TS_LOG_LEVEL_TRACE 5
+
+// Levels above TS_LOG_MAX_LEVEL are compiled out, arguments included.
+#ifndef TS_LOG_MAX_LEVEL
+#define TS_LOG_MAX_LEVEL TS_LOG_LEVEL_DEBUG
+#endif
+
+#define TS_LOG(level, fmt, ...)                                                                                        \
+    do {                                                                                                               \
+        if (Logger::Enabled(level)) {                                                                                  \
+            Logger::Write(level, fmt, ##__VA_ARGS__);                                                                  \
+        }                                                                                                              \
+    } while (0)
+
+#define TS_LOG_DISABLED(fmt, ...)                                                                                      \
+    do {                                                                                                               \
+    } while (0)
+
+#if TS_LOG_MAX_LEVEL >= TS_LOG_LEVEL_ERROR
+#define TS_LOGE(fmt, ...) TS_LOG(TS_LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
+#else
+#define TS_LOGE(fmt, ...) TS_LOG_DISABLED(fmt, ##__VA_ARGS__)
+#endif
+
+#if TS_LOG_MAX_LEVEL >= TS_LOG_LEVEL_WARN
+#define TS_LOGW(fmt, ...) TS_LOG(TS_LOG_LEVEL_WARN, fmt, ##__VA_ARGS__)
+#else
+#define TS_LOGW(fmt, ...) TS_LOG_DISABLED(fmt, ##__VA_ARGS__)
+#endif
+
+#if TS_LOG_MAX_LEVEL >= TS_LOG_LEVEL_INFO
+#define TS_LOGI(fmt, ...) TS_LOG(TS_LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+#else
+#define TS_LOGI(fmt, ...) TS_LOG_DISABLED(fmt, ##__VA_ARGS__)
+#endif
+
+#if TS_LOG_MAX_LEVEL >= TS_LOG_LEVEL_DEBUG
+#define TS_LOGD(fmt, ...) TS_LOG(TS_LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+#else
+#define TS_LOGD(fmt, ...) TS_LOG_DISABLED(fmt, ##__VA_ARGS__)
+#endif
+
+#if TS_LOG_MAX_LEVEL >= TS_LOG_LEVEL_TRACE
+#define TS_LOGT(fmt, ...) TS_LOG(TS_LOG_LEVEL_TRACE, fmt, ##__VA_ARGS__)
+#else
+#define TS_LOGT(fmt, ...) TS_LOG_DISABLED(fmt, ##__VA_ARGS__)
+#endif
+
+#define TS_LOG_TEXT_SIZE 256 // bytes of string arguments an event holds, longer ones are cut short
+
+// A log record as it sits in the ring: the format string and the raw arguments. Formatting happens in
+// Logger::Drain(), off the thread that produced the event. Arguments are stored by value; strings (char pointers
+// and std::string) are copied into |text|, so they may be temporaries.
+struct LogEvent {
+    std::atomic<size_t> sequence;
+    int level;
+    const char *fmt;
+    int (*format)(const LogEvent &event, char *buf, size_t size);
+    alignas(16) uint8_t args[64];
+    char text[TS_LOG_TEXT_SIZE];
+};
+
+// How a log argument of type T is kept in LogEvent::args: as itself, or for strings as an offset into the text.
+template <typename T>
+struct LogArg {
+    using Type = T;
+    static T Store(LogEvent &, size_t &, const T &value) { return value; }
+    static T Load(const LogEvent &, const T &value) { return value; }
+};
+
+struct LogText {
+    uint16_t offset;
+};
+
+struct LogTextArg {
+    using Type = LogText;
+    static LogText Store(LogEvent &event, size_t &used, const char *value);
+    static const char *Load(const LogEvent &event, LogText value) { return event.text + value.offset; }
+};
+
+template <>
+struct LogArg<const char *> : LogTextArg {};
+template <>
+struct LogArg<char *> : LogTextArg {};
+template <>
+struct LogArg<std::string> : LogTextArg {
+    static LogText Store(LogEvent &event, size_t &used, const std::string &value) {
+        return LogTextArg::Store(event, used, value.c_str());
+    }
+};
+
+class Logger {
+public:
+    static bool Enabled(int level) { return level <= level_.load(std::memory_order_relaxed); }
+    static int GetLevel() { return level_.load(std::memory_order_relaxed); }
+    static void SetLevel(int level) { level_.store(level, std::memory_order_relaxed); }
+
+    // "error", "warn", "info", "debug", "trace" or a number; returns -1 if unknown.
+    static int ParseLevel(const char *name);
+
+    template <typename... Args>
+    static void Write(int level, const char *fmt, const Args &...args) {
+        using Pack = std::tuple<typename LogArg<std::decay_t<Args>>::Type...>;
+        static_assert(sizeof(Pack) <= sizeof(LogEvent::args), "too many log arguments");
+        static_assert(alignof(Pack) <= alignof(LogEvent), "log argument alignment");
+        static_assert((std::is_trivially_copyable<typename LogArg<std::decay_t<Args>>::Type>::value && ...),
+                      "log arguments must be trivially copyable");
+
+        LogEvent *event = Acquire();
+        if (!event) {
+            return;
+        }
+
+        event->level = level;
+        event->fmt = fmt;
+        event->format = &Format<std::decay_t<Args>...>;
+        // Braced, so that strings are copied in argument order and the last ones are those cut short.
+        [[maybe_unused]] size_t used = 0; // unused without arguments
+        new (event->args) Pack{LogArg<std::decay_t<Args>>::Store(*event, used, args)...};
+        Publish(event);
+    }
+
+    // Formats and prints every pending event. Only one thread may drain at a time.
+    static size_t Drain(FILE *out);
+
+    // Background thread that drains the ring to |out| until Stop().
+    static void Start(FILE *out);
+    static void Stop();
+
+    static uint64_t Dropped() { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    template <typename... Args>
+    static int Format(const LogEvent &event, char *buf, size_t size) {
+        auto *pack = reinterpret_cast<const std::tuple<typename LogArg<Args>::Type...> *>(event.args);
+        return std::apply(
+            [&](const typename LogArg<Args>::Type &...args) {
+                return snprintf(buf, size, event.fmt, LogArg<Args>::Load(event, args)...);
+            },
+            *pack);
+    }
+
+    static LogEvent *Acquire();
+    static void Publish(LogEvent *event);
+
+private:
+    static std::atomic<int> level_;
+    static std::atomic<uint64_t> dropped_;
+};
+
+#endif // MPEG_TS_MEDIA_SRC_LOGGER_H
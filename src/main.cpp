@@ -2,102 +2,561 @@
 // Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
 //
 
+#include <algorithm>
+#include <array>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <memory>
+#include <mutex>
 #include <stdio.h>
+#include <unistd.h>
 
+#include "batch_demuxer.h"
 #include "file.h"
+#include "input_source.h"
+#include "logger.h"
 #include "mpeg_ts.h"
 #include "mpeg_ts_demuxer.h"
+#include "mpeg_ts_filter.h"
+#include "mpeg_ts_muxer.h"
+#include "mpeg_ts_parallel_demuxer.h"
+#include "mpeg_ts_probe.h"
+#include "seek_index.h"
+#include "stream_stats.h"
+#include "ts_analyzer.h"
 
-int main(int argc, char **argv) {
-    printf("MPEG-TS demuxer tool\n");
-    if (argc != 2) {
-        printf("Miss parameter, please specify a file.\n");
-        return -1;
+static void Usage(const char *name) {
+    printf("Usage: %s [-l level] [-z] [-j threads | -w threads] [-t seconds] [-i | -s seconds] [-p] [-o out.ts]"
+           " [-a opts] [-P program] [-k pids] [-m file] [-c] input\n"
+           "       %s -b threads [-d dir] [-z] [-a opts] input...\n",
+           name, name);
+    printf("  input     file.ts, - for stdin, a FIFO, udp://[address]:port or rtp://[address]:port\n");
+    printf("  -l level  log level: none, error, warn, info (default), debug, trace\n");
+    printf("  -z        zero-copy: write frames straight from the mapped input\n");
+    printf("  -j N      demux on N threads (0: one per CPU); output is identical to a serial run\n");
+    printf("  -w N      pipelined: reassemble and write each elementary stream on one of N worker threads\n");
+    printf("  -t N      stop a network input after N seconds without data\n");
+    printf("  -i        also write a seek index to input%s\n", SEEK_INDEX_SUFFIX);
+    printf("  -s T      start at the keyframe T seconds into a file indexed with -i\n");
+    printf("  -p        probe: report programs, streams, duration and bitrate from the head and tail of a file\n");
+    printf("  -o file   remux the first program into a new transport stream instead of writing raw streams\n");
+    printf("  -a opts   write outputs on a background thread; comma-separated opts: file (a thread per file),\n"
+           "            direct (O_DIRECT), prealloc=MB, buffer=MB\n");
+    printf("  -P N      with -o: copy program N as it is, without demuxing, with the PAT rewritten to list it alone\n");
+    printf("  -k PIDs   with -o: copy the comma-separated PIDs as they are; with -P, keep only these of its streams\n");
+    printf("  -m file   keep per-PID statistics and rewrite them to file every second: JSON if it ends in .json,\n"
+           "            Prometheus text otherwise\n");
+    printf("  -c        check: run the TR 101 290 priority 1 and 2 checks, log each error and print a summary\n");
+    printf("  -b N      batch: demux every input on N threads (0: one per CPU), one file at a time per thread;\n"
+           "            inputs are files, directories of .ts files or @list files\n");
+    printf("  -d dir    with -b: output directory (default .), for files named <input>-<PID>.<codec>\n");
+}
+
+static void PrintTime(const char *label, int64_t ticks) {
+    if (ticks < 0) {
+        printf("%s N/A", label);
+    } else {
+        printf("%s %.3fs", label, ticks / 90000.0);
     }
+}
+
+static void PrintProbe(const char *name, const ProbeInfo &info) {
+    printf("Input: %s, %lu bytes, %zu-byte packets, transport_stream_id %u\n", name, info.size, info.packetSize,
+           info.transportStreamId);
+    PrintTime("  Duration:", info.duration);
+    printf(", bitrate: %lu kb/s\n", info.bitrate / 1000);
 
-    std::shared_ptr<FileWriter> avcFile;
-    std::shared_ptr<FileWriter> aacFile;
-    std::shared_ptr<FileWriter> hevcFile;
-    std::shared_ptr<FileWriter> mpegAudioFile;
+    for (auto &program : info.programs) {
+        printf("  Program %u, PMT 0x%04x, PCR 0x%04x", program.programNumber, program.pmtPid, program.pcrPid);
+        if (!program.serviceName.empty() || !program.providerName.empty()) {
+            printf(", service \"%s\" by \"%s\"", program.serviceName.c_str(), program.providerName.c_str());
+        }
+        PrintTime(",", program.firstPcr);
+        PrintTime(" -", program.lastPcr);
+        printf("\n");
+
+        for (auto &stream : program.streams) {
+            printf("    Stream 0x%04x: %s (0x%02x)", stream.pid, StreamTypeName(stream.codecId), stream.codecId);
+            PrintTime(",", stream.firstPts);
+            PrintTime(" -", stream.lastPts);
+            printf("\n");
+        }
+    }
+}
 
-    MpegTsDemuxer demuxer;
-    demuxer.SetDemuxCallback([&](StreamType codec, int64_t pts, int64_t dts, const uint8_t *data, size_t size) {
-        printf("StreamType: 0x%02x, pts: %ld, dts: %ld, data: %02x %02x %02x %02x %02x, size: %zu\n", codec, pts, dts,
-               data[0], data[1], data[2], data[3], data[4], size);
+// Output files are opened with this, async or not.
+static FileWriterConfig outputConfig;
+
+// Raw elementary stream files, one per codec, opened on first use and shared by the streams of that codec.
+class RawOutput : public FrameSink<RawOutput> {
+public:
+    // |shared|: frames may arrive from several threads at once, as pipelined workers deliver them.
+    explicit RawOutput(bool shared) : shared_(shared) {}
+
+    void OnFrame(Frame &frame) {
+        if (!frame.iov.empty()) {
+            Writev(frame.codecId, frame.pts, frame.dts, frame.iov.data(), frame.iov.size());
+        } else {
+            Write(frame.codecId, frame.pts, frame.dts, (const uint8_t *)frame.data.data(), frame.data.size());
+        }
+    }
+
+    void Write(StreamType codec, int64_t pts, int64_t dts, const uint8_t *data, size_t size) {
+        TS_LOGD("StreamType: 0x%02x, pts: %ld, dts: %ld, data: %02x %02x %02x %02x %02x, size: %zu", codec, pts, dts,
+                data[0], data[1], data[2], data[3], data[4], size);
+
+        std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
+        if (shared_) {
+            lock.lock();
+        }
+        FileWriter *file = File(codec, data);
+        if (file) {
+            file->Write(data, size);
+        }
+    }
+
+    void Writev(StreamType codec, int64_t pts, int64_t dts, const struct iovec *iov, size_t iovcnt) {
+        TS_LOGD("StreamType: 0x%02x, pts: %ld, dts: %ld, spans: %zu, size: %zu", codec, pts, dts, iovcnt,
+                IovLength(iov, iovcnt));
+
+        std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
+        if (shared_) {
+            lock.lock();
+        }
+        uint8_t head[2] = {};
+        for (size_t i = 0, n = 0; i < iovcnt && n < sizeof(head); i++) {
+            for (size_t j = 0; j < iov[i].iov_len && n < sizeof(head); j++) {
+                head[n++] = ((const uint8_t *)iov[i].iov_base)[j];
+            }
+        }
+        FileWriter *file = File(codec, head);
+        if (file) {
+            file->Writev(iov, iovcnt);
+        }
+    }
+
+    // Writes out what is still buffered and closes the files.
+    void Close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto &file : files_) {
+            if (file) {
+                file->Close();
+            }
+        }
+    }
+
+private:
+    // MPEG-1 and MPEG-2 audio go to the same file.
+    static uint8_t Slot(StreamType codec) { return codec == STREAM_TYPE_AUDIO_MPEG2 ? STREAM_TYPE_AUDIO_MPEG1 : codec; }
+
+    // |head| is the start of the first frame.
+    FileWriter *File(StreamType codec, const uint8_t *head) {
+        uint8_t slot = Slot(codec);
+        if (opened_[slot]) {
+            return files_[slot].get();
+        }
+        opened_[slot] = true;
 
+        std::string name;
         switch (codec) {
             case STREAM_TYPE_VIDEO_H264:
-                static std::shared_ptr<FileWriter> avcFile =
-                    FileWriter::Open("video-" + std::to_string(time(nullptr)) + ".h264");
-                avcFile->Write(data, size);
+                name = "video-" + std::to_string(time(nullptr)) + ".h264";
                 break;
             case STREAM_TYPE_VIDEO_HEVC:
-                static std::shared_ptr<FileWriter> hevcFile =
-                    FileWriter::Open("video-" + std::to_string(time(nullptr)) + ".h265");
-                hevcFile->Write(data, size);
+                name = "video-" + std::to_string(time(nullptr)) + ".h265";
                 break;
             case STREAM_TYPE_AUDIO_AAC:
-                static std::shared_ptr<FileWriter> aacFile =
-                    FileWriter::Open("audio-" + std::to_string(time(nullptr)) + ".aac");
-                aacFile->Write(data, size);
+                name = "audio-" + std::to_string(time(nullptr)) + ".aac";
                 break;
             case STREAM_TYPE_AUDIO_MPEG1:
-            case STREAM_TYPE_AUDIO_MPEG2:
-                static std::shared_ptr<FileWriter> mpegAudioFile;
-                if (!mpegAudioFile) {
-                    uint8_t layer = (data[1] >> 1) & 0x02;
-                    std::string suffix(".mp3");
-                    if (layer == 0b01) {
-                        suffix = ".mp3";
-                    } else if (layer == 0b10) {
-                        suffix = ".mp2";
-                    } else if (layer == 0b11) {
-                        suffix = ".mp1";
-                    }
-
-                    mpegAudioFile = FileWriter::Open("audio-" + std::to_string(time(nullptr)) + suffix);
+            case STREAM_TYPE_AUDIO_MPEG2: {
+                uint8_t layer = (head[1] >> 1) & 0x02;
+                std::string suffix(".mp3");
+                if (layer == 0b01) {
+                    suffix = ".mp3";
+                } else if (layer == 0b10) {
+                    suffix = ".mp2";
+                } else if (layer == 0b11) {
+                    suffix = ".mp1";
                 }
-                mpegAudioFile->Write(data, size);
+                name = "audio-" + std::to_string(time(nullptr)) + suffix;
                 break;
+            }
             case STREAM_TYPE_VIDEO_MPEG1:
-                static std::shared_ptr<FileWriter> mpeg1File =
-                    FileWriter::Open("video-" + std::to_string(time(nullptr)) + ".mpeg1video");
-                mpeg1File->Write(data, size);
+                name = "video-" + std::to_string(time(nullptr)) + ".mpeg1video";
                 break;
             case STREAM_TYPE_VIDEO_MPEG2:
-                static std::shared_ptr<FileWriter> mpeg2File =
-                    FileWriter::Open("video-" + std::to_string(time(nullptr)) + ".mpeg2video");
-                mpeg2File->Write(data, size);
+                name = "video-" + std::to_string(time(nullptr)) + ".mpeg2video";
                 break;
             default:
-                printf("Unsupported stream type 0x%02x\n", codec);
+                TS_LOGW("Unsupported stream type 0x%02x", codec);
+                return nullptr;
+        }
+
+        files_[slot] = FileWriter::Open(name, outputConfig);
+        return files_[slot].get();
+    }
+
+private:
+    bool shared_;
+    std::mutex mutex_;
+    std::array<std::shared_ptr<FileWriter>, 256> files_; // by Slot()
+    std::array<bool, 256> opened_ = {};
+};
+
+int main(int argc, char **argv) {
+    printf("MPEG-TS demuxer tool\n");
+
+    bool zeroCopy = false;
+    int threads = -1;
+    int workers = 0;
+    int timeout = 0;
+    bool buildIndex = false;
+    double seek = -1;
+    bool probe = false;
+    bool levelSet = false;
+    std::string outputName;
+    std::string metricsName;
+    bool check = false;
+    int batchThreads = -1;
+    std::string batchDir = ".";
+    MpegTsFilter filter;
+    bool filtering = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "l:zj:w:t:is:po:a:P:k:m:cb:d:h")) != -1) {
+        switch (opt) {
+            case 'l': {
+                int level = Logger::ParseLevel(optarg);
+                if (level < 0) {
+                    printf("Unknown log level '%s'\n", optarg);
+                    return -1;
+                }
+                if (level > TS_LOG_MAX_LEVEL) {
+                    printf("Log level %d is compiled out, rebuild with -DTS_LOG_MAX_LEVEL to enable it\n", level);
+                }
+                Logger::SetLevel(level);
+                levelSet = true;
+                break;
+            }
+            case 'z':
+                zeroCopy = true;
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            case 'w':
+                workers = atoi(optarg);
+                break;
+            case 't':
+                timeout = atoi(optarg);
+                break;
+            case 'i':
+                buildIndex = true;
+                break;
+            case 's':
+                seek = atof(optarg);
+                break;
+            case 'p':
+                probe = true;
+                break;
+            case 'o':
+                outputName = optarg;
+                break;
+            case 'a': {
+                outputConfig.async = true;
+                bool shared = true;
+                for (char *option = strtok(optarg, ","); option; option = strtok(nullptr, ",")) {
+                    if (strcmp(option, "file") == 0) {
+                        shared = false;
+                    } else if (strcmp(option, "direct") == 0) {
+                        outputConfig.direct = true;
+                    } else if (strncmp(option, "prealloc=", 9) == 0) {
+                        outputConfig.preallocate = (size_t)atoi(option + 9) << 20;
+                    } else if (strncmp(option, "buffer=", 7) == 0) {
+                        outputConfig.bufferSize = (size_t)atoi(option + 7) << 20;
+                    } else if (strcmp(option, "shared") != 0) {
+                        printf("Unknown output option '%s'\n", option);
+                        return -1;
+                    }
+                }
+                if (shared) {
+                    outputConfig.flusher = std::make_shared<FileFlusher>();
+                }
+                break;
+            }
+            case 'P':
+                filter.SetProgram((uint16_t)strtol(optarg, nullptr, 0));
+                filtering = true;
+                break;
+            case 'k':
+                for (char *pid = strtok(optarg, ","); pid; pid = strtok(nullptr, ",")) {
+                    filter.AddPid((uint16_t)(strtol(pid, nullptr, 0) & (TS_PID_COUNT - 1)));
+                }
+                filtering = true;
+                break;
+            case 'm':
+                metricsName = optarg;
+                break;
+            case 'c':
+                check = true;
+                break;
+            case 'b':
+                batchThreads = atoi(optarg);
                 break;
+            case 'd':
+                batchDir = optarg;
+                break;
+            default:
+                Usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (batchThreads >= 0 ? optind >= argc : optind != argc - 1) {
+        printf("Miss parameter, please specify an input.\n");
+        Usage(argv[0]);
+        return -1;
+    }
+
+    if (batchThreads >= 0) {
+        BatchConfig config;
+        config.threads = batchThreads;
+        config.outputDir = batchDir;
+        config.zeroCopy = zeroCopy;
+        config.output = outputConfig;
+
+        Logger::Start(stdout);
+        BatchDemuxer batch(config);
+        for (int i = optind; i < argc; i++) {
+            batch.AddInput(argv[i]);
+        }
+        bool done = batch.InputCount() > 0 && batch.Run([](const BatchProgress &progress) {
+            TS_LOGI("Batch: %zu/%zu files, %lu/%lu MB, %.1f MB/s, %zu failed", progress.files, progress.totalFiles,
+                    progress.bytes >> 20, progress.totalBytes >> 20,
+                    progress.seconds > 0 ? progress.bytes / progress.seconds / 1e6 : 0.0, progress.failed);
+        });
+        Logger::Stop();
+        return done ? 0 : -1;
+    }
+
+    if (probe) {
+        // The report goes out once the log has drained; table parsing is logged at info level, so keep it quiet.
+        if (!levelSet) {
+            Logger::SetLevel(TS_LOG_LEVEL_WARN);
+        }
+        Logger::Start(stdout);
+        auto file = FileReader::Open(argv[optind]);
+        ProbeInfo info;
+        bool probed = file && MpegTsProbe().Probe(file->data, file->size, info);
+        Logger::Stop();
+        if (probed) {
+            PrintProbe(argv[optind], info);
+        }
+        return probed ? 0 : -1;
+    }
+
+    Logger::Start(stdout);
+
+    if (filtering) {
+        // Packets are copied from the mapping by offset, so this needs a regular file.
+        auto file = FileReader::Open(argv[optind]);
+        auto output = outputName.empty() ? nullptr : FileWriter::Open(outputName);
+        if (!output) {
+            TS_LOGE("Filtering needs an input file and an output set with -o");
+        }
+        bool filtered = file && output && filter.Filter(*file, *output);
+        Logger::Stop();
+        return filtered ? 0 : -1;
+    }
+
+    // Pipelined workers deliver frames concurrently, and streams of the same codec share an output file.
+    RawOutput rawOutput(workers > 0);
+    auto onFrame = [&](StreamType codec, int64_t pts, int64_t dts, const uint8_t *data, size_t size) {
+        rawOutput.Write(codec, pts, dts, data, size);
+    };
+    auto onIovFrame = [&](StreamType codec, int64_t pts, int64_t dts, const struct iovec *iov, size_t iovcnt) {
+        rawOutput.Writev(codec, pts, dts, iov, iovcnt);
+    };
+
+    if (threads >= 0 && (buildIndex || seek >= 0 || !outputName.empty())) {
+        TS_LOGW("Indexing, seeking and remuxing run serially, ignoring -j");
+        threads = -1;
+    }
+
+    if (threads >= 0 && (!metricsName.empty() || check)) {
+        TS_LOGW("Statistics and checks need one demuxer for the whole input, ignoring -j");
+        threads = -1;
+    }
+
+    std::unique_ptr<StatsExporter> exporter;
+    std::shared_ptr<StreamStats> stats;
+    if (!metricsName.empty()) {
+        exporter = std::make_unique<StatsExporter>(metricsName);
+        stats = std::make_shared<StreamStats>(argv[optind]);
+        exporter->Add(stats);
+    }
+
+    std::shared_ptr<TsAnalyzer> analyzer;
+    if (check) {
+        analyzer = std::make_shared<TsAnalyzer>();
+        analyzer->SetEventCallback([](const TrEvent &event) {
+            TS_LOGW("%s on PID 0x%04x at %.3fs, offset %lu: %ld", TrCheckName(event.check), event.pid,
+                    event.time / 27000000.0, event.offset, event.value);
+        });
+    }
+
+    if (threads >= 0) {
+        // Chunks are cut from the whole mapping, so this needs a regular file.
+        auto file = FileReader::Open(argv[optind]);
+        if (!file) {
+            Logger::Stop();
+            return -1;
+        }
+
+        MpegTsParallelDemuxer demuxer(threads);
+        if (zeroCopy) {
+            demuxer.SetDemuxIovCallback(onIovFrame);
+        } else {
+            demuxer.SetDemuxCallback(onFrame);
+        }
+        demuxer.Demux(file->data, file->size);
+    } else {
+        MpegTsDemuxer demuxer;
+        if ((buildIndex || !outputName.empty()) && workers > 0) {
+            TS_LOGW("Indexing and remuxing run on the calling thread, ignoring -w");
+            workers = 0;
         }
-    });
+        demuxer.SetWorkerThreads(workers);
+        demuxer.SetStreamStats(stats);
+        demuxer.SetAnalyzer(analyzer);
 
-    int count = 0;
-    auto file = FileReader::Open(argv[1]);
-    uint8_t *end = file->data + file->size;
-    uint8_t *p = file->data;
-    while (p + TS_PACKET_SIZE <= end) {
-        if (p[0] == 0x47) {
-            if (p + TS_PACKET_SIZE == end || p[TS_PACKET_SIZE] == 0x47) {
-                demuxer.Input(p, TS_PACKET_SIZE);
-                p += TS_PACKET_SIZE;
-                continue;
-            } else {
-                printf("Invalid packet size\n");
+        auto source = seek >= 0 ? nullptr : InputSource::Open(argv[optind], timeout * 1000);
+        if (seek < 0 && zeroCopy && source && !source->Persistent()) {
+            TS_LOGW("Zero-copy needs a file input, frames will be copied");
+            zeroCopy = false;
+        }
+
+        // Remuxing: the streams of the program of the first frame go into one new transport stream.
+        std::shared_ptr<FileWriter> output;
+        MpegTsMuxer muxer;
+        std::vector<uint16_t> remuxPids;
+        data_t scratch;
+        auto onRemuxFrame = [&](Frame &frame) {
+            for (auto &program : demuxer.GetPAT().programs) {
+                if (!remuxPids.empty() || !program.pmt) {
+                    break;
+                }
+                auto &streams = program.pmt->streams;
+                if (std::none_of(streams.begin(), streams.end(),
+                                 [&](const TS_PMT_Stream &stream) { return stream.elementary_PID == frame.pid; })) {
+                    continue;
+                }
+
+                muxer.SetProgram(program.program_number, program.program_map_PID);
+                muxer.SetPcrPid(program.pmt->PCR_PID);
+                for (auto &stream : streams) {
+                    if (muxer.AddStream(stream.elementary_PID, (StreamType)stream.stream_type)) {
+                        remuxPids.push_back(stream.elementary_PID);
+                    }
+                }
+            }
+            if (std::find(remuxPids.begin(), remuxPids.end(), frame.pid) == remuxPids.end()) {
+                return;
+            }
+
+            const uint8_t *data = (const uint8_t *)frame.data.data();
+            size_t size = frame.data.size();
+            if (!frame.iov.empty()) {
+                IovLinearize(frame.iov.data(), frame.iov.size(), scratch);
+                data = (const uint8_t *)scratch.data();
+                size = scratch.size();
+            }
+            muxer.Write(frame.pid, frame.pts, frame.dts, data, size, frame.randomAccess);
+        };
+
+        if (!outputName.empty()) {
+            output = FileWriter::Open(outputName, outputConfig);
+            if (!output) {
+                TS_LOGE("Cannot create the output file");
+                Logger::Stop();
+                return -1;
+            }
+            muxer.SetOutputCallback([&](const struct iovec *iov, size_t iovcnt) { output->Writev(iov, iovcnt); });
+            demuxer.SetDemuxFrameCallback(onRemuxFrame);
+        } else {
+            // The frames of each Input() in one batch, unless workers deliver them.
+            demuxer.SetFrameMode(zeroCopy ? FRAME_MODE_IOVEC : FRAME_MODE_COPY);
+            demuxer.SetFrameSink(&rawOutput, workers == 0);
+        }
+
+        if (seek >= 0) {
+            std::string indexName = std::string(argv[optind]) + SEEK_INDEX_SUFFIX;
+            auto file = FileReader::Open(argv[optind]);
+            auto index = file ? SeekIndex::Open(indexName) : nullptr;
+            if (!index) {
+                TS_LOGE("Cannot seek without %s, build it with -i", indexName.c_str());
+                Logger::Stop();
+                return -1;
+            }
+            if (index->FileSize() != file->size) {
+                TS_LOGW("The seek index was built for a file of another size");
             }
 
+            int64_t offset = demuxer.Seek(*index, (int64_t)(seek * 90000));
+            if (offset >= 0 && (uint64_t)offset < file->size) {
+                demuxer.Input(file->data + offset, file->size - offset);
+            }
+            demuxer.Flush();
         } else {
-            printf("Error\n");
+            if (!source) {
+                Logger::Stop();
+                return -1;
+            }
+
+            std::unique_ptr<SeekIndexBuilder> index;
+            if (buildIndex) {
+                index = std::make_unique<SeekIndexBuilder>(demuxer);
+            }
+
+            struct iovec spans[UDP_BATCH_COUNT];
+            uint64_t total = 0;
+            int n;
+            while ((n = source->Read(spans, UDP_BATCH_COUNT)) > 0) {
+                for (int i = 0; i < n; i++) {
+                    demuxer.Input((const uint8_t *)spans[i].iov_base, spans[i].iov_len);
+                    total += spans[i].iov_len;
+                }
+            }
+            demuxer.Flush();
+
+            if (index) {
+                index->Write(std::string(argv[optind]) + SEEK_INDEX_SUFFIX, total);
+            }
+        }
+        muxer.Flush();
+    }
+
+    // The final figures, once the demuxer has flushed.
+    if (exporter) {
+        exporter->Stop();
+    }
+
+    // The raw output files hand over their last, partial buffers as they close, which the figures must include.
+    rawOutput.Close();
+    if (outputConfig.flusher) {
+        FileWriterStats stats = outputConfig.flusher->GetStats();
+        TS_LOGI("Output thread: %lu bytes in %lu buffers, up to %zu queued, %lu stalls for %lu us", stats.bytes,
+                stats.buffers, stats.peakQueued, stats.stalls, stats.stallTime);
+    }
+    Logger::Stop();
 
-            p++;
+    if (analyzer) {
+        printf("TR 101 290: %lu packets, %.3fs\n", analyzer->Packets(), analyzer->Duration() / 27000000.0);
+        for (int i = 0; i < TR_CHECK_COUNT; i++) {
+            printf("  %-40s %lu\n", TrCheckName((TrCheck)i), analyzer->Count((TrCheck)i));
         }
     }
-    demuxer.Flush();
 
     return 0;
 }
\ No newline at end of file
@@ -3,18 +3,30 @@
 //
 
 #include "mpeg_ts.h"
+#include "crc32.h"
+#include "logger.h"
 #include <algorithm>
 #include <cassert>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <utility>
+
+#define FRAME_POOL_MAX_FREE 4 // spare buffers kept per stream
 
 bool TS_Adaption::Parse(const uint8_t *data, size_t size) {
     assert(size <= TS_PACKET_SIZE);
 
     size_t i = 0;
-    printf("TS_Adaption::Parse %02x %02x %02x %02x\n", data[i], data[i + 1], data[i + 2], data[i + 3]);
+    TS_LOGT("TS_Adaption::Parse %02x %02x %02x %02x", data[i], data[i + 1], data[i + 2], data[i + 3]);
     adaptation_field_length = data[i++];
+    if (1 + (size_t)adaptation_field_length > size) {
+        return false;
+    }
+
+    // The fields must fit in the adaptation field itself.
+    size = 1 + adaptation_field_length;
     if (adaptation_field_length > 0) {
         discontinuity_indicator = (data[i] >> 7) & 0x01;
         random_access_indicator = (data[i] >> 6) & 0x01;
@@ -27,7 +39,9 @@ bool TS_Adaption::Parse(const uint8_t *data, size_t size) {
         i++;
 
         if (PCR_flag) {
-            assert(i + 6 <= size);
+            if (i + 6 > size) {
+                return false;
+            }
             program_clock_reference_base = ((uint64_t)data[i] << 25) | ((uint64_t)data[i + 1] << 17) |
                                            ((uint64_t)data[i + 2] << 9) | ((uint64_t)data[i + 3] << 1) |
                                            ((data[i + 4] >> 7) & 0x01);
@@ -36,7 +50,9 @@ bool TS_Adaption::Parse(const uint8_t *data, size_t size) {
         }
 
         if (OPCR_flag) {
-            assert(i + 6 <= size);
+            if (i + 6 > size) {
+                return false;
+            }
             original_program_clock_reference_base = (((uint64_t)data[i]) << 25) | ((uint64_t)data[i + 1] << 17) |
                                                     ((uint64_t)data[i + 2] << 9) | ((uint64_t)data[i + 3] << 1) |
                                                     ((data[i + 4] >> 7) & 0x01);
@@ -44,13 +60,19 @@ bool TS_Adaption::Parse(const uint8_t *data, size_t size) {
             i += 6;
         }
 
+        if (i + splicing_point_flag + transport_private_data_flag + 2 * adaptation_field_extension_flag > size) {
+            return false;
+        }
+
         if (splicing_point_flag) {
             splice_countdown = data[i++];
         }
 
         if (transport_private_data_flag) {
             transport_private_data_length = data[i++];
-            assert(i + transport_private_data_length <= size);
+            if (i + transport_private_data_length > size) {
+                return false;
+            }
             for (uint8_t j = 0; j < transport_private_data_length; j++) {
                 uint8_t transport_private_data = data[i + j];
             }
@@ -59,6 +81,9 @@ bool TS_Adaption::Parse(const uint8_t *data, size_t size) {
         }
 
         if (adaptation_field_extension_flag) {
+            if (i + 2 > size) {
+                return false;
+            }
             adaptation_field_extension_length = data[i++];
             ltw_flag = (data[i] >> 7) & 0x01;
             piecewise_rate_flag = (data[i] >> 6) & 0x01;
@@ -68,20 +93,26 @@ bool TS_Adaption::Parse(const uint8_t *data, size_t size) {
 
             i++;
             if (ltw_flag) {
-                assert(i + 2 <= size);
+                if (i + 2 > size) {
+                    return false;
+                }
                 ltw_valid_flag = (data[i] >> 7) & 0x01;
                 ltw_offset = ((data[i] & 0x7F) << 8) | data[i + 1];
                 i += 2;
             }
 
             if (piecewise_rate_flag) {
-                assert(i + 3 <= size);
+                if (i + 3 > size) {
+                    return false;
+                }
                 piecewise_rate = ((data[i] & 0x3f) << 16) | (data[i + 1] << 8) | data[i + 2];
                 i += 3;
             }
 
             if (seamless_splice_flag) {
-                assert(i + 5 <= size);
+                if (i + 5 > size) {
+                    return false;
+                }
                 Splice_type = (data[i] >> 4) & 0x0F;
                 DTS_next_AU = (((data[i] >> 1) & 0x07) << 30) | (data[i + 1] << 22) |
                               (((data[i + 2] >> 1) & 0x7F) << 15) | (data[i + 3] << 7) | ((data[i + 4] >> 1) & 0x7F);
@@ -96,18 +127,42 @@ bool TS_Adaption::Parse(const uint8_t *data, size_t size) {
     return true;
 }
 
-int TS_PES::Parse(const uint8_t *data, size_t size) {
+// 33-bit timestamp behind a 4-bit prefix and its marker bits (ISO/IEC 13818-1 2.4.3.7).
+static inline uint64_t ReadTimestamp(const uint8_t *data) {
+    return (((uint64_t)data[0] & 0x0e) << 29) | ((uint64_t)data[1] << 22) | (((uint64_t)data[2] & 0xfe) << 14) |
+           ((uint64_t)data[3] << 7) | (data[4] >> 1);
+}
+
+// Bytes of the optional fields the flags byte announces, PES extension left out.
+static inline size_t PesFieldsSize(uint8_t flags) {
+    return ((flags >> 7) & 0x01) * 5 + ((flags >> 6) & 0x01) * 5 + ((flags >> 5) & 0x01) * 6 +
+           ((flags >> 4) & 0x01) * 3 + ((flags >> 3) & 0x01) + ((flags >> 2) & 0x01) + ((flags >> 1) & 0x01) * 2;
+}
+
+// Start code, the '10' bits and a header that fits, with the fields its flags announce; anything else is a corrupted
+// packet.
+static inline bool PesHeaderValid(const uint8_t *data, size_t size) {
+    return size >= 9 && data[0] == 0 && data[1] == 0 && data[2] == 0x01 && (data[6] & 0xc0) == 0x80 &&
+           (size_t)data[8] + 9 <= size && (data[7] & 0xc0) != 0x40 && PesFieldsSize(data[7]) <= data[8];
+}
 
-    printf("TS_PES::Parse() %02x %02x %02x %02x\n", data[0], data[1], data[2], data[3]);
+int TS_PES_Header::Parse(const uint8_t *data, size_t size) {
+    if (!PesHeaderValid(data, size)) {
+        return 0;
+    }
+
+    TS_LOGT("TS_PES_Header::Parse() %02x %02x %02x %02x", data[0], data[1], data[2], data[3]);
+    ParseFields(data);
+    return PES_header_data_length + 9; // size before 'PES_header_data_length'
+}
+
+void TS_PES_Header::ParseFields(const uint8_t *data) {
     size_t i = 0;
     packet_start_code_prefix = (data[0] << 16) | (data[1] << 8) | data[2];
     stream_id = data[3];
     PES_packet_length = (data[4] << 8) | data[5]; // may be 0
-    // assert(packet_start_code_prefix == 0x000001);
-    assert(data[0] == 0 && data[1] == 0 && data[2] == 0x01);
 
     i = 6;
-    assert(((data[i] >> 6) & 0x03) == 0x02);
     PES_scrambling_control = (data[i] >> 4) & 0x03;
     PES_priority = (data[i] >> 3) & 0x01;
     data_alignment_indicator = (data[i] >> 2) & 0x01;
@@ -123,20 +178,14 @@ int TS_PES::Parse(const uint8_t *data, size_t size) {
     PES_extension_flag = data[i++] & 0x01;
 
     PES_header_data_length = data[i++];
-    if (PTS_DTS_flags & 0x02) {
-        assert(0x20 == (data[i] & 0x20));
-        PTS = ((((uint64_t)data[i] >> 1) & 0x07) << 30) | ((uint64_t)data[i + 1] << 22) |
-              ((((uint64_t)data[i + 2] >> 1) & 0x7f) << 15) | ((uint64_t)data[i + 3] << 7) |
-              ((data[i + 4] >> 1) & 0x7f);
 
+    if (PTS_DTS_flags & 0x02) {
+        PTS = ReadTimestamp(data + i);
         i += 5;
     }
 
     if (PTS_DTS_flags & 0x01) {
-        assert(0x10 == (data[i] & 0x10));
-        DTS = ((((uint64_t)data[i] >> 1) & 0x07) << 30) | ((uint64_t)data[i + 1] << 22) |
-              ((((uint64_t)data[i + 2] >> 1) & 0x7f) << 15) | ((uint64_t)data[i + 3] << 7) |
-              ((data[i + 4] >> 1) & 0x7f);
+        DTS = ReadTimestamp(data + i);
         i += 5;
     } else {
         if (PTS_DTS_flags & 0x02) {
@@ -174,16 +223,78 @@ int TS_PES::Parse(const uint8_t *data, size_t size) {
 
     if (PES_extension_flag == 0x01) {
     }
+}
 
-    return PES_header_data_length + 9; // size before 'PES_header_data_length'
+int TS_PES::Parse(const uint8_t *data, size_t size) {
+    if (!PesHeaderValid(data, size)) {
+        return 0;
+    }
+
+    // Only what every PES packet needs; the rest stays in header_ for Header().
+    stream_id = data[3];
+    PES_packet_length = (data[4] << 8) | data[5];
+    PTS_DTS_flags = data[7] >> 6;
+    PES_header_data_length = data[8];
+    if (PTS_DTS_flags & 0x02) {
+        PTS = ReadTimestamp(data + 9);
+        DTS = PTS_DTS_flags & 0x01 ? ReadTimestamp(data + 14) : PTS;
+    }
+
+    size_t headerSize = (size_t)PES_header_data_length + 9;
+    headerSize_ = headerSize < TS_PES_RETAINED_SIZE ? headerSize : TS_PES_RETAINED_SIZE;
+    memcpy(header_, data, headerSize_);
+    return (int)headerSize;
+}
+
+bool TS_PES::Header(TS_PES_Header &header) const {
+    if (headerSize_ == 0) {
+        return false;
+    }
+    header.ParseFields(header_);
+    return true;
+}
+
+// The inverse of ReadTimestamp().
+static void WriteTimestamp(uint8_t *data, uint8_t prefix, uint64_t ts) {
+    data[0] = (prefix << 4) | (((ts >> 30) & 0x07) << 1) | 0x01;
+    data[1] = (ts >> 22) & 0xff;
+    data[2] = (((ts >> 15) & 0x7f) << 1) | 0x01;
+    data[3] = (ts >> 7) & 0xff;
+    data[4] = ((ts & 0x7f) << 1) | 0x01;
+}
+
+size_t TS_PES_Header::Serialize(uint8_t *data) const {
+    size_t i = 0;
+    data[i++] = 0x00;
+    data[i++] = 0x00;
+    data[i++] = 0x01;
+    data[i++] = stream_id;
+    data[i++] = PES_packet_length >> 8;
+    data[i++] = PES_packet_length & 0xff;
+    data[i++] = 0x80 | (data_alignment_indicator << 2);
+    data[i++] = PTS_DTS_flags << 6;
+    data[i++] = (PTS_DTS_flags == 0x03 ? 10 : PTS_DTS_flags == 0x02 ? 5 : 0);
+
+    if (PTS_DTS_flags & 0x02) {
+        WriteTimestamp(data + i, PTS_DTS_flags, PTS);
+        i += 5;
+    }
+
+    if (PTS_DTS_flags == 0x03) {
+        WriteTimestamp(data + i, 0x01, DTS);
+        i += 5;
+    }
+    return i;
 }
 
 bool TS_PMT::Parse(const uint8_t *data, size_t size) {
-    int crc32Size = 4;
+    size_t crc32Size = 4;
 
-    assert(size > 12 + crc32Size);
+    // 12 bytes fiexed header; a program without streams has nothing else but the CRC
+    if (size < 12 + crc32Size) {
+        return false;
+    }
 
-    // 12 bytes fiexed header
     table_id = data[0];
     section_syntax_indicator = (data[1] >> 7) & 0x01;
     section_length = ((data[1] & 0x0f) << 8) | data[2];
@@ -201,10 +312,11 @@ bool TS_PMT::Parse(const uint8_t *data, size_t size) {
     assert(section_number == 0);
     assert(last_section_number == 0);
 
-    int totalSizeOfPMT = section_length + 3;
-    assert(totalSizeOfPMT > 12 + crc32Size);
-    assert(totalSizeOfPMT <= size);
-    assert(program_info_length + 12 <= totalSizeOfPMT - crc32Size);
+    size_t totalSizeOfPMT = section_length + 3;
+    if (totalSizeOfPMT < 12 + crc32Size || totalSizeOfPMT > size ||
+        (size_t)program_info_length + 12 > totalSizeOfPMT - crc32Size) {
+        return false;
+    }
 
     if (program_info_length > 0) {
         // descriptor(data + 12, program_info_length)
@@ -234,8 +346,8 @@ bool TS_PMT::Parse(const uint8_t *data, size_t size) {
                 // descriptor(data + i + 5, ES_info_length)
             }
 
-            printf("Find stream_type: 0x%02x, pid: 0x%04x | refer to 0x1b: AVC; 0x0f: AAC; 0x24: HEVC\n", stream_type,
-                   elementary_PID);
+            TS_LOGI("Find stream_type: 0x%02x, pid: 0x%04x | refer to 0x1b: AVC; 0x0f: AAC; 0x24: HEVC", stream_type,
+                    elementary_PID);
             streams.emplace_back(stream);
         } else {
             if (it->stream_type != stream_type) {
@@ -248,12 +360,48 @@ bool TS_PMT::Parse(const uint8_t *data, size_t size) {
     }
 
     assert(i + 4 <= size);
-    printf("%02x %02x %02x %02x\n", data[i], data[i + 1], data[i + 2], data[i + 3]);
-    uint32_t crc = (data[i] << 24) | (data[i + 1] << 16) | (data[i + 2] << 8) | data[i + 3];
-    // check crc32
+    TS_LOGT("%02x %02x %02x %02x", data[i], data[i + 1], data[i + 2], data[i + 3]);
+    // The CRC was checked by SectionCache before the section got here.
     return true;
 }
 
+size_t TS_PMT::Serialize(uint8_t *data, size_t size) const {
+    int crc32Size = 4;
+    size_t total = 12 + streams.size() * 5 + crc32Size;
+    if (total > size || total - 3 > 1021) {
+        return 0;
+    }
+
+    size_t i = 0;
+    data[i++] = TID_PMS;
+    data[i++] = 0xb0 | ((total - 3) >> 8); // section_syntax_indicator, '0', reserved
+    data[i++] = (total - 3) & 0xff;
+    data[i++] = program_number >> 8;
+    data[i++] = program_number & 0xff;
+    data[i++] = 0xc0 | (version_number << 1) | 0x01; // current_next_indicator
+    data[i++] = 0;                                   // section_number
+    data[i++] = 0;                                   // last_section_number
+    data[i++] = 0xe0 | (PCR_PID >> 8);
+    data[i++] = PCR_PID & 0xff;
+    data[i++] = 0xf0; // program_info_length
+    data[i++] = 0;
+
+    for (auto &stream : streams) {
+        data[i++] = stream.stream_type;
+        data[i++] = 0xe0 | (stream.elementary_PID >> 8);
+        data[i++] = stream.elementary_PID & 0xff;
+        data[i++] = 0xf0; // ES_info_length
+        data[i++] = 0;
+    }
+
+    uint32_t crc = Crc32Mpeg2(data, i);
+    data[i++] = crc >> 24;
+    data[i++] = (crc >> 16) & 0xff;
+    data[i++] = (crc >> 8) & 0xff;
+    data[i++] = crc & 0xff;
+    return i;
+}
+
 bool TS_PAT::Parse(const uint8_t *data, size_t size) {
     size_t i = 0;
     int crc32Size = 4;
@@ -273,9 +421,9 @@ bool TS_PAT::Parse(const uint8_t *data, size_t size) {
     int totalSizeOfPAT = section_length + 3;
     assert(totalSizeOfPAT >= 8 + crc32Size); // PAT size = section_length +3
 
-    printf("section_length: %d\n", section_length);
+    TS_LOGT("section_length: %d", section_length);
     for (i = 8; i + 4 <= totalSizeOfPAT - 4 && section_length + 3 <= size; i += 4) {
-        printf("%02x %02x %02x %02x\n", data[i], data[i + 1], data[i + 2], data[i + 3]);
+        TS_LOGT("%02x %02x %02x %02x", data[i], data[i + 1], data[i + 2], data[i + 3]);
 
         uint16_t program_number = (data[i] << 8) | data[i + 1];
         if (program_number == 0) {
@@ -292,19 +440,233 @@ bool TS_PAT::Parse(const uint8_t *data, size_t size) {
                 program.program_number = program_number;
                 program.program_map_PID = program_map_PID;
                 programs.emplace_back(program);
-                printf("program_number: %d, program_map_PID:0x%02x\n", program.program_number, program.program_map_PID);
+                TS_LOGI("program_number: %d, program_map_PID:0x%02x", program.program_number, program.program_map_PID);
             } else {
                 it->program_number = program_number;
-                printf("find program, program_number: %d, program_map_PID:0x%02x\n", it->program_number,
-                       it->program_map_PID);
+                TS_LOGT("find program, program_number: %d, program_map_PID:0x%02x", it->program_number,
+                        it->program_map_PID);
             }
         }
     }
 
-    printf("i = %ld, size = %zu\n", i, size);
-    assert(i + 4 < size);
-    printf("%02x %02x %02x %02x\n", data[i], data[i + 1], data[i + 2], data[i + 3]);
+    TS_LOGT("i = %ld, size = %zu", i, size);
+    assert(i + 4 <= size);
+    TS_LOGT("%02x %02x %02x %02x", data[i], data[i + 1], data[i + 2], data[i + 3]);
     crc = (data[i] << 24) | (data[i + 1] << 16) | (data[i + 2] << 8) | data[i + 3];
-    // check crc32
     return true;
+}
+
+size_t TS_PAT::Serialize(uint8_t *data, size_t size) const {
+    int crc32Size = 4;
+    size_t total = 8 + programs.size() * 4 + crc32Size;
+    if (total > size || total - 3 > 1021) {
+        return 0;
+    }
+
+    size_t i = 0;
+    data[i++] = TID_PAS;
+    data[i++] = 0xb0 | ((total - 3) >> 8); // section_syntax_indicator, '0', reserved
+    data[i++] = (total - 3) & 0xff;
+    data[i++] = transport_stream_id >> 8;
+    data[i++] = transport_stream_id & 0xff;
+    data[i++] = 0xc0 | (version_number << 1) | 0x01; // current_next_indicator
+    data[i++] = 0;                                   // section_number
+    data[i++] = 0;                                   // last_section_number
+
+    for (auto &program : programs) {
+        data[i++] = program.program_number >> 8;
+        data[i++] = program.program_number & 0xff;
+        data[i++] = 0xe0 | (program.program_map_PID >> 8);
+        data[i++] = program.program_map_PID & 0xff;
+    }
+
+    uint32_t crc = Crc32Mpeg2(data, i);
+    data[i++] = crc >> 24;
+    data[i++] = (crc >> 16) & 0xff;
+    data[i++] = (crc >> 8) & 0xff;
+    data[i++] = crc & 0xff;
+    return i;
+}
+
+// DVB strings may start with a character table selector (EN 300 468 annex A.2); the text is kept as it is.
+static std::string DvbString(const uint8_t *data, size_t size) {
+    size_t skip = 0;
+    if (size > 0 && data[0] < 0x20) {
+        skip = data[0] == 0x10 ? 3 : data[0] == 0x1f ? 2 : 1;
+    }
+    return skip < size ? std::string((const char *)data + skip, size - skip) : std::string();
+}
+
+bool TS_SDT::Parse(const uint8_t *data, size_t size) {
+    size_t crc32Size = 4;
+
+    // 11 bytes fixed header
+    if (size < 11 + crc32Size) {
+        return false;
+    }
+
+    table_id = data[0];
+    section_length = ((data[1] & 0x0f) << 8) | data[2];
+    transport_stream_id = (data[3] << 8) | data[4];
+    version_number = (data[5] >> 1) & 0x1f;
+    section_number = data[6];
+    last_section_number = data[7];
+    original_network_id = (data[8] << 8) | data[9];
+
+    assert(table_id == TID_SDS);
+    size_t end = std::min((size_t)section_length + 3, size) - crc32Size;
+
+    uint16_t descriptors_loop_length = 0;
+    for (size_t i = 11; i + 5 <= end; i += 5 + descriptors_loop_length) {
+        uint16_t service_id = (data[i] << 8) | data[i + 1];
+        descriptors_loop_length = ((data[i + 3] & 0x0f) << 8) | data[i + 4];
+        if (i + 5 + descriptors_loop_length > end) {
+            break;
+        }
+
+        auto it = std::find_if(services.begin(), services.end(),
+                               [&](const TS_SDT_Service &service) { return service.service_id == service_id; });
+        if (it == services.end()) {
+            services.emplace_back();
+            it = services.end() - 1;
+            it->service_id = service_id;
+        }
+
+        it->EIT_schedule_flag = (data[i + 2] >> 1) & 0x01;
+        it->EIT_present_following_flag = data[i + 2] & 0x01;
+        it->running_status = (data[i + 3] >> 5) & 0x07;
+        it->free_CA_mode = (data[i + 3] >> 4) & 0x01;
+
+        const uint8_t *p = data + i + 5;
+        const uint8_t *descriptorsEnd = p + descriptors_loop_length;
+        while (p + 2 <= descriptorsEnd && p + 2 + p[1] <= descriptorsEnd) {
+            uint8_t descriptor_tag = p[0];
+            uint8_t descriptor_length = p[1];
+            const uint8_t *d = p + 2;
+            const uint8_t *dEnd = d + descriptor_length;
+            if (descriptor_tag == 0x48 && d + 2 <= dEnd && d + 2 + d[1] < dEnd) {
+                uint8_t providerLength = d[1];
+                uint8_t nameLength = d[2 + providerLength];
+                it->service_type = d[0];
+                it->provider_name = DvbString(d + 2, providerLength);
+                it->service_name = DvbString(d + 3 + providerLength,
+                                             std::min((size_t)nameLength, (size_t)(dEnd - d - 3 - providerLength)));
+                TS_LOGI("service_id: %d, service_type: 0x%02x", service_id, it->service_type);
+            }
+            p = dEnd;
+        }
+    }
+
+    return true;
+}
+
+const char *StreamTypeName(uint8_t streamType) {
+    switch (streamType) {
+        case STREAM_TYPE_VIDEO_MPEG1:
+            return "mpeg1video";
+        case STREAM_TYPE_VIDEO_MPEG2:
+            return "mpeg2video";
+        case STREAM_TYPE_AUDIO_MPEG1:
+        case STREAM_TYPE_AUDIO_MPEG2:
+            return "mp2/mp3";
+        case STREAM_TYPE_PRIVATE_SECTION:
+            return "private_section";
+        case STREAM_TYPE_PRIVATE_DATA:
+            return "private_data";
+        case STREAM_TYPE_AUDIO_AAC:
+            return "aac";
+        case STREAM_TYPE_VIDEO_MPEG4:
+            return "mpeg4";
+        case STREAM_TYPE_AUDIO_AAC_LATM:
+            return "aac_latm";
+        case STREAM_TYPE_METADATA:
+            return "metadata";
+        case STREAM_TYPE_VIDEO_H264:
+            return "h264";
+        case STREAM_TYPE_VIDEO_HEVC:
+            return "hevc";
+        case STREAM_TYPE_VIDEO_CAVS:
+            return "cavs";
+        case STREAM_TYPE_VIDEO_AVS2:
+            return "avs2";
+        case STREAM_TYPE_VIDEO_AVS3:
+            return "avs3";
+        case STREAM_TYPE_VIDEO_VC1:
+            return "vc1";
+        case STREAM_TYPE_VIDEO_SVAC:
+            return "svac";
+        case STREAM_TYPE_AUDIO_SVAC:
+            return "svac_audio";
+        case STREAM_TYPE_AUDIO_G711A:
+            return "g711a";
+        case STREAM_TYPE_AUDIO_G711U:
+            return "g711u";
+        case STREAM_TYPE_AUDIO_G722:
+            return "g722";
+        case STREAM_TYPE_AUDIO_G723:
+            return "g723";
+        case STREAM_TYPE_AUDIO_G729:
+            return "g729";
+        case STREAM_TYPE_AUDIO_OPUS:
+            return "opus";
+        default:
+            return "unknown";
+    }
+}
+
+size_t IovLength(const struct iovec *iov, size_t iovcnt) {
+    size_t length = 0;
+    for (size_t i = 0; i < iovcnt; i++) {
+        length += iov[i].iov_len;
+    }
+    return length;
+}
+
+void IovLinearize(const struct iovec *iov, size_t iovcnt, data_t &out) {
+    out.clear();
+    out.reserve(IovLength(iov, iovcnt));
+    for (size_t i = 0; i < iovcnt; i++) {
+        out.append((const char *)iov[i].iov_base, iov[i].iov_len);
+    }
+}
+
+data_t FramePool::Acquire(size_t expected) {
+    data_t buffer;
+    if (!free_.empty()) {
+        // Prefer a buffer that is already big enough, otherwise grow the biggest one.
+        auto it = std::max_element(free_.begin(), free_.end(), [](const data_t &a, const data_t &b) {
+            return a.capacity() < b.capacity();
+        });
+        for (auto i = free_.begin(); i != free_.end(); ++i) {
+            if (i->capacity() >= expected && i->capacity() < it->capacity()) {
+                it = i;
+            }
+        }
+
+        buffer = std::move(*it);
+        *it = std::move(free_.back());
+        free_.pop_back();
+        buffer.clear();
+    }
+
+    // When a buffer has to grow anyway, grow it to the high-water mark so it does not grow again soon.
+    if (buffer.capacity() < expected) {
+        buffer.reserve(std::max(expected, highWater_));
+    }
+    return buffer;
+}
+
+void FramePool::Release(data_t &&buffer) {
+    // Moved-from buffers own no storage and are not worth keeping.
+    if (buffer.capacity() <= data_t().capacity()) {
+        return;
+    }
+
+    if (free_.size() < FRAME_POOL_MAX_FREE) {
+        free_.emplace_back(std::move(buffer));
+    }
+}
+
+void FramePool::Record(size_t frameSize) {
+    highWater_ = std::max(frameSize, highWater_ - highWater_ / 256);
 }
\ No newline at end of file
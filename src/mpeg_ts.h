@@ -5,15 +5,25 @@
 #ifndef MPEG_TS_MEDIA_SRC_MPEG_TS_H
 #define MPEG_TS_MEDIA_SRC_MPEG_TS_H
 
+#include "audio_framer.h"
+#include "nal_scanner.h"
+#include <array>
 #include <cstdint>
+#include <deque>
 #include <memory>
 #include <string>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <utility>
 #include <vector>
 
-#define TS_PACKET_SIZE   188 // .ts
-#define M2TS_PACKET_SIZE 192 // .m2ts
-#define TS_SYNC_BYTE     0x47
+#define TS_PACKET_SIZE         188 // .ts
+#define M2TS_PACKET_SIZE       192 // .m2ts, 4-byte TP_extra_header (timecode) before each packet
+#define TS_RS_PACKET_SIZE      204 // .ts with 16 bytes of Reed-Solomon parity after each packet (DVB-ASI)
+#define TS_SYNC_BYTE           0x47
+#define TS_PID_COUNT           8192 // 13-bit PID space
+#define TS_PES_MAX_HEADER_SIZE 19 // fixed part, PTS and DTS
+#define TS_PES_RETAINED_SIZE   32 // fixed part to PES_CRC, the fields TS_PES_Header decodes
 
 using data_t = std::string;
 
@@ -26,6 +36,7 @@ enum TS_PID : uint16_t {
     PID_ASI  = 0x0004, /// Adaptive Streaming Information
     PID_NIT  = 0x0010, /// Network Information Table | ST
     PID_SDT  = 0x0011, /// Service Description Table | BAT | ST
+    PID_NULL = 0x1FFF, /// Null packets
 };
 
 enum TS_TID : uint8_t {
@@ -142,13 +153,41 @@ struct TSPacketHeader {
 //
 //  32  CRC_32
 //
-struct TS_Description {
-    TS_TID tableId : 8; // TID_SDS 0x42, TID_SDS_O 0x46
+struct TS_SDT_Service {
+    uint16_t service_id : 16;
+    uint8_t EIT_schedule_flag : 1;
+    uint8_t EIT_present_following_flag : 1;
+    uint8_t running_status : 3;
+    uint8_t free_CA_mode : 1;
+
+    // service_descriptor (tag 0x48), ETSI EN 300 468 6.2.33; names without their character table prefix
+    uint8_t service_type;
+    std::string provider_name;
+    std::string service_name;
+};
+
+class TS_SDT {
+public:
+    // Only sections of the actual transport stream (TID_SDS) are expected; services are merged by service_id, so
+    // the sections of a multi-section SDT add up.
+    bool Parse(const uint8_t *data, size_t size);
+
+public:
+    uint8_t table_id = TID_SDS;
+    uint16_t section_length : 12;
+    uint16_t transport_stream_id : 16;
+    uint8_t version_number : 5;
+    uint8_t section_number : 8;
+    uint8_t last_section_number : 8;
+    uint16_t original_network_id : 16;
+
+    std::vector<TS_SDT_Service> services;
 };
 
 // Prohibit cast type conversion
 class TS_Adaption {
 public:
+    // Returns false if the fields overrun adaptation_field_length or |size|.
     bool Parse(const uint8_t *data, size_t size);
 
 public:
@@ -197,22 +236,82 @@ public:
 };
 
 struct Frame {
+    uint16_t pid;
     StreamType codecId;
     int64_t pts;
     int64_t dts;
+    bool randomAccess = false; // random_access_indicator of the packet holding the PES header
     data_t data;
+    std::vector<struct iovec> iov; // FRAME_MODE_IOVEC: spans into the input buffers instead of data
+    std::deque<std::array<uint8_t, TS_PACKET_SIZE>> pinned; // payloads copied out of transient buffers
+    std::vector<NalUnit> nalUnits; // H.264/HEVC with MpegTsDemuxer::SetNalScan()
+    bool keyframe = false;         // likewise: an IDR or IRAP picture is among them
     void Clear() {
         codecId = STREAM_TYPE_RESERVED;
         pts = 0;
         dts = 0;
+        randomAccess = false;
         data.clear();
+        iov.clear();
+        pinned.clear();
+        nalUnits.clear();
+        keyframe = false;
+    }
+    // Exchanges everything, buffers included, without allocating; std::swap() may, through the deque.
+    void Swap(Frame &other) {
+        std::swap(pid, other.pid);
+        std::swap(codecId, other.codecId);
+        std::swap(pts, other.pts);
+        std::swap(dts, other.dts);
+        std::swap(randomAccess, other.randomAccess);
+        data.swap(other.data);
+        iov.swap(other.iov);
+        pinned.swap(other.pinned);
+        nalUnits.swap(other.nalUnits);
+        std::swap(keyframe, other.keyframe);
     }
 };
 
-class TS_PES {
+// Short codec name for reports, such as "h264" or "aac"; "unknown" for stream types not listed in StreamType.
+const char *StreamTypeName(uint8_t streamType);
+
+size_t IovLength(const struct iovec *iov, size_t iovcnt);
+
+// Copies the spans into |out|, for consumers that need the frame in one piece.
+void IovLinearize(const struct iovec *iov, size_t iovcnt, data_t &out);
+
+// Per-stream recycler for frame buffers. Buffers are reserved up front, either from the announced PES size or
+// from the recent high-water mark, so appending payloads does not reallocate once the stream has warmed up.
+class FramePool {
+public:
+    data_t Acquire(size_t expected);
+    void Release(data_t &&buffer);
+
+    // Feeds the size of a completed frame into the high-water mark, which decays slowly towards recent sizes.
+    void Record(size_t frameSize);
+    size_t HighWater() const { return highWater_; }
+
+private:
+    std::vector<data_t> free_;
+    size_t highWater_ = 0;
+};
+
+// Every field of a PES header. The demuxer keeps only TS_PES per stream and decodes this on demand, see
+// TS_PES::Header(); the muxer fills one in as the template of its headers.
+class TS_PES_Header {
 public:
+    // Returns the header size, or 0 if |data| does not start with a whole, well-formed PES header.
     int Parse(const uint8_t *data, size_t size);
 
+    // Writes a PES header from stream_id, PES_packet_length, data_alignment_indicator, PTS_DTS_flags and PTS/DTS;
+    // the other optional fields are left out. Returns its size, at most TS_PES_MAX_HEADER_SIZE.
+    size_t Serialize(uint8_t *data) const;
+
+private:
+    friend class TS_PES;
+    // The fields of a header Parse() has checked; reads no more than TS_PES_RETAINED_SIZE bytes of it.
+    void ParseFields(const uint8_t *data);
+
 public:
     uint32_t packet_start_code_prefix : 24; // 0x000001
     uint8_t stream_id : 8;
@@ -236,9 +335,9 @@ public:
     uint8_t PES_header_data_length : 8;
 
     // if (PTS_DTS_flags == '10' || PTS_DTS_flags == '11')
-    uint32_t PTS;
+    uint64_t PTS; // 33 bits
     // if (PTS_DTS_flags == '11')
-    uint32_t DTS;
+    uint64_t DTS;
 
     // if (ESCR_flag == '1')
     uint32_t ESCR_base;
@@ -289,11 +388,39 @@ public:
     uint8_t stream_id_extension : 7;
     uint8_t tref_extension_flag : 1;
     uint32_t TREF : 32;
+};
+
+// Per-stream PES state of the demuxer: the few header fields read for every PES packet, the frame being assembled
+// and the raw start of the last header, from which Header() decodes the rest when asked.
+class TS_PES {
+public:
+    // Same checks and result as TS_PES_Header::Parse(), without decoding the optional fields.
+    int Parse(const uint8_t *data, size_t size);
+
+    // Decodes every field of the last header Parse() accepted. Returns false if there was none.
+    bool Header(TS_PES_Header &header) const;
+
+public:
+    uint8_t stream_id = 0;
+    uint8_t PTS_DTS_flags = 0;
+    uint16_t PES_packet_length = 0;
+    uint8_t PES_header_data_length = 0;
+    uint64_t PTS = 0;
+    uint64_t DTS = 0; // PTS when there is only a PTS
 
     // extra
-    int have_pes_header;
-    int flags;
+    int have_pes_header = 0;
+    int seen_pes_start = 0;  // a PES packet started since this was created, valid header or not
+    int seen_pes_header = 0; // likewise, one with a valid header
+    int flags = 0;
     Frame frame;
+    FramePool pool;
+    NalScanner nal;
+    AudioFramer audio;
+
+private:
+    uint8_t header_[TS_PES_RETAINED_SIZE]; // start of the last header
+    uint8_t headerSize_ = 0;               // of header_, at most TS_PES_RETAINED_SIZE, 0 until a header is accepted
 };
 
 struct TS_PMT_Stream {
@@ -312,6 +439,10 @@ class TS_PMT {
 public:
     bool Parse(const uint8_t *data, size_t size);
 
+    // Writes the section for program_number, version_number, PCR_PID and the stream types and PIDs of |streams|,
+    // without descriptors, CRC_32 included. Returns its size, 0 if it does not fit in |size|.
+    size_t Serialize(uint8_t *data, size_t size) const;
+
 public:
     uint8_t table_id : 8;
     uint8_t section_syntax_indicator : 1;
@@ -343,6 +474,10 @@ class TS_PAT {
 public:
     bool Parse(const uint8_t *data, size_t size);
 
+    // Writes the section for transport_stream_id, version_number and |programs|, CRC_32 included. Returns its
+    // size, 0 if it does not fit in |size|.
+    size_t Serialize(uint8_t *data, size_t size) const;
+
 public:
     uint8_t table_id = TID_PAS;
     uint8_t section_syntax_indicator : 1;
@@ -3,39 +3,382 @@
 //
 
 #include "mpeg_ts_demuxer.h"
+#include "logger.h"
 #include "mpeg_ts.h"
+#include "seek_index.h"
+#include "spsc_ring.h"
+#include "ts_sync.h"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <memory>
+#include <mutex>
+#include <thread>
+
+#define TS_PROBE_SIZE        (TS_RS_PACKET_SIZE * (TS_SYNC_CONFIRM_COUNT + 2))
+#define TS_PREFETCH_DISTANCE 8 // packets
+
+#define PIPELINE_RING_SIZE  4096 // packets queued per worker, about 0.9 MB
+#define PIPELINE_SPIN_COUNT 64   // empty polls before a worker goes to sleep
+
+// Trace logs of the packet path, which only variants with DEMUX_FEATURE_TRACE keep.
+#define DEMUX_TRACE(fmt, ...)                                                                                          \
+    do {                                                                                                               \
+        if (Features & DEMUX_FEATURE_TRACE) {                                                                          \
+            TS_LOGT(fmt, ##__VA_ARGS__);                                                                               \
+        }                                                                                                              \
+    } while (0)
+
+// Worker-side state of one elementary stream PID. The PMT entry only classifies; this copy owns the PES state.
+struct MpegTsDemuxer::PesLane {
+    TS_PMT_Stream stream;
+    PesWorker *worker = nullptr;
+};
+
+// One queued packet. |packet| points into the caller's buffer in zero-copy mode, otherwise at |copy|.
+// A slot without a packet flushes the lane's last frame.
+struct MpegTsDemuxer::PesSlot {
+    PesLane *lane = nullptr;
+    const uint8_t *packet = nullptr;
+    uint8_t streamType = 0;
+    uint8_t offset = 0; // start of the payload
+    PacketContext context = {};
+    uint8_t copy[TS_PACKET_SIZE];
+};
+
+class MpegTsDemuxer::PesWorker {
+public:
+    explicit PesWorker(MpegTsDemuxer *demuxer) : ring(PIPELINE_RING_SIZE), demuxer_(demuxer) {
+        thread_ = std::thread([this]() { Run(); });
+    }
+
+    ~PesWorker() {
+        stop_.store(true);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            cond_.notify_one();
+        }
+        thread_.join();
+    }
+
+    // Producer side, after Push(): wakes the worker if it went to sleep on an empty ring.
+    void Wake() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping_.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            cond_.notify_one();
+        }
+    }
+
+    SpscRing<PesSlot> ring;
+    size_t lanes = 0;
+
+private:
+    void Run() {
+        int idle = 0;
+        while (true) {
+            PesSlot *slot = ring.Front();
+            if (slot) {
+                demuxer_->HandleSlot(*slot);
+                ring.Pop();
+                idle = 0;
+                continue;
+            }
+
+            if (stop_.load()) {
+                return;
+            }
+
+            if (++idle < PIPELINE_SPIN_COUNT) {
+                std::this_thread::yield();
+                continue;
+            }
+
+            // Pairs with the fence in Wake(): either the producer sees |sleeping_| or we see its packet.
+            std::unique_lock<std::mutex> lock(mutex_);
+            sleeping_.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            cond_.wait(lock, [this]() { return !ring.Empty() || stop_.load(); });
+            sleeping_.store(false, std::memory_order_relaxed);
+            idle = 0;
+        }
+    }
+
+    MpegTsDemuxer *demuxer_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::atomic<bool> sleeping_{false};
+    std::atomic<bool> stop_{false};
+    std::thread thread_;
+};
+
+MpegTsDemuxer::MpegTsDemuxer() {
+    RebuildPidTable();
+}
+
+MpegTsDemuxer::~MpegTsDemuxer() {
+    // Workers go first: they still reference the lanes.
+    workers_.clear();
+}
+
+std::unique_ptr<MpegTsDemuxer> MpegTsDemuxer::Create(size_t packetSize, unsigned features) {
+    bool es = (features & DEMUX_FEATURES_ALL) == DEMUX_FEATURES_ES;
+    switch (packetSize) {
+        case TS_PACKET_SIZE:
+            if (es) {
+                return std::make_unique<MpegTsDemuxerT<TS_PACKET_SIZE, DEMUX_FEATURES_ES>>();
+            }
+            return std::make_unique<MpegTsDemuxerT<TS_PACKET_SIZE, DEMUX_FEATURES_ALL>>();
+        case M2TS_PACKET_SIZE:
+            if (es) {
+                return std::make_unique<MpegTsDemuxerT<M2TS_PACKET_SIZE, DEMUX_FEATURES_ES>>();
+            }
+            return std::make_unique<MpegTsDemuxerT<M2TS_PACKET_SIZE, DEMUX_FEATURES_ALL>>();
+        case TS_RS_PACKET_SIZE:
+            if (es) {
+                return std::make_unique<MpegTsDemuxerT<TS_RS_PACKET_SIZE, DEMUX_FEATURES_ES>>();
+            }
+            return std::make_unique<MpegTsDemuxerT<TS_RS_PACKET_SIZE, DEMUX_FEATURES_ALL>>();
+        default:
+            return std::make_unique<MpegTsDemuxer>();
+    }
+}
+
+void MpegTsDemuxer::SetAnalyzer(std::shared_ptr<TsAnalyzer> analyzer) {
+    analyzer_ = std::move(analyzer);
+    if (analyzer_) {
+        analyzer_->Programs(pat_);
+    }
+}
+
+void MpegTsDemuxer::SetWorkerThreads(int threads) {
+    if (!workers_.empty() || threads <= 0) {
+        return;
+    }
+
+    laneTable_ = std::make_unique<std::array<PesLane *, TS_PID_COUNT>>();
+    laneTable_->fill(nullptr);
+    for (int i = 0; i < threads; i++) {
+        workers_.emplace_back(std::make_unique<PesWorker>(this));
+    }
+}
 
-static uint64_t count = 0;
 void MpegTsDemuxer::Input(const uint8_t *data, size_t size) {
-    printf("[%lu] Input data %02x %02x %02x %02x, size: %zu\n", count++, data[0], data[1], data[2], data[3], size);
+    InputData(data, size);
+    if (batchSize_ > 0) {
+        DeliverBatch();
+    }
+}
 
-    assert(size == TS_PACKET_SIZE);
-    assert(data[0] == TS_SYNC_BYTE);
+void MpegTsDemuxer::InputData(const uint8_t *data, size_t size) {
+    TS_LOGT("Input data size: %zu", size);
+    if (size == 0) {
+        return;
+    }
+
+    uint64_t offset = bytesIn_;
+    bytesIn_ += size;
+    if (packetSize_ == 0 && probe_.empty() && size >= TS_PROBE_SIZE) {
+        // Enough to detect the packet size in place, so frames may keep spans into |data|.
+        const uint8_t *sync = nullptr;
+        size_t packetSize = TsDetectPacketSize(data, size, &sync);
+        if (packetSize) {
+            packetSize_ = packetSize;
+            TS_LOGI("Packet size %zu, first packet at offset %zu", packetSize_, (size_t)(sync - data));
+            InputBuffer(sync, data + size - sync, false, offset + (sync - data));
+            return;
+        }
+    }
+
+    if (packetSize_ == 0) {
+        // Not enough data yet to tell 188/192/204 apart reliably, hold on to it.
+        probe_.append((const char *)data, size);
+        if (probe_.size() < TS_PROBE_SIZE) {
+            return;
+        }
+        ProbePacketSize(false);
+        return;
+    }
+
+    InputBuffer(data, size, false, offset);
+}
+
+void MpegTsDemuxer::ProbePacketSize(bool flush) {
+    const uint8_t *data = (const uint8_t *)probe_.data();
+    const uint8_t *sync = nullptr;
+    size_t packetSize = TsDetectPacketSize(data, probe_.size(), &sync);
+    if (packetSize == 0) {
+        if (!flush) {
+            // Keep the tail in case a valid stream starts across the boundary.
+            if (probe_.size() > TS_PROBE_SIZE) {
+                probe_.erase(0, probe_.size() - TS_PROBE_SIZE);
+            }
+            return;
+        }
+
+        // A single packet cannot be confirmed; take it as plain TS.
+        sync = TsFindSyncByte(data, data + probe_.size());
+        packetSize = TS_PACKET_SIZE;
+    }
+
+    packetSize_ = packetSize;
+    TS_LOGI("Packet size %zu, first packet at offset %zu", packetSize_, (size_t)(sync - data));
+
+    // The probe buffer is reused, so frames must not keep spans into it.
+    size_t offset = sync - data;
+    data_t probe;
+    probe.swap(probe_);
+    InputBuffer((const uint8_t *)probe.data() + offset, probe.size() - offset, true,
+                bytesIn_ - probe.size() + offset);
+}
+
+template <size_t PacketSize, unsigned Features>
+void MpegTsDemuxer::InputBufferT(const uint8_t *data, size_t size, bool transient, uint64_t offset) {
+    const size_t packetSize = PacketSize ? PacketSize : packetSize_;
+    const uint8_t *p = data;
+    const uint8_t *end = data + size;
+
+    // The carried sync byte may be a stray one, as a resync near the end of a buffer can pick; a packet may still
+    // start later in the carried bytes, so they are searched before the new ones.
+    uint64_t lostOffset = carryOffset_;
+    size_t skipped = 0;
+    auto lost = [&](size_t bytes) {
+        TS_LOGW("Lost sync at a buffer boundary, skipped %zu bytes", bytes);
+        if ((Features & DEMUX_FEATURE_STATS) && analyzer_) {
+            analyzer_->SyncLoss(bytes, lostOffset);
+        }
+    };
+    while (carrySize_ > 0) {
+        size_t need = std::min(packetSize - carrySize_, (size_t)(end - p));
+        memcpy(carry_ + carrySize_, p, need);
+        carrySize_ += need;
+        p += need;
+        // A carried packet counts once the byte after it is a sync byte, so one that fills up at the end of |data|
+        // waits for the next Input(), or for Flush().
+        if (carrySize_ < packetSize || p == end) {
+            if (skipped > 0) {
+                lost(skipped);
+            }
+            return;
+        }
+
+        if (*p == TS_SYNC_BYTE) {
+            if (skipped > 0) {
+                lost(skipped);
+            }
+            carrySize_ = 0;
+            transient_ = true;
+            packetOffset_ = carryOffset_;
+            InputPacketT<Features>(carry_);
+            transient_ = transient;
+            break;
+        }
+
+        const uint8_t *next = TsFindSyncByte(carry_ + 1, carry_ + carrySize_);
+        size_t shift = next - carry_;
+        skipped += shift;
+        carrySize_ -= shift;
+        carryOffset_ += shift;
+        if (carrySize_ > 0) {
+            memmove(carry_, next, carrySize_);
+            continue;
+        }
+
+        next = TsResync(p, end, packetSize);
+        lost(skipped + (next - p));
+        p = next;
+    }
+
+    transient_ = transient;
+    while (p + packetSize <= end) {
+        __builtin_prefetch(p + TS_PREFETCH_DISTANCE * packetSize);
+
+        // A packet only counts when the next one starts where it should; otherwise it was cut short.
+        if (p[0] == TS_SYNC_BYTE && (p + packetSize == end || p[packetSize] == TS_SYNC_BYTE)) {
+            packetOffset_ = offset + (p - data);
+            InputPacketT<Features>(p);
+            p += packetSize;
+            continue;
+        }
+
+        const uint8_t *next = TsResync(p + 1, end, packetSize);
+        TS_LOGW("Lost sync, skipped %zu bytes", (size_t)(next - p));
+        if ((Features & DEMUX_FEATURE_STATS) && analyzer_) {
+            analyzer_->SyncLoss(next - p, offset + (p - data));
+        }
+        p = next;
+    }
+    transient_ = false;
+
+    // Whatever is left starts at a sync byte and is shorter than a packet.
+    carrySize_ = end - p;
+    carryOffset_ = offset + (p - data);
+    memcpy(carry_, p, carrySize_);
+}
+
+template <unsigned Features>
+void MpegTsDemuxer::InputPacketT(const uint8_t *data) {
+    const size_t size = TS_PACKET_SIZE;
+
+    if (Features & DEMUX_FEATURE_STATS) {
+        if (stats_) {
+            stats_->Packet(data, packetSize_);
+        }
+        if (analyzer_) {
+            analyzer_->Packet(data, packetOffset_);
+        }
+    }
 
     TSPacketHeader *tsPacket = (TSPacketHeader *)data;
 
     uint16_t pid = tsPacket->GetPID();
-    printf("PID[0x%04x]: Error: %u, Start:%u, Priority:%u, Scrambler:%u, Adaptation: %u, Counter: %u\n", pid,
-           tsPacket->transport_error_indicator, tsPacket->payload_unit_start_indicator, tsPacket->transport_priority,
-           tsPacket->transport_scrambling_control, tsPacket->adaptation_field_control, tsPacket->continuity_counter);
+    DEMUX_TRACE("PID[0x%04x]: Error: %u, Start:%u, Priority:%u, Scrambler:%u, Adaptation: %u, Counter: %u", pid,
+                tsPacket->transport_error_indicator, tsPacket->payload_unit_start_indicator,
+                tsPacket->transport_priority, tsPacket->transport_scrambling_control,
+                tsPacket->adaptation_field_control, tsPacket->continuity_counter);
+
+    const PidEntry &entry = pidTable_[pid];
+    if (entry.type == PID_TYPE_NULL) {
+        return;
+    }
+
+    if (psiOnly_ && entry.type == PID_TYPE_ES) {
+        entry.stream->continuity_counter = tsPacket->continuity_counter;
+        return;
+    }
 
     size_t i = 4;
-    if (tsPacket->adaptation_field_control & 0x02) {
-        printf("Find adaptation field\n");
+    bool randomAccess = false;
+    constexpr bool parseAdaptation = Features & (DEMUX_FEATURE_ADAPTATION | DEMUX_FEATURE_PCR);
+    if ((tsPacket->adaptation_field_control & 0x02) && !parseAdaptation) {
+        // Skipped unread; a length running past the packet leaves no payload.
+        i += data[i] + 1;
+        if (i + (tsPacket->payload_unit_start_indicator ? 1 : 0) >= size) {
+            return;
+        }
+    } else if (tsPacket->adaptation_field_control & 0x02) {
+        DEMUX_TRACE("Find adaptation field");
         TS_Adaption adaptation;
-        adaptation.Parse(data + i, size - i);
+        if (!adaptation.Parse(data + i, size - i)) {
+            TS_LOGW("Invalid adaptation field on PID 0x%04x", pid);
+            return;
+        }
 
-        if (adaptation.adaptation_field_length > 0 && adaptation.PCR_flag) {
+        if ((Features & DEMUX_FEATURE_PCR) && adaptation.adaptation_field_length > 0 && adaptation.PCR_flag) {
             int64_t t = adaptation.program_clock_reference_base / 90L; // ms
-            printf("pcr: %02d:%02d:%02d.%03d - %lu/%u\n", (int)(t / 3600000), (int)(t % 3600000) / 60000,
-                   (int)((t / 1000) % 60), (int)(t % 1000), adaptation.program_clock_reference_base,
-                   adaptation.program_clock_reference_extension);
+            TS_LOGD("pcr: %02d:%02d:%02d.%03d - %lu/%u", (int)(t / 3600000), (int)(t % 3600000) / 60000,
+                    (int)((t / 1000) % 60), (int)(t % 1000), adaptation.program_clock_reference_base,
+                    adaptation.program_clock_reference_extension);
+            if (pcrCallback_) {
+                pcrCallback_(pid, adaptation.program_clock_reference_base, packetOffset_);
+            }
         }
+        randomAccess = adaptation.adaptation_field_length > 0 && adaptation.random_access_indicator;
 
         i += (adaptation.adaptation_field_length + 1);
         if (i + (tsPacket->payload_unit_start_indicator ? 1 : 0) >= size) {
@@ -43,110 +386,578 @@ void MpegTsDemuxer::Input(const uint8_t *data, size_t size) {
         }
     }
 
-    if (tsPacket->adaptation_field_control & 0x01) {
-        if (pid == PID_PAT) {
-            printf("This is a PAT\n");
-            if (tsPacket->payload_unit_start_indicator) {
-                i++; // skip pointer_field 0x00
-            }
-
-            pat_.Parse(data + i, size - i);
-        } else if (pid == PID_SDT) {
-            HandleSDT(data, size);
-        } else {
-            for (size_t j = 0; j < pat_.programs.size(); j++) {
-                if (pid == pat_.programs[j].program_map_PID) {
-                    printf("This is a PMT\n");
-                    if (tsPacket->payload_unit_start_indicator) {
-                        i++;
-                    }
-
-                    if (!pat_.programs[j].pmt) {
-                        pat_.programs[j].pmt = std::make_shared<TS_PMT>();
-                    }
-                    pat_.programs[j].pmt->Parse(data + i, size - i);
-                    break;
-                } else {
-                    for (size_t k = 0; k < pat_.programs[j].pmt->streams.size(); k++) {
-                        TS_PMT_Stream *stream = &pat_.programs[j].pmt->streams[k];
-                        if (pid != stream->elementary_PID) {
-                            printf("stream->elementary_PID: %d, current PID: %d\n", stream->elementary_PID, pid);
-                            continue;
-                        }
-
-                        printf("Find stream with pid: %04x\n", pid);
-
-                        if (!stream->pes) {
-                            stream->pes = std::make_shared<TS_PES>();
-                            stream->continuity_counter = 0x0f;
-                        }
-
-                        if (tsPacket->continuity_counter != (stream->continuity_counter + 1) % 16) {
-                            printf("Error pes lost, lastCC = %d, currentCC = %d\n", stream->continuity_counter,
-                                   tsPacket->continuity_counter);
-                        }
-                        stream->continuity_counter = tsPacket->continuity_counter;
-
-                        if (tsPacket->payload_unit_start_indicator) {
-                            size_t n = stream->pes->Parse(data + i, size - i);
-                            assert(n > 0);
-                            i += n;
-                            printf("payload_unit_start_indicator i = %zu, n = %zu\n", i, n);
-                            stream->pes->have_pes_header = n > 0 ? 1 : 0;
-                        } else if (!stream->pes->have_pes_header) {
-                            continue; // don't have pes header yet
-                        }
-
-                        const uint8_t *p = data + i;
-                        size_t length = size - i;
-
-                        assert(stream->pes->DTS != 0);
-
-                        if (length < 0) {
-                            continue;
-                        }
-
-                        if (tsPacket->payload_unit_start_indicator || stream->pes->DTS != stream->pes->frame.dts) {
-                            if (callback_ && stream->pes->frame.data.size()) {
-                                printf("callback\n");
-                                callback_(stream->pes->frame.codecId, stream->pes->frame.pts, stream->pes->frame.dts,
-                                          (const uint8_t *)stream->pes->frame.data.data(),
-                                          stream->pes->frame.data.size());
-                            }
-                            stream->pes->frame.Clear();
-                            stream->pes->frame.dts = stream->pes->DTS;
-                            stream->pes->frame.pts = stream->pes->PTS;
-                            stream->pes->frame.codecId = (StreamType)stream->stream_type;
-                        }
-
-                        printf("append frame (%zu)\n", length);
-                        stream->pes->frame.data.append((const char *)p, length);
-
-                        break; // find stream
-                    }
-                }
+    if (!(tsPacket->adaptation_field_control & 0x01)) {
+        return;
+    }
+
+    switch (entry.type) {
+        case PID_TYPE_PAT:
+        case PID_TYPE_PMT:
+        case PID_TYPE_SDT:
+            HandlePSI(pid, tsPacket, data + i, size - i);
+            break;
+        case PID_TYPE_ES: {
+            PacketContext context = {packetOffset_, transient_, randomAccess};
+            if (laneTable_) {
+                DispatchPES(entry.stream, data, i, context);
+            } else {
+                HandlePES<Features>(entry.stream, tsPacket, data + i, size - i, context);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void MpegTsDemuxer::InputBuffer(const uint8_t *data, size_t size, bool transient, uint64_t offset) {
+    InputBufferT<0, DEMUX_FEATURES_ALL>(data, size, transient, offset);
+}
+
+void MpegTsDemuxer::InputPacket(const uint8_t *data) {
+    InputPacketT<DEMUX_FEATURES_ALL>(data);
+}
+
+void MpegTsDemuxer::HandlePSI(uint16_t pid, const TSPacketHeader *tsPacket, const uint8_t *data, size_t size) {
+    sections_[pid].Push(data, size, tsPacket->payload_unit_start_indicator, tsPacket->continuity_counter,
+                        [&](const uint8_t *section, size_t sectionSize) { HandleSection(pid, section, sectionSize); });
+}
+
+void MpegTsDemuxer::HandleSection(uint16_t pid, const uint8_t *section, size_t size) {
+    const PidEntry &entry = pidTable_[pid];
+    bool cached = (entry.type == PID_TYPE_PAT && section[0] == TID_PAS) ||
+                  (entry.type == PID_TYPE_PMT && section[0] == TID_PMS) ||
+                  (entry.type == PID_TYPE_SDT && section[0] == TID_SDS);
+
+    if (!cached) {
+        if (analyzer_) {
+            analyzer_->Section(pid, section, size, false);
+        }
+        return;
+    }
+
+    // Repeats of the current version are dropped here, before any parsing, and the analyzer is told when the cache
+    // has vouched for the CRC so that it does not compute it again.
+    SectionState state = sectionCache_.Update(pid, section, size);
+    if (analyzer_) {
+        analyzer_->Section(pid, section, size, state != SECTION_CORRUPT);
+    }
+    if (state != SECTION_NEW) {
+        return;
+    }
+
+    if (entry.type == PID_TYPE_PAT) {
+        TS_LOGT("This is a PAT");
+        if (sectionCallback_) {
+            sectionCallback_(pid, section, size);
+        }
+        size_t programCount = pat_.programs.size();
+        pat_.Parse(section, size);
+        if (pat_.programs.size() != programCount) {
+            RebuildPidTable();
+        }
+    } else if (entry.type == PID_TYPE_PMT) {
+        TS_LOGT("This is a PMT");
+        if (sectionCallback_) {
+            sectionCallback_(pid, section, size);
+        }
+        HandlePMT(entry.program, section, size);
+    } else {
+        if (sectionCallback_) {
+            sectionCallback_(pid, section, size);
+        }
+        HandleSDT(section, size);
+    }
+}
+
+void MpegTsDemuxer::HandlePMT(TS_PAT_Program *program, const uint8_t *data, size_t size) {
+    bool created = false;
+    if (!program->pmt) {
+        program->pmt = std::make_shared<TS_PMT>();
+        created = true;
+    }
+
+    size_t streamCount = program->pmt->streams.size();
+    program->pmt->Parse(data, size);
+    if (created || program->pmt->streams.size() != streamCount) {
+        RebuildPidTable();
+    }
+}
+
+template <unsigned Features>
+void MpegTsDemuxer::HandlePES(TS_PMT_Stream *stream, const TSPacketHeader *tsPacket, const uint8_t *data,
+                              size_t size, const PacketContext &context) {
+    uint16_t pid = stream->elementary_PID;
+    DEMUX_TRACE("Find stream with pid: %04x", pid);
+
+    // A stream's first packet (or the first after a seek) has nothing to be continuous with.
+    bool first = !stream->pes;
+    if (first) {
+        stream->pes = std::make_shared<TS_PES>();
+    }
+
+    if ((Features & DEMUX_FEATURE_CC) && !first &&
+        tsPacket->continuity_counter != (stream->continuity_counter + 1) % 16) {
+        TS_LOGW("Error pes lost, lastCC = %d, currentCC = %d", stream->continuity_counter,
+                tsPacket->continuity_counter);
+    }
+    stream->continuity_counter = tsPacket->continuity_counter;
+
+    size_t i = 0;
+    if (tsPacket->payload_unit_start_indicator) {
+        stream->pes->seen_pes_start = 1;
+        size_t n = stream->pes->Parse(data, size);
+        if (n == 0) {
+            TS_LOGW("Invalid PES header on PID 0x%04x", pid);
+            stream->pes->have_pes_header = 0;
+            return;
+        }
+        i += n;
+        DEMUX_TRACE("payload_unit_start_indicator i = %zu, n = %zu", i, n);
+        stream->pes->have_pes_header = n > 0 ? 1 : 0;
+
+        if (!stream->pes->seen_pes_header && orphanCallback_) {
+            orphanCallback_(pid, nullptr, 0);
+        }
+        stream->pes->seen_pes_header = 1;
+
+        if (unitCallback_ && n > 0 && (size_t)n <= size) {
+            AccessUnit unit = {context.offset, pid, (StreamType)stream->stream_type, (int64_t)stream->pes->PTS,
+                               (int64_t)stream->pes->DTS, context.randomAccess, data + n, size - n};
+            unitCallback_(unit);
+        }
+    } else if (!stream->pes->have_pes_header) {
+        // Once a PES packet has started, even with an invalid header, the payload is dropped as in a serial run.
+        if (orphanCallback_ && !stream->pes->seen_pes_start) {
+            orphanCallback_(pid, data, size);
+        }
+        return; // don't have pes header yet
+    }
+
+    if (i > size) {
+        return;
+    }
+
+    const uint8_t *p = data + i;
+    size_t length = size - i;
+
+    assert(stream->pes->DTS != 0);
+
+    if (tsPacket->payload_unit_start_indicator || (int64_t)stream->pes->DTS != stream->pes->frame.dts) {
+        // PES_packet_length counts everything after itself, i.e. the header remainder plus the payload.
+        size_t expected = 0;
+        if (tsPacket->payload_unit_start_indicator && stream->pes->PES_packet_length > 0 &&
+            (size_t)stream->pes->PES_packet_length + 6 > i) {
+            expected = stream->pes->PES_packet_length + 6 - i;
+        }
+
+        NextFrame(stream, expected);
+        stream->pes->frame.randomAccess = tsPacket->payload_unit_start_indicator && context.randomAccess;
+    }
+
+    DEMUX_TRACE("append frame (%zu)", length);
+    Frame &frame = stream->pes->frame;
+    if (frameMode_ == FRAME_MODE_IOVEC) {
+        if (context.transient && length > 0) {
+            // The packet sits in an internal buffer that is about to be reused; keep a copy with the frame.
+            frame.pinned.emplace_back();
+            memcpy(frame.pinned.back().data(), p, length);
+            p = frame.pinned.back().data();
+        }
+
+        if (!frame.iov.empty() && (const uint8_t *)frame.iov.back().iov_base + frame.iov.back().iov_len == p) {
+            frame.iov.back().iov_len += length;
+        } else if (length > 0) {
+            frame.iov.push_back({(void *)p, length});
+        }
+    } else {
+        frame.data.append((const char *)p, length);
+    }
+    stream->pes->nal.Scan(p, length, frame.nalUnits, frame.keyframe);
+}
+
+void MpegTsDemuxer::DispatchPES(TS_PMT_Stream *stream, const uint8_t *data, size_t offset,
+                                const PacketContext &context) {
+    PesLane *&lane = (*laneTable_)[stream->elementary_PID];
+    if (!lane) {
+        // Spread the streams over the workers as they turn up.
+        auto worker = std::min_element(workers_.begin(), workers_.end(),
+                                       [](const auto &a, const auto &b) { return a->lanes < b->lanes; });
+        lanes_.emplace_back(std::make_unique<PesLane>());
+        lane = lanes_.back().get();
+        lane->stream = *stream;
+        lane->stream.pes.reset();
+        lane->worker = worker->get();
+        lane->worker->lanes++;
+    }
+
+    PesWorker *worker = lane->worker;
+    PesSlot *slot = worker->ring.Back();
+    while (!slot) {
+        // The worker is behind; everything else waits on it once its ring is full.
+        worker->Wake();
+        std::this_thread::yield();
+        slot = worker->ring.Back();
+    }
+
+    slot->lane = lane;
+    slot->streamType = stream->stream_type;
+    slot->offset = (uint8_t)offset;
+    slot->context = context;
+    if (frameMode_ == FRAME_MODE_IOVEC && !context.transient) {
+        slot->packet = data;
+    } else {
+        // Copy mode callers may reuse their buffer as soon as Input() returns.
+        memcpy(slot->copy, data, TS_PACKET_SIZE);
+        slot->packet = slot->copy;
+        slot->context.transient = true;
+    }
+    worker->ring.Push();
+    worker->Wake();
+}
+
+void MpegTsDemuxer::WaitWorkers() {
+    for (auto &worker : workers_) {
+        while (!worker->ring.Empty()) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void MpegTsDemuxer::HandleSlot(PesSlot &slot) {
+    TS_PMT_Stream *stream = &slot.lane->stream;
+    if (!slot.packet) {
+        if (stream->pes) {
+            EmitFrame(stream->pes.get());
+            stream->pes->frame.Clear();
+        }
+        return;
+    }
+
+    // The PMT changed the stream type: start over, as TS_PMT::Parse() does for the serial path.
+    if (stream->stream_type != slot.streamType) {
+        stream->stream_type = slot.streamType;
+        stream->pes.reset();
+    }
+
+    const TSPacketHeader *tsPacket = (const TSPacketHeader *)slot.packet;
+    HandlePES<DEMUX_FEATURES_ALL>(stream, tsPacket, slot.packet + slot.offset, TS_PACKET_SIZE - slot.offset,
+                                  slot.context);
+}
+
+void MpegTsDemuxer::NextFrame(TS_PMT_Stream *stream, size_t expected) {
+    TS_PES *pes = stream->pes.get();
+    Frame &frame = pes->frame;
+
+    size_t size = frameMode_ == FRAME_MODE_IOVEC ? IovLength(frame.iov.data(), frame.iov.size()) : frame.data.size();
+    EmitFrame(pes);
+    if (size > 0) {
+        pes->pool.Record(size);
+    }
+
+    frame.Clear();
+    frame.pid = stream->elementary_PID;
+    frame.dts = pes->DTS;
+    frame.pts = pes->PTS;
+    frame.codecId = (StreamType)stream->stream_type;
+    if (nalScan_) {
+        pes->nal.Reset(stream->stream_type);
+    }
+
+    if (frameMode_ == FRAME_MODE_COPY) {
+        if (expected == 0) {
+            expected = pes->pool.HighWater();
+        }
+
+        // A frame callback may have moved the buffer out, in which case the pool provides the next one.
+        if (frame.data.capacity() < expected) {
+            pes->pool.Release(std::move(frame.data));
+            frame.data = pes->pool.Acquire(expected);
+        }
+    }
+}
+
+void MpegTsDemuxer::Recycle(uint16_t pid, data_t &&buffer) {
+    if (laneTable_) {
+        PesLane *lane = (*laneTable_)[pid & (TS_PID_COUNT - 1)];
+        if (lane && lane->stream.pes) {
+            lane->stream.pes->pool.Release(std::move(buffer));
+        }
+        return;
+    }
+
+    const PidEntry &entry = pidTable_[pid & (TS_PID_COUNT - 1)];
+    if (entry.type == PID_TYPE_ES && entry.stream->pes) {
+        entry.stream->pes->pool.Release(std::move(buffer));
+    }
+}
+
+void MpegTsDemuxer::EmitFrame(TS_PES *pes) {
+    Frame &frame = pes->frame;
+    pes->nal.Finish(frame.nalUnits);
+
+    // Before the frame callback, which may move the data out.
+    if (audioCallback_ && AudioFramer::Supports(frame.codecId)) {
+        if (frameMode_ == FRAME_MODE_IOVEC) {
+            pes->audio.Split(frame.pid, frame.codecId, frame.pts, frame.iov.data(), frame.iov.size(), audioCallback_);
+        } else if (frame.data.size()) {
+            struct iovec span = {&frame.data[0], frame.data.size()};
+            pes->audio.Split(frame.pid, frame.codecId, frame.pts, &span, 1, audioCallback_);
+        }
+    }
+
+    if (stats_) {
+        size_t size =
+            frameMode_ == FRAME_MODE_IOVEC ? IovLength(frame.iov.data(), frame.iov.size()) : frame.data.size();
+        if (size > 0) {
+            stats_->Frame(frame.pid, size);
+        }
+    }
+
+    if (frameMode_ == FRAME_MODE_IOVEC ? frame.iov.empty() : frame.data.empty()) {
+        return;
+    }
+
+    if (!sink_) {
+        callbackSink_.OnFrame(frame);
+    } else if (batched_ && !laneTable_) {
+        // Swapped, so the stream carries on with the cleared buffers of an earlier batch, preferably of a frame of
+        // its own, as those have the right size.
+        if (batchSize_ == batch_.size()) {
+            batch_.emplace_back();
+        }
+        for (size_t i = batchSize_ + 1; i < batch_.size() && batch_[batchSize_].pid != frame.pid; i++) {
+            if (batch_[i].pid == frame.pid) {
+                batch_[batchSize_].Swap(batch_[i]);
             }
         }
+        batch_[batchSize_++].Swap(frame);
+    } else {
+        sink_->OnFrames(&frame, 1);
+    }
+}
+
+void MpegTsDemuxer::CallbackSink::OnFrame(Frame &frame) {
+    MpegTsDemuxer &demuxer = *demuxer_;
+    TS_LOGT("callback");
+    if (demuxer.frameCallback_) {
+        demuxer.frameCallback_(frame);
+    } else if (demuxer.frameMode_ == FRAME_MODE_IOVEC) {
+        if (demuxer.iovCallback_) {
+            demuxer.iovCallback_(frame.codecId, frame.pts, frame.dts, frame.iov.data(), frame.iov.size());
+        }
+    } else if (demuxer.callback_) {
+        demuxer.callback_(frame.codecId, frame.pts, frame.dts, (const uint8_t *)frame.data.data(), frame.data.size());
     }
 }
 
+void MpegTsDemuxer::DeliverBatch() {
+    sink_->OnFrames(batch_.data(), batchSize_);
+    // Buffers stay with their slots, for the streams to swap in as their next frames complete.
+    for (size_t i = 0; i < batchSize_; i++) {
+        batch_[i].Clear();
+    }
+    batchSize_ = 0;
+}
+
+void MpegTsDemuxer::CopyPsi(const MpegTsDemuxer &other) {
+    pat_ = other.pat_;
+    sdt_ = other.sdt_;
+    for (auto &program : pat_.programs) {
+        if (!program.pmt) {
+            continue;
+        }
+
+        // Fresh PES state, but keep the continuity counters so the first packets are not reported as lost.
+        program.pmt = std::make_shared<TS_PMT>(*program.pmt);
+        for (auto &stream : program.pmt->streams) {
+            stream.pes = std::make_shared<TS_PES>();
+        }
+    }
+
+    // Sections still being assembled carry on in this demuxer.
+    sections_ = other.sections_;
+    sectionCache_ = other.sectionCache_;
+    SetPacketSize(other.packetSize_);
+    RebuildPidTable();
+}
+
+void MpegTsDemuxer::TakeOpenFrames(const DemuxOpenFrameCallback &callback) {
+    FlushInput();
+    if (batchSize_ > 0) {
+        DeliverBatch();
+    }
+    for (auto &program : pat_.programs) {
+        if (!program.pmt) {
+            continue;
+        }
+
+        for (auto &stream : program.pmt->streams) {
+            if (stream.pes && stream.pes->seen_pes_start) {
+                callback(stream.elementary_PID, stream.pes->frame, stream.pes->have_pes_header);
+                stream.pes->frame.Clear();
+            }
+        }
+    }
+}
+
+int64_t MpegTsDemuxer::Seek(const SeekIndex &index, int64_t time) {
+    const SeekIndexEntry *entry = index.Find(time);
+    if (!entry) {
+        return -1;
+    }
+
+    // Nothing assembled so far continues at the new position.
+    WaitWorkers();
+    probe_.clear();
+    carrySize_ = 0;
+    sections_.clear();
+    for (auto &program : pat_.programs) {
+        if (program.pmt) {
+            for (auto &stream : program.pmt->streams) {
+                stream.pes.reset();
+            }
+        }
+    }
+    for (auto &lane : lanes_) {
+        lane->stream.pes.reset();
+    }
+
+    if (packetSize_ == 0) {
+        packetSize_ = index.PacketSize();
+    }
+
+    bool havePmt = std::any_of(pat_.programs.begin(), pat_.programs.end(),
+                               [](const TS_PAT_Program &program) { return program.pmt != nullptr; });
+    if (!havePmt) {
+        index.ForEachSection(
+            [this](uint16_t pid, const uint8_t *section, size_t size) { HandleSection(pid, section, size); });
+    }
+
+    TS_LOGI("Seek to %.3fs: PID 0x%04x at offset %lu", entry->time / 90000.0, entry->pid, entry->offset);
+    bytesIn_ = entry->offset;
+    return (int64_t)entry->offset;
+}
+
+void MpegTsDemuxer::RebuildPidTable() {
+    for (auto &entry : pidTable_) {
+        entry.type = PID_TYPE_IGNORE;
+        entry.program = nullptr;
+    }
+
+    pidTable_[PID_PAT].type = PID_TYPE_PAT;
+    pidTable_[PID_SDT].type = PID_TYPE_SDT;
+    pidTable_[PID_NULL].type = PID_TYPE_NULL;
+
+    for (auto &program : pat_.programs) {
+        pidTable_[program.program_map_PID].type = PID_TYPE_PMT;
+        pidTable_[program.program_map_PID].program = &program;
+    }
+
+    // Elementary streams are filled in after every PMT, so a PMT PID is never shadowed by a stream PID
+    // announced in another program.
+    for (auto &program : pat_.programs) {
+        if (!program.pmt) {
+            continue;
+        }
+
+        for (auto &stream : program.pmt->streams) {
+            PidEntry &entry = pidTable_[stream.elementary_PID];
+            if (entry.type != PID_TYPE_IGNORE) {
+                continue;
+            }
+            entry.type = PID_TYPE_ES;
+            entry.stream = &stream;
+        }
+    }
+
+    if (analyzer_) {
+        analyzer_->Programs(pat_);
+    }
+}
+
+void MpegTsDemuxer::FlushInput() {
+    if (packetSize_ == 0 && probe_.size() >= TS_PACKET_SIZE) {
+        ProbePacketSize(true);
+    }
+
+    // The last packet of an M2TS or RS stream is complete without its trailing bytes.
+    if (carrySize_ >= TS_PACKET_SIZE && carry_[0] == TS_SYNC_BYTE) {
+        transient_ = true;
+        packetOffset_ = carryOffset_;
+        InputPacket(carry_);
+        transient_ = false;
+    }
+    carrySize_ = 0;
+}
+
 void MpegTsDemuxer::Flush() {
-    printf("Flush() enter\n");
+    TS_LOGD("Flush() enter");
+    FlushInput();
+
+    if (laneTable_) {
+        for (auto &lane : lanes_) {
+            PesSlot *slot = lane->worker->ring.Back();
+            while (!slot) {
+                lane->worker->Wake();
+                std::this_thread::yield();
+                slot = lane->worker->ring.Back();
+            }
+            slot->lane = lane.get();
+            slot->packet = nullptr;
+            lane->worker->ring.Push();
+            lane->worker->Wake();
+        }
+
+        WaitWorkers();
+        return;
+    }
+
     for (size_t i = 0; i < pat_.programs.size(); i++) {
+        if (!pat_.programs[i].pmt) {
+            continue;
+        }
+
         for (size_t j = 0; j < pat_.programs[i].pmt->streams.size(); j++) {
             TS_PMT_Stream *stream = &pat_.programs[i].pmt->streams[j];
             if (stream && stream->pes) {
-                if (callback_ && stream->pes->frame.data.size()) {
-                    printf("callback\n");
-                    callback_(stream->pes->frame.codecId, stream->pes->frame.pts, stream->pes->frame.dts,
-                              (const uint8_t *)stream->pes->frame.data.data(), stream->pes->frame.data.size());
-                }
+                EmitFrame(stream->pes.get());
                 stream->pes->frame.Clear();
             }
         }
     }
+
+    if (batchSize_ > 0) {
+        DeliverBatch();
+    }
 }
 
 void MpegTsDemuxer::HandleSDT(const uint8_t *data, size_t size) {
-    printf("Handle SDT\n");
-}
\ No newline at end of file
+    TS_LOGT("This is a SDT");
+    sdt_.Parse(data, size);
+}
+
+template <size_t PacketSize, unsigned Features>
+void MpegTsDemuxerT<PacketSize, Features>::SetPacketSize(size_t packetSize) {
+    if (packetSize != PacketSize) {
+        TS_LOGE("Packet size %zu set on a demuxer built for %zu-byte packets, ignored", packetSize, PacketSize);
+    }
+}
+
+template <size_t PacketSize, unsigned Features>
+void MpegTsDemuxerT<PacketSize, Features>::InputBuffer(const uint8_t *data, size_t size, bool transient,
+                                                       uint64_t offset) {
+    InputBufferT<PacketSize, Features>(data, size, transient, offset);
+}
+
+template <size_t PacketSize, unsigned Features>
+void MpegTsDemuxerT<PacketSize, Features>::InputPacket(const uint8_t *data) {
+    InputPacketT<Features>(data);
+}
+
+template class MpegTsDemuxerT<TS_PACKET_SIZE, DEMUX_FEATURES_ES>;
+template class MpegTsDemuxerT<TS_PACKET_SIZE, DEMUX_FEATURES_ALL>;
+template class MpegTsDemuxerT<M2TS_PACKET_SIZE, DEMUX_FEATURES_ES>;
+template class MpegTsDemuxerT<M2TS_PACKET_SIZE, DEMUX_FEATURES_ALL>;
+template class MpegTsDemuxerT<TS_RS_PACKET_SIZE, DEMUX_FEATURES_ES>;
+template class MpegTsDemuxerT<TS_RS_PACKET_SIZE, DEMUX_FEATURES_ALL>;
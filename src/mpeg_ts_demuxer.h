@@ -6,24 +6,312 @@
 #define MPEG_TS_MEDIA_SRC_MPEG_TS_DEMUXER_H
 
 #include "mpeg_ts.h"
+#include "psi_section.h"
+#include "stream_stats.h"
+#include "ts_analyzer.h"
+#include <array>
 #include <cstdint>
 #include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+enum PidType : uint8_t {
+    PID_TYPE_IGNORE = 0,
+    PID_TYPE_PAT,
+    PID_TYPE_PMT,
+    PID_TYPE_ES,
+    PID_TYPE_SDT,
+    PID_TYPE_NULL,
+};
+
+// Parts of the packet path that MpegTsDemuxerT compiles in or leaves out; MpegTsDemuxer has them all.
+enum DemuxFeature : unsigned {
+    DEMUX_FEATURE_ADAPTATION = 0x01, // adaptation fields parsed: Frame::randomAccess, packets with broken ones dropped
+    DEMUX_FEATURE_PCR        = 0x02, // the PCR callback, adaptation fields parsed as well
+    DEMUX_FEATURE_CC         = 0x04, // continuity counter warnings on elementary streams
+    DEMUX_FEATURE_STATS      = 0x08, // SetStreamStats() and SetAnalyzer()
+    DEMUX_FEATURE_TRACE      = 0x10, // trace logs, if TS_LOG_MAX_LEVEL keeps them at all
+
+    DEMUX_FEATURES_ES  = 0x00, // elementary streams only, adaptation fields skipped
+    DEMUX_FEATURES_ALL = 0x1f,
+};
+
+enum FrameMode : uint8_t {
+    FRAME_MODE_COPY = 0, // payloads are appended into Frame::data
+    FRAME_MODE_IOVEC,    // payloads are referenced in place through Frame::iov
+};
+
+// One slot per PID, so dispatching a packet is a single indexed load.
+struct PidEntry {
+    PidType type = PID_TYPE_IGNORE;
+    union {
+        TS_PAT_Program *program = nullptr; // PID_TYPE_PMT
+        TS_PMT_Stream *stream;             // PID_TYPE_ES
+    };
+};
+
+// Start of an access unit (a PES packet) as seen on the transport stream.
+struct AccessUnit {
+    uint64_t offset; // of the packet holding the PES header, counted from the first byte given to Input()
+    uint16_t pid;
+    StreamType codecId;
+    int64_t pts;
+    int64_t dts;
+    bool randomAccess;   // random_access_indicator of that packet
+    const uint8_t *data; // elementary stream data following the PES header in that packet
+    size_t size;
+};
+
+// Where a demuxer delivers its frames, see MpegTsDemuxer::SetFrameSink(). Derive through FrameSink<>, or override
+// OnFrames() directly to take each batch as a whole.
+class FrameSinkBase {
+public:
+    virtual ~FrameSinkBase() = default;
+
+    // |count| frames, in the order they were completed. A sink may move frame.data out of them.
+    virtual void OnFrames(Frame *frames, size_t count) = 0;
+};
+
+// Static dispatch to Sink::OnFrame(Frame &frame), which the loop over a batch inlines: one virtual call per batch,
+// instead of a std::function call per frame.
+template <typename Sink>
+class FrameSink : public FrameSinkBase {
+public:
+    void OnFrames(Frame *frames, size_t count) final {
+        for (size_t i = 0; i < count; i++) {
+            static_cast<Sink *>(this)->OnFrame(frames[i]);
+        }
+    }
+};
+
+class SeekIndex;
+
+template <size_t PacketSize, unsigned Features>
+class MpegTsDemuxerT;
 
 class MpegTsDemuxer {
 public:
     using DemuxCallback =
         std::function<void(StreamType codec, int64_t pts, int64_t dts, const uint8_t *data, size_t size)>;
+    using DemuxIovCallback =
+        std::function<void(StreamType codec, int64_t pts, int64_t dts, const struct iovec *iov, size_t iovcnt)>;
+    using DemuxFrameCallback = std::function<void(Frame &frame)>;
+    using DemuxOpenFrameCallback = std::function<void(uint16_t pid, Frame &frame, bool open)>;
+    using DemuxOrphanCallback = std::function<void(uint16_t pid, const uint8_t *data, size_t size)>;
+    using DemuxUnitCallback = std::function<void(const AccessUnit &unit)>;
+    using DemuxPcrCallback = std::function<void(uint16_t pid, int64_t pcr, uint64_t offset)>; // 90 kHz base
+    using DemuxSectionCallback = std::function<void(uint16_t pid, const uint8_t *section, size_t size)>;
+    using DemuxAudioCallback = AudioFramer::AudioFrameCallback;
 
+    MpegTsDemuxer();
+    virtual ~MpegTsDemuxer();
+
+    // The MpegTsDemuxerT built for |packetSize| with the fewest features that include |features| (DemuxFeature), or
+    // a plain MpegTsDemuxer if there is none, e.g. for a packet size of 0, still to be detected.
+    static std::unique_ptr<MpegTsDemuxer> Create(size_t packetSize, unsigned features);
+
+    // Takes any amount of stream data: whole files, socket reads or single packets. A partial packet at the end
+    // is kept and completed by the next call. The packet size is detected from the first bytes unless set.
     void Input(const uint8_t *data, size_t size);
     void Flush();
+
+    // TS_PACKET_SIZE, M2TS_PACKET_SIZE, TS_RS_PACKET_SIZE, or 0 to detect it. An MpegTsDemuxerT only takes the size
+    // it was compiled for.
+    virtual void SetPacketSize(size_t packetSize) { packetSize_ = packetSize; }
+    size_t GetPacketSize() const { return packetSize_; }
     void SetDemuxCallback(DemuxCallback callback) { callback_ = std::move(callback); }
 
+    // Zero-copy mode: frames are delivered as spans pointing into the buffers passed to Input(), so those
+    // buffers (typically the mmap of a FileReader) must stay valid until the frame is delivered or Flush() returns.
+    void SetDemuxIovCallback(DemuxIovCallback callback) {
+        iovCallback_ = std::move(callback);
+        frameMode_ = iovCallback_ ? FRAME_MODE_IOVEC : FRAME_MODE_COPY;
+    }
+
+    // Frames are assembled in Frame::data unless an iovec callback is set or the mode is forced here.
+    void SetFrameMode(FrameMode mode) { frameMode_ = mode; }
+
+    // Hands out the whole frame, in either mode. The callback may take frame.data with std::move and give the
+    // buffer back through Recycle() once done with it; both must happen on the thread that delivered the frame.
+    void SetDemuxFrameCallback(DemuxFrameCallback callback) { frameCallback_ = std::move(callback); }
+    void Recycle(uint16_t pid, data_t &&buffer);
+
+    // Frames go to |sink| instead of the callbacks above, which are themselves served by a sink of this demuxer's
+    // own; nullptr goes back to them. With |batched|, the frames completed by one Input() or Flush() are handed over
+    // together at its end, in one array, so copied frames take as much memory as the Input() calls bring; buffers
+    // not moved out are reused. Zero-copy frames keep the validity rules above. Pipelined mode delivers frame by
+    // frame. |sink| must outlive its use.
+    void SetFrameSink(FrameSinkBase *sink, bool batched = false) {
+        sink_ = sink;
+        batched_ = batched;
+    }
+
+    // Pipelined mode for live ingest: Input() only classifies packets, and PES reassembly plus the callbacks of each
+    // elementary stream run on one of |threads| workers, so a slow sink only holds up the streams sharing its
+    // worker. Frames of one stream stay in order; frames of different streams may be delivered concurrently.
+    // Set before the first Input(); Flush() returns once every worker has delivered its last frame.
+    void SetWorkerThreads(int threads);
+
+    // Stream structure for indexing and analysis, delivered on the thread that calls Input(). The unit callback is
+    // called from the workers in pipelined mode. Sections are only reported when new or changed.
+    void SetDemuxUnitCallback(DemuxUnitCallback callback) { unitCallback_ = std::move(callback); }
+    void SetDemuxPcrCallback(DemuxPcrCallback callback) { pcrCallback_ = std::move(callback); }
+    void SetDemuxSectionCallback(DemuxSectionCallback callback) { sectionCallback_ = std::move(callback); }
+
+    // Jumps to the last keyframe at or before |time| (90 kHz ticks from the start of the indexed stream) and
+    // returns its byte offset; the caller continues with Input() from there. Frames being assembled are dropped,
+    // and the program tables are taken from the index if none were seen yet. Returns -1 if there is no keyframe.
+    int64_t Seek(const SeekIndex &index, int64_t time);
+
+    // Frames of H.264 and HEVC streams come with their NAL units and a keyframe flag (Frame::nalUnits, keyframe),
+    // found while each payload is appended, so consumers need no second pass. Not with MpegTsParallelDemuxer.
+    void SetNalScan(bool nalScan) { nalScan_ = nalScan; }
+
+    // AAC (ADTS) and MPEG audio PES packets are also split into frames, each with its own PTS. The frames point
+    // into the frame being emitted and are delivered just before it, from the workers in pipelined mode.
+    void SetDemuxAudioCallback(DemuxAudioCallback callback) { audioCallback_ = std::move(callback); }
+
+    // Per-PID packet, error, frame and PCR statistics, updated as the input goes through; read them with
+    // StreamStats::Snapshot() from any thread. Not with MpegTsParallelDemuxer.
+    void SetStreamStats(std::shared_ptr<StreamStats> stats) { stats_ = std::move(stats); }
+
+    // Runs the TR 101 290 priority 1 and 2 checks of |analyzer| on every packet, including lost sync, on the thread
+    // that calls Input(). Not with MpegTsParallelDemuxer.
+    void SetAnalyzer(std::shared_ptr<TsAnalyzer> analyzer);
+
+    // Only follow PAT/PMT (and continuity counters); elementary stream payloads are skipped.
+    void SetPsiOnly(bool psiOnly) { psiOnly_ = psiOnly; }
+    const TS_PAT &GetPAT() const { return pat_; }
+    const TS_SDT &GetSDT() const { return sdt_; }
+
+    // Support for demuxing a stream in independent pieces (see MpegTsParallelDemuxer).
+    // Starts from the program tables of |other|, as if this demuxer had seen the same input.
+    void CopyPsi(const MpegTsDemuxer &other);
+    // Payload of a stream that arrives before its first PES packet starts, i.e. the end of a frame that started
+    // before this demuxer's input. Called with size 0 when the first valid PES header turns up.
+    void SetDemuxOrphanCallback(DemuxOrphanCallback callback) { orphanCallback_ = std::move(callback); }
+    // Hands out the frame of every stream that started a PES packet, empty ones included, instead of emitting them
+    // as Flush() does. |open|: the payload after this demuxer's input still belongs to it. Not so after an invalid
+    // PES header, and without any valid one the frame is empty.
+    void TakeOpenFrames(const DemuxOpenFrameCallback &callback);
+
 private:
-   void HandleSDT(const uint8_t *data, size_t size); 
+    template <size_t PacketSize, unsigned Features>
+    friend class MpegTsDemuxerT;
+
+    // Per-packet facts that travel with elementary stream payloads, also through the worker rings.
+    struct PacketContext {
+        uint64_t offset;
+        bool transient; // see InputBuffer()
+        bool randomAccess;
+    };
+
+    struct PesLane;
+    struct PesSlot;
+    class PesWorker;
+
+    // Delivers to the callbacks, for the frames of a demuxer without a sink.
+    class CallbackSink final : public FrameSink<CallbackSink> {
+    public:
+        explicit CallbackSink(MpegTsDemuxer *demuxer) : demuxer_(demuxer) {}
+        void OnFrame(Frame &frame);
+
+    private:
+        MpegTsDemuxer *demuxer_;
+    };
+
+    void InputData(const uint8_t *data, size_t size);
+    void ProbePacketSize(bool flush);
+    void FlushInput();
+    // |transient| buffers are reused by the demuxer, so zero-copy frames must copy out of them.
+    virtual void InputBuffer(const uint8_t *data, size_t size, bool transient, uint64_t offset);
+    virtual void InputPacket(const uint8_t *data);
+    // The packet path proper, for a packet size of packetSize_ when PacketSize is 0.
+    template <size_t PacketSize, unsigned Features>
+    void InputBufferT(const uint8_t *data, size_t size, bool transient, uint64_t offset);
+    template <unsigned Features>
+    void InputPacketT(const uint8_t *data);
+    void HandlePSI(uint16_t pid, const TSPacketHeader *tsPacket, const uint8_t *data, size_t size);
+    void HandleSection(uint16_t pid, const uint8_t *section, size_t size);
+    void HandleSDT(const uint8_t *data, size_t size);
+    void HandlePMT(TS_PAT_Program *program, const uint8_t *data, size_t size);
+    template <unsigned Features>
+    void HandlePES(TS_PMT_Stream *stream, const TSPacketHeader *tsPacket, const uint8_t *data, size_t size,
+                   const PacketContext &context);
+    void DispatchPES(TS_PMT_Stream *stream, const uint8_t *data, size_t offset, const PacketContext &context);
+    void WaitWorkers();
+    void HandleSlot(PesSlot &slot);
+    void NextFrame(TS_PMT_Stream *stream, size_t expected);
+    void EmitFrame(TS_PES *pes);
+    void DeliverBatch();
+
+    // The table holds pointers into pat_.programs and TS_PMT::streams, so it must be rebuilt
+    // whenever either vector changes.
+    void RebuildPidTable();
+
 private:
     uint16_t pmtId_ = 0xffff;
     DemuxCallback callback_;
+    DemuxIovCallback iovCallback_;
+    DemuxFrameCallback frameCallback_;
+    DemuxOrphanCallback orphanCallback_;
+    DemuxUnitCallback unitCallback_;
+    DemuxPcrCallback pcrCallback_;
+    DemuxSectionCallback sectionCallback_;
+    DemuxAudioCallback audioCallback_;
+    CallbackSink callbackSink_{this};
+    FrameSinkBase *sink_ = nullptr;
+    bool batched_ = false;
+    std::vector<Frame> batch_; // completed frames waiting for the end of Input(), cleared ones kept for reuse
+    size_t batchSize_ = 0;
+    std::shared_ptr<StreamStats> stats_;
+    std::shared_ptr<TsAnalyzer> analyzer_;
+    bool psiOnly_ = false;
+    bool nalScan_ = false;
+    FrameMode frameMode_ = FRAME_MODE_COPY;
     TS_PAT pat_;
+    TS_SDT sdt_;
+    std::array<PidEntry, TS_PID_COUNT> pidTable_;
+    std::unordered_map<uint16_t, SectionAssembler> sections_; // PAT, PMT and SDT PIDs
+    SectionCache sectionCache_;
+
+    size_t packetSize_ = 0;
+    data_t probe_;
+    uint8_t carry_[TS_RS_PACKET_SIZE];
+    size_t carrySize_ = 0;
+    uint64_t carryOffset_ = 0;
+    bool transient_ = false;
+    uint64_t bytesIn_ = 0;      // stream offset of the end of the data given to Input() so far
+    uint64_t packetOffset_ = 0; // stream offset of the packet being handled
+
+    std::vector<std::unique_ptr<PesWorker>> workers_;
+    std::vector<std::unique_ptr<PesLane>> lanes_;
+    std::unique_ptr<std::array<PesLane *, TS_PID_COUNT>> laneTable_; // only allocated in pipelined mode
 };
 
+// MpegTsDemuxer with the packet path compiled for one packet size and DemuxFeature mask, so that what is left out
+// costs no branch per packet: DEMUX_FEATURES_ES reduces it to PID lookup, PES reassembly and PSI. Setters of features
+// left out are ignored. Pipelined mode runs the full PES path on its workers. Only the instantiations declared below
+// exist; MpegTsDemuxer::Create() picks one at run time.
+template <size_t PacketSize, unsigned Features>
+class MpegTsDemuxerT final : public MpegTsDemuxer {
+public:
+    MpegTsDemuxerT() { packetSize_ = PacketSize; }
+
+    // Any other size would desynchronise the packet path, so it is refused with an error.
+    void SetPacketSize(size_t packetSize) override;
+
+private:
+    void InputBuffer(const uint8_t *data, size_t size, bool transient, uint64_t offset) override;
+    void InputPacket(const uint8_t *data) override;
+};
+
+extern template class MpegTsDemuxerT<TS_PACKET_SIZE, DEMUX_FEATURES_ES>;
+extern template class MpegTsDemuxerT<TS_PACKET_SIZE, DEMUX_FEATURES_ALL>;
+extern template class MpegTsDemuxerT<M2TS_PACKET_SIZE, DEMUX_FEATURES_ES>;
+extern template class MpegTsDemuxerT<M2TS_PACKET_SIZE, DEMUX_FEATURES_ALL>;
+extern template class MpegTsDemuxerT<TS_RS_PACKET_SIZE, DEMUX_FEATURES_ES>;
+extern template class MpegTsDemuxerT<TS_RS_PACKET_SIZE, DEMUX_FEATURES_ALL>;
+
 #endif // MPEG_TS_MEDIA_SRC_MPEG_TS_DEMUXER_H
@@ -0,0 +1,375 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#include "mpeg_ts_filter.h"
+#include "crc32.h"
+#include "logger.h"
+#include "ts_sync.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TS_PAYLOAD_SIZE   (TS_PACKET_SIZE - 4)
+#define PSI_STUFFING_BYTE 0xff
+
+static uint16_t ReadPid(const uint8_t *data) {
+    return ((data[0] & 0x1f) << 8) | data[1];
+}
+
+// Sets section_length for a section rebuilt in |section| and appends its CRC_32.
+static void FinishSection(data_t &section) {
+    size_t length = section.size() + PSI_CRC_SIZE - PSI_SECTION_HEADER_SIZE;
+    section[1] = (char)((section[1] & 0xf0) | ((length >> 8) & 0x0f));
+    section[2] = (char)(length & 0xff);
+
+    uint32_t crc = Crc32Mpeg2((const uint8_t *)section.data(), section.size());
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        section.push_back((char)((crc >> shift) & 0xff));
+    }
+}
+
+void MpegTsFilter::SetProgram(uint16_t programNumber) {
+    programNumber_ = programNumber;
+    programSet_ = true;
+}
+
+void MpegTsFilter::AddPid(uint16_t pid) {
+    if (std::find(pids_.begin(), pids_.end(), pid) == pids_.end()) {
+        pids_.push_back(pid);
+    }
+}
+
+bool MpegTsFilter::Filter(const FileReader &input, FileWriter &output) {
+    const uint8_t *data = input.data;
+    const uint8_t *end = data + input.size;
+    const uint8_t *sync = nullptr;
+    size_t packetSize = TsDetectPacketSize(data, input.size, &sync);
+    if (packetSize == 0) {
+        TS_LOGE("No transport stream packets found");
+        return false;
+    }
+
+    // Packets are copied whole; the timecode of an M2TS packet comes before its sync byte.
+    size_t prefix = packetSize == M2TS_PACKET_SIZE ? packetSize - TS_PACKET_SIZE : 0;
+
+    output.Flush();
+    output_ = &output;
+    inFd_ = input.Fd();
+    outFd_ = output.Fd();
+    mode_ = FILTER_OUTPUT_WRITEV;
+    struct stat sb {};
+    if (fstat(outFd_, &sb) == 0) {
+        if (S_ISREG(sb.st_mode)) {
+            mode_ = FILTER_OUTPUT_COPY_RANGE;
+        } else if (S_ISFIFO(sb.st_mode)) {
+            mode_ = FILTER_OUTPUT_SPLICE;
+        }
+    }
+
+    base_ = data;
+    unitSize_ = packetSize;
+    runStart_ = runEnd_ = nullptr;
+    iov_.clear();
+    iov_.reserve(FILTER_IOV_COUNT);
+    psiBuffer_ = std::make_unique<uint8_t[]>(FILTER_PSI_BUFFER);
+    psiUsed_ = 0;
+    failed_ = false;
+    packetsIn_ = packetsOut_ = 0;
+    RebuildActions();
+
+    const uint8_t *p = sync;
+    while (p + TS_PACKET_SIZE <= end && !failed_) {
+        // As when demuxing, a packet only counts when the next one starts where it should.
+        if (p[0] == TS_SYNC_BYTE && (p + packetSize >= end || p[packetSize] == TS_SYNC_BYTE)) {
+            if ((size_t)(p - data) >= prefix && p - prefix + packetSize <= end) {
+                HandlePacket(p, p - prefix);
+            }
+            p += packetSize;
+            continue;
+        }
+
+        const uint8_t *next = TsResync(p + 1, end, packetSize);
+        TS_LOGW("Lost sync, skipped %zu bytes", (size_t)(next - p));
+        p = next;
+    }
+
+    CloseRun();
+    FlushSpans();
+    output_ = nullptr;
+    psiBuffer_.reset();
+
+    TS_LOGI("Kept %lu of %lu packets", packetsOut_, packetsIn_);
+    return !failed_;
+}
+
+void MpegTsFilter::RebuildActions() {
+    actions_.fill(FILTER_ACTION_DROP);
+    for (auto pid : pids_) {
+        actions_[pid] = FILTER_ACTION_PASS;
+    }
+    if (!programSet_) {
+        return;
+    }
+
+    // Without a PID list the whole program is kept; with one, only the streams listed.
+    if (pids_.empty()) {
+        for (auto pid : streams_) {
+            actions_[pid] = FILTER_ACTION_PASS;
+        }
+    }
+    if (pcrPid_ != PID_NULL) {
+        actions_[pcrPid_] = FILTER_ACTION_PASS;
+    }
+    if (pmtPid_ != PID_NULL) {
+        actions_[pmtPid_] = FILTER_ACTION_PMT;
+    }
+    actions_[PID_PAT] = FILTER_ACTION_PAT;
+}
+
+void MpegTsFilter::HandlePacket(const uint8_t *packet, const uint8_t *unit) {
+    packetsIn_++;
+    TSPacketHeader *tsPacket = (TSPacketHeader *)packet;
+    uint16_t pid = tsPacket->GetPID();
+    unit_ = unit;
+
+    switch (actions_[pid]) {
+        case FILTER_ACTION_PASS:
+            packetsOut_++;
+            if (unit != runEnd_) {
+                CloseRun();
+                runStart_ = unit;
+            }
+            runEnd_ = unit + unitSize_;
+            break;
+        case FILTER_ACTION_PAT:
+        case FILTER_ACTION_PMT: {
+            size_t i = 4;
+            if (tsPacket->adaptation_field_control & 0x02) {
+                i += packet[i] + 1;
+            }
+            if (!(tsPacket->adaptation_field_control & 0x01) || i >= TS_PACKET_SIZE) {
+                break;
+            }
+
+            psi_[pid].assembler.Push(
+                packet + i, TS_PACKET_SIZE - i, tsPacket->payload_unit_start_indicator, tsPacket->continuity_counter,
+                [&](const uint8_t *section, size_t size) { HandleSection(pid, section, size); });
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void MpegTsFilter::HandleSection(uint16_t pid, const uint8_t *section, size_t size) {
+    if (size < 8 + PSI_CRC_SIZE) {
+        return;
+    }
+
+    // Tables repeat every few hundred milliseconds; an unchanged CRC_32 means the last rewrite still holds.
+    PsiOutput &psi = psi_[pid];
+    const uint8_t *c = section + size - PSI_CRC_SIZE;
+    uint32_t crc = ((uint32_t)c[0] << 24) | (c[1] << 16) | (c[2] << 8) | c[3];
+    if (size != psi.lastSize || crc != psi.lastCrc) {
+        if (Crc32Mpeg2(section, size) != 0) {
+            TS_LOGW("PSI section on PID 0x%04x failed its CRC check, dropped", pid);
+            return;
+        }
+
+        psi.lastSize = size;
+        psi.lastCrc = crc;
+        bool rewritten = actions_[pid] == FILTER_ACTION_PAT ? RewritePAT(section, size, psi.section)
+                                                              : RewritePMT(section, size, psi.section);
+        if (!rewritten) {
+            psi.section.clear();
+        }
+    }
+
+    if (!psi.section.empty()) {
+        EmitSection(pid, psi);
+    }
+}
+
+bool MpegTsFilter::RewritePAT(const uint8_t *section, size_t size, data_t &out) {
+    if (section[0] != TID_PAS) {
+        return false;
+    }
+
+    // The network PID (program 0) stays listed only if it is kept.
+    out.assign((const char *)section, 8);
+    uint16_t pmtPid = PID_NULL;
+    for (size_t i = 8; i + 4 <= size - PSI_CRC_SIZE; i += 4) {
+        uint16_t programNumber = (section[i] << 8) | section[i + 1];
+        uint16_t pid = ReadPid(section + i + 2);
+        if (programNumber == programNumber_) {
+            pmtPid = pid;
+        } else if (programNumber != 0 || actions_[pid] != FILTER_ACTION_PASS) {
+            continue;
+        }
+        out.append((const char *)section + i, 4);
+    }
+
+    if (pmtPid == PID_NULL && section[6] == 0 && section[7] == 0) {
+        TS_LOGW("Program %u is not in the PAT", programNumber_);
+    }
+    if (pmtPid != PID_NULL && pmtPid != pmtPid_) {
+        TS_LOGI("Program %u: PMT on PID 0x%04x", programNumber_, pmtPid);
+        pmtPid_ = pmtPid;
+        pcrPid_ = PID_NULL;
+        streams_.clear();
+        RebuildActions();
+    }
+
+    FinishSection(out);
+    return true;
+}
+
+bool MpegTsFilter::RewritePMT(const uint8_t *section, size_t size, data_t &out) {
+    // Other programs may share the PID; their sections are left out.
+    if (section[0] != TID_PMS || size < 12 + PSI_CRC_SIZE || ((section[3] << 8) | section[4]) != programNumber_) {
+        return false;
+    }
+
+    size_t body = size - PSI_CRC_SIZE;
+    size_t first = 12 + (((section[10] & 0x0f) << 8) | section[11]);
+    std::vector<uint16_t> streams;
+    size_t i = first;
+    while (i + 5 <= body) {
+        streams.push_back(ReadPid(section + i + 1));
+        i += 5 + (((section[i + 3] & 0x0f) << 8) | section[i + 4]);
+    }
+    if (first > body || i != body) {
+        TS_LOGW("Malformed PMT for program %u", programNumber_);
+        return false;
+    }
+
+    uint16_t pcrPid = ReadPid(section + 8);
+    if (streams != streams_ || pcrPid != pcrPid_) {
+        TS_LOGI("Program %u: %zu streams, PCR on PID 0x%04x", programNumber_, streams.size(), pcrPid);
+        streams_ = std::move(streams);
+        pcrPid_ = pcrPid;
+        RebuildActions();
+    }
+
+    out.assign((const char *)section, first);
+    for (i = first; i < body;) {
+        size_t entrySize = 5 + (((section[i + 3] & 0x0f) << 8) | section[i + 4]);
+        if (actions_[ReadPid(section + i + 1)] == FILTER_ACTION_PASS) {
+            out.append((const char *)section + i, entrySize);
+        }
+        i += entrySize;
+    }
+
+    FinishSection(out);
+    return true;
+}
+
+void MpegTsFilter::EmitSection(uint16_t pid, PsiOutput &psi) {
+    CloseRun();
+
+    const uint8_t *p = (const uint8_t *)psi.section.data();
+    size_t left = psi.section.size();
+    size_t count = (left + 1 + TS_PAYLOAD_SIZE - 1) / TS_PAYLOAD_SIZE; // pointer_field first
+    // Flushing resets the buffer, so it must not happen half way through the section.
+    if (psiUsed_ + count * unitSize_ > FILTER_PSI_BUFFER || iov_.size() + count > FILTER_IOV_COUNT) {
+        FlushSpans();
+    }
+
+    // Timecode or parity bytes come from the packet that completed the section.
+    size_t prefix = unitSize_ == M2TS_PACKET_SIZE ? unitSize_ - TS_PACKET_SIZE : 0;
+    for (size_t n = 0; n < count; n++) {
+        uint8_t *unit = psiBuffer_.get() + psiUsed_;
+        psiUsed_ += unitSize_;
+        memcpy(unit, unit_, unitSize_);
+
+        uint8_t *packet = unit + prefix;
+        packet[0] = TS_SYNC_BYTE;
+        packet[1] = (n == 0 ? 0x40 : 0x00) | ((pid >> 8) & 0x1f);
+        packet[2] = pid & 0xff;
+        packet[3] = 0x10 | psi.continuityCounter;
+        psi.continuityCounter = (psi.continuityCounter + 1) & 0x0f;
+
+        uint8_t *payload = packet + 4;
+        size_t room = TS_PAYLOAD_SIZE;
+        if (n == 0) {
+            *payload++ = 0;
+            room--;
+        }
+        size_t size = std::min(room, left);
+        memcpy(payload, p, size);
+        memset(payload + size, PSI_STUFFING_BYTE, room - size);
+        p += size;
+        left -= size;
+
+        AddSpan(unit, unitSize_);
+        packetsOut_++;
+    }
+}
+
+void MpegTsFilter::AddSpan(const uint8_t *data, size_t size) {
+    if (!iov_.empty() && (const uint8_t *)iov_.back().iov_base + iov_.back().iov_len == data) {
+        iov_.back().iov_len += size;
+        return;
+    }
+
+    if (iov_.size() == FILTER_IOV_COUNT) {
+        FlushSpans();
+    }
+    iov_.push_back({(void *)data, size});
+}
+
+void MpegTsFilter::CloseRun() {
+    if (!runStart_) {
+        return;
+    }
+
+    const uint8_t *p = runStart_;
+    size_t size = runEnd_ - runStart_;
+    runStart_ = runEnd_ = nullptr;
+
+    // Long runs are worth a system call of their own; whatever went before must reach the output first.
+    if (size >= FILTER_COPY_THRESHOLD && mode_ != FILTER_OUTPUT_WRITEV) {
+        FlushSpans();
+        output_->Flush();
+        loff_t offset = p - base_;
+        while (size > 0 && mode_ != FILTER_OUTPUT_WRITEV && !failed_) {
+            ssize_t n = mode_ == FILTER_OUTPUT_COPY_RANGE
+                            ? copy_file_range(inFd_, &offset, outFd_, nullptr, size, 0)
+                            : splice(inFd_, &offset, outFd_, nullptr, size, SPLICE_F_MORE);
+            if (n > 0) {
+                size -= n;
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n == 0 || errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+                // Older kernels, file systems without support or an output that was not what it seemed.
+                TS_LOGI("Kernel copy not available (errno %d), falling back to writev", n == 0 ? 0 : errno);
+                mode_ = FILTER_OUTPUT_WRITEV;
+            } else {
+                TS_LOGE("Writing the output failed, errno %d", errno);
+                failed_ = true;
+                return;
+            }
+        }
+        p = base_ + offset;
+    }
+
+    if (size > 0) {
+        AddSpan(p, size);
+    }
+}
+
+void MpegTsFilter::FlushSpans() {
+    if (iov_.empty()) {
+        return;
+    }
+
+    if (!output_->Writev(iov_.data(), iov_.size())) {
+        failed_ = true;
+    }
+    iov_.clear();
+    psiUsed_ = 0;
+}
@@ -0,0 +1,110 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#ifndef MPEG_TS_MEDIA_SRC_MPEG_TS_FILTER_H
+#define MPEG_TS_MEDIA_SRC_MPEG_TS_FILTER_H
+
+#include "file.h"
+#include "mpeg_ts.h"
+#include "psi_section.h"
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <sys/uio.h>
+#include <unordered_map>
+#include <vector>
+
+#define FILTER_COPY_THRESHOLD (64 * 1024) // runs at least this long are copied by the kernel, shorter ones gathered
+#define FILTER_IOV_COUNT      1024        // spans per writev, IOV_MAX on Linux
+#define FILTER_PSI_BUFFER     (64 * 1024) // rewritten PAT/PMT packets waiting for the next writev
+
+enum FilterAction : uint8_t {
+    FILTER_ACTION_DROP = 0,
+    FILTER_ACTION_PASS,
+    FILTER_ACTION_PAT, // assembled and rewritten
+    FILTER_ACTION_PMT,
+};
+
+enum FilterOutput : uint8_t {
+    FILTER_OUTPUT_WRITEV = 0,
+    FILTER_OUTPUT_COPY_RANGE, // regular file: copy_file_range, which may share extents instead of copying
+    FILTER_OUTPUT_SPLICE,     // pipe: splice from the page cache
+};
+
+// Strips a transport stream down to one program or a few PIDs without demuxing it.
+//
+// Packets are classified by the PID in their header through a per-PID table. Only the PAT and the PMT of the kept
+// program are assembled: they are rewritten to describe what is kept and packetized again with their own continuity
+// counters. Every other kept packet goes out as it is, straight from the input mapping: long runs of adjacent kept
+// packets are copied by the kernel (copy_file_range to a file, splice to a pipe) and the rest are gathered into
+// writev calls, so packet data never passes through a user space buffer.
+class MpegTsFilter {
+public:
+    // Keeps program |programNumber|: the PAT is rewritten to list it alone, and its PMT, PCR PID and streams are
+    // followed as the PMT changes.
+    void SetProgram(uint16_t programNumber);
+
+    // Keeps |pid| as it is. With a program set, that program's streams are restricted to the PIDs added here and
+    // its PMT rewritten accordingly; the PCR PID is always kept.
+    void AddPid(uint16_t pid);
+
+    // |input| must be a whole M2TS, RS or plain transport stream; packets keep their size and any timecode.
+    // Returns false if no packets were found or the output failed.
+    bool Filter(const FileReader &input, FileWriter &output);
+
+    uint64_t PacketsIn() const { return packetsIn_; }
+    uint64_t PacketsOut() const { return packetsOut_; }
+
+private:
+    struct PsiOutput {
+        SectionAssembler assembler;
+        uint8_t continuityCounter = 0;
+        uint32_t lastCrc = 0; // CRC_32 of the last input section, repeats reuse |section|
+        size_t lastSize = 0;
+        data_t section;       // rewritten, empty if the input section is not passed on
+    };
+
+    void RebuildActions();
+    void HandlePacket(const uint8_t *packet, const uint8_t *unit);
+    void HandleSection(uint16_t pid, const uint8_t *section, size_t size);
+    bool RewritePAT(const uint8_t *section, size_t size, data_t &out);
+    bool RewritePMT(const uint8_t *section, size_t size, data_t &out);
+    void EmitSection(uint16_t pid, PsiOutput &psi);
+    void AddSpan(const uint8_t *data, size_t size);
+    void CloseRun();
+    void FlushSpans();
+
+private:
+    uint16_t programNumber_ = 0;
+    bool programSet_ = false;
+    std::vector<uint16_t> pids_;
+
+    // Learned from the stream.
+    uint16_t pmtPid_ = PID_NULL;
+    uint16_t pcrPid_ = PID_NULL;
+    std::vector<uint16_t> streams_;
+
+    std::array<FilterAction, TS_PID_COUNT> actions_{};
+    std::unordered_map<uint16_t, PsiOutput> psi_;
+
+    // Output state while filtering.
+    FileWriter *output_ = nullptr;
+    FilterOutput mode_ = FILTER_OUTPUT_WRITEV;
+    int inFd_ = -1;
+    int outFd_ = -1;
+    const uint8_t *base_ = nullptr; // start of the input mapping
+    size_t unitSize_ = 0;           // bytes per packet on input and output
+    const uint8_t *unit_ = nullptr; // packet being handled, timecode included
+    const uint8_t *runStart_ = nullptr;
+    const uint8_t *runEnd_ = nullptr;
+    std::vector<struct iovec> iov_;
+    std::unique_ptr<uint8_t[]> psiBuffer_;
+    size_t psiUsed_ = 0;
+    bool failed_ = false;
+
+    uint64_t packetsIn_ = 0;
+    uint64_t packetsOut_ = 0;
+};
+
+#endif // MPEG_TS_MEDIA_SRC_MPEG_TS_FILTER_H
@@ -0,0 +1,436 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#include "mpeg_ts_muxer.h"
+#include "logger.h"
+#include <algorithm>
+#include <cstring>
+
+#define TIMESTAMP_MASK     ((1LL << 33) - 1)
+#define MUX_MAX_JUMP       90000 // a DTS further off than this is a discontinuity, not interleaving
+#define DEFAULT_PMT_PID    0x1000
+#define DEFAULT_PROGRAM    1
+#define TS_PAYLOAD_SIZE    (TS_PACKET_SIZE - 4)
+
+// Ticks from |from| to |to| modulo 2^33, negative if |to| is behind.
+static int64_t Since(int64_t from, int64_t to) {
+    int64_t diff = (to - from) & TIMESTAMP_MASK;
+    return diff > TIMESTAMP_MASK / 2 ? diff - TIMESTAMP_MASK - 1 : diff;
+}
+
+static uint8_t StreamId(StreamType codecId) {
+    switch (codecId) {
+        case STREAM_TYPE_VIDEO_MPEG1:
+        case STREAM_TYPE_VIDEO_MPEG2:
+        case STREAM_TYPE_VIDEO_MPEG4:
+        case STREAM_TYPE_VIDEO_H264:
+        case STREAM_TYPE_VIDEO_HEVC:
+        case STREAM_TYPE_VIDEO_CAVS:
+        case STREAM_TYPE_VIDEO_AVS2:
+        case STREAM_TYPE_VIDEO_AVS3:
+        case STREAM_TYPE_VIDEO_VC1:
+        case STREAM_TYPE_VIDEO_SVAC:
+            return 0xe0;
+        case STREAM_TYPE_AUDIO_MPEG1:
+        case STREAM_TYPE_AUDIO_MPEG2:
+        case STREAM_TYPE_AUDIO_AAC:
+        case STREAM_TYPE_AUDIO_AAC_LATM:
+        case STREAM_TYPE_AUDIO_SVAC:
+        case STREAM_TYPE_AUDIO_G711A:
+        case STREAM_TYPE_AUDIO_G711U:
+        case STREAM_TYPE_AUDIO_G722:
+        case STREAM_TYPE_AUDIO_G723:
+        case STREAM_TYPE_AUDIO_G729:
+            return 0xc0;
+        default:
+            return 0xbd; // private_stream_1
+    }
+}
+
+static void WriteHeader(uint8_t *packet, uint16_t pid, bool start, uint8_t adaptationFieldControl) {
+    TSPacketHeader header;
+    header.sync_byte = TS_SYNC_BYTE;
+    header.transport_error_indicator = 0;
+    header.payload_unit_start_indicator = start;
+    header.transport_priority = 0;
+    header.SetPID(pid);
+    header.transport_scrambling_control = 0;
+    header.adaptation_field_control = adaptationFieldControl;
+    header.continuity_counter = 0;
+    memcpy(packet, &header, 4);
+}
+
+// program_clock_reference_base and _extension of a 27 MHz clock.
+static void WritePcrField(uint8_t *data, int64_t pcr) {
+    int64_t base = (pcr / 300) & TIMESTAMP_MASK;
+    int extension = pcr % 300;
+    data[0] = (base >> 25) & 0xff;
+    data[1] = (base >> 17) & 0xff;
+    data[2] = (base >> 9) & 0xff;
+    data[3] = (base >> 1) & 0xff;
+    data[4] = ((base & 0x01) << 7) | 0x7e | (extension >> 8);
+    data[5] = extension & 0xff;
+}
+
+MpegTsMuxer::MpegTsMuxer() {
+    pat_.transport_stream_id = 1;
+    pat_.version_number = 0;
+    pat_.current_next_indicator = 1;
+
+    TS_PAT_Program program;
+    program.program_number = DEFAULT_PROGRAM;
+    program.program_map_PID = DEFAULT_PMT_PID;
+    program.pmt = std::make_shared<TS_PMT>();
+    program.pmt->program_number = DEFAULT_PROGRAM;
+    program.pmt->version_number = 0;
+    program.pmt->PCR_PID = PID_NULL;
+    pat_.programs.push_back(program);
+
+    streams_.reserve(MUX_MAX_STREAMS);
+}
+
+void MpegTsMuxer::SetTransportStreamId(uint16_t transportStreamId) {
+    pat_.transport_stream_id = transportStreamId;
+    psiDirty_ = true;
+}
+
+void MpegTsMuxer::SetProgram(uint16_t programNumber, uint16_t pmtPid) {
+    pat_.programs[0].program_number = programNumber;
+    pat_.programs[0].program_map_PID = pmtPid;
+    pat_.programs[0].pmt->program_number = programNumber;
+    psiDirty_ = true;
+}
+
+void MpegTsMuxer::SetPcrPid(uint16_t pid) {
+    pcrPid_ = pid;
+    pcrPidSet_ = true;
+    psiDirty_ = true;
+}
+
+void MpegTsMuxer::SetMuxRate(uint64_t bitrate) {
+    // The clock goes on from where it is, at the new rate.
+    if (clockBase_ >= 0) {
+        clockBase_ = Clock();
+        clockPosition_ = packetCount_ * TS_PACKET_SIZE;
+    }
+    muxRate_ = bitrate;
+    ticksPerByte_ = 27000000.0 * 8 / (bitrate > 0 ? bitrate : MUX_DEFAULT_RATE);
+}
+
+bool MpegTsMuxer::AddStream(uint16_t pid, StreamType codecId) {
+    if (FindStream(pid) || pid == pat_.programs[0].program_map_PID || pid < PID_NIT || pid >= PID_NULL) {
+        TS_LOGE("PID 0x%04x cannot carry a stream", pid);
+        return false;
+    }
+    if (streams_.size() == MUX_MAX_STREAMS) {
+        TS_LOGE("No more than %d streams", MUX_MAX_STREAMS);
+        return false;
+    }
+
+    streams_.emplace_back();
+    MuxStream &stream = streams_.back();
+    stream.pid = pid;
+    stream.codecId = codecId;
+    WriteHeader(stream.header, pid, false, 0x01);
+
+    uint8_t streamId = StreamId(codecId);
+    stream.pes.stream_id = streamId;
+    stream.pes.data_alignment_indicator = streamId == 0xe0 ? 1 : 0;
+
+    // Video is the usual PCR carrier, as its frames come at a steady pace.
+    if (!pcrPidSet_ &&
+        (pcrPid_ == PID_NULL || (streamId == 0xe0 && StreamId(FindStream(pcrPid_)->codecId) != 0xe0))) {
+        pcrPid_ = pid;
+    }
+    psiDirty_ = true;
+    return true;
+}
+
+MpegTsMuxer::MuxStream *MpegTsMuxer::FindStream(uint16_t pid) {
+    for (auto &stream : streams_) {
+        if (stream.pid == pid) {
+            return &stream;
+        }
+    }
+    return nullptr;
+}
+
+void MpegTsMuxer::UpdatePsi() {
+    TS_PMT &pmt = *pat_.programs[0].pmt;
+    pmt.PCR_PID = pcrPid_;
+    pmt.streams.clear();
+    for (auto &stream : streams_) {
+        TS_PMT_Stream pmtStream;
+        pmtStream.stream_type = stream.codecId;
+        pmtStream.elementary_PID = stream.pid;
+        pmtStream.ES_info_length = 0;
+        pmt.streams.push_back(pmtStream);
+    }
+
+    // Receivers only pick up a changed table under a new version.
+    if (lastPsi_ >= 0) {
+        pat_.version_number = (pat_.version_number + 1) & 0x1f;
+        pmt.version_number = (pmt.version_number + 1) & 0x1f;
+    }
+
+    // The sections and their CRC are computed here once and then repeated as they are.
+    for (int i = 0; i < 2; i++) {
+        uint8_t *packet = i == 0 ? patPacket_.data() : pmtPacket_.data();
+        WriteHeader(packet, i == 0 ? (uint16_t)PID_PAT : pat_.programs[0].program_map_PID, true, 0x01);
+        packet[4] = 0; // pointer_field
+        size_t size = i == 0 ? pat_.Serialize(packet + 5, TS_PAYLOAD_SIZE - 1)
+                             : pmt.Serialize(packet + 5, TS_PAYLOAD_SIZE - 1);
+        memset(packet + 5 + size, 0xff, TS_PAYLOAD_SIZE - 1 - size);
+    }
+
+    psiDirty_ = false;
+    lastPsi_ = -1;
+}
+
+void MpegTsMuxer::WritePsi() {
+    if (PcrDue()) {
+        WritePcr();
+    }
+    uint8_t *packet = NextPacket();
+    memcpy(packet, patPacket_.data(), TS_PACKET_SIZE);
+    packet[3] |= patCounter_;
+    patCounter_ = (patCounter_ + 1) & 0x0f;
+
+    if (PcrDue()) {
+        WritePcr();
+    }
+    packet = NextPacket();
+    memcpy(packet, pmtPacket_.data(), TS_PACKET_SIZE);
+    packet[3] |= pmtCounter_;
+    pmtCounter_ = (pmtCounter_ + 1) & 0x0f;
+}
+
+void MpegTsMuxer::WritePcr() {
+    // Adaptation field only, so the continuity counter stays where the PID left it.
+    int64_t pcr = Clock();
+    uint8_t *packet = NextPacket();
+    WriteHeader(packet, pcrPid_, false, 0x02);
+    MuxStream *stream = FindStream(pcrPid_);
+    if (stream) {
+        packet[3] |= (stream->continuityCounter - 1) & 0x0f;
+    }
+
+    packet[4] = TS_PAYLOAD_SIZE - 1;
+    packet[5] = 0x10 | (discontinuity_ ? 0x80 : 0);
+    WritePcrField(packet + 6, pcr);
+    memset(packet + 12, 0xff, TS_PACKET_SIZE - 12);
+    lastPcr_ = pcr;
+    discontinuity_ = false;
+}
+
+void MpegTsMuxer::WriteNull() {
+    uint8_t *packet = NextPacket();
+    WriteHeader(packet, PID_NULL, false, 0x01);
+    memset(packet + 4, 0xff, TS_PAYLOAD_SIZE);
+}
+
+void MpegTsMuxer::UpdateClock(int64_t dts) {
+    dts &= TIMESTAMP_MASK;
+    int64_t step = lastDts_ < 0 ? 0 : Since(lastDts_, dts);
+    uint64_t position = packetCount_ * TS_PACKET_SIZE;
+    if (lastDts_ < 0 || step < -MUX_MAX_JUMP || step > MUX_MAX_JUMP) {
+        // A new time base: the next packet carries a PCR, with discontinuity_indicator unless it is the first.
+        discontinuity_ = lastDts_ >= 0;
+        lastDts_ = dts;
+        target_ = ((dts - MUX_PCR_DELAY) & TIMESTAMP_MASK) * 300;
+        clockBase_ = firstTarget_ = target_;
+        clockPosition_ = firstPosition_ = position;
+        drift_ = 0;
+        lastPcr_ = -1;
+        return;
+    }
+    if (step <= 0) {
+        return; // repeated, or interleaved a little behind
+    }
+    lastDts_ = dts;
+    target_ += step * 300;
+
+    int64_t clock = Clock();
+    if (muxRate_ > 0) {
+        while (Clock() < target_) {
+            if (PcrDue()) {
+                WritePcr();
+            } else {
+                WriteNull();
+            }
+        }
+        if (clock - target_ > MUX_PCR_DELAY * 300 && !late_) {
+            late_ = true;
+            TS_LOGW("Frames come faster than the mux rate of %lu bits/s, the PCR is past their DTS", muxRate_);
+        }
+        return;
+    }
+
+    // VBR: the clock keeps its rate until it has drifted too far, then goes at the average rate so far, sped up or
+    // slowed down to make up the drift in about a second, and back at the average once it has.
+    int64_t drift = target_ - clock;
+    bool far = drift > MUX_PCR_DRIFT || drift < -MUX_PCR_DRIFT;
+    bool madeUp = drift_ != 0 && (drift > 0) != (drift_ > 0);
+    if (position > firstPosition_ && (far || madeUp)) {
+        double average = (double)(target_ - firstTarget_) / (position - firstPosition_);
+        double correction = far ? std::max(-0.5, std::min(0.5, (double)drift / 27000000)) : 0;
+        ticksPerByte_ = average * (1 + correction);
+        clockBase_ = clock;
+        clockPosition_ = position;
+        drift_ = far ? drift : 0;
+    }
+}
+
+bool MpegTsMuxer::Write(uint16_t pid, int64_t pts, int64_t dts, const uint8_t *data, size_t size, bool keyframe) {
+    MuxStream *stream = FindStream(pid);
+    if (!stream) {
+        TS_LOGE("PID 0x%04x was not added to the muxer", pid);
+        return false;
+    }
+
+    // The frames of the PCR PID time the clock; those of any stream if it carries none.
+    if (pid == pcrPid_ || !FindStream(pcrPid_)) {
+        UpdateClock(dts);
+    }
+
+    if (psiDirty_) {
+        UpdatePsi();
+    }
+    int64_t sincePsi = lastPsi_ < 0 ? MUX_PSI_INTERVAL : Since(lastPsi_, dts);
+    if (sincePsi >= MUX_PSI_INTERVAL || sincePsi < -MUX_MAX_JUMP) {
+        WritePsi();
+        lastPsi_ = dts & TIMESTAMP_MASK;
+    }
+
+    // Only video may leave PES_packet_length at 0 for a frame too long for it; other frames go on in PES packets
+    // without timestamps.
+    TS_PES_Header &pes = stream->pes;
+    bool video = (pes.stream_id & 0xf0) == 0xe0;
+    pes.PTS = pts & TIMESTAMP_MASK;
+    pes.DTS = dts & TIMESTAMP_MASK;
+    pes.PTS_DTS_flags = pes.PTS != pes.DTS ? 0x03 : 0x02;
+    do {
+        uint8_t header[TS_PES_MAX_HEADER_SIZE];
+        size_t headerSize = pes.PTS_DTS_flags == 0x03 ? 19 : pes.PTS_DTS_flags == 0x02 ? 14 : 9;
+        size_t part = video ? size : std::min(size, 0xffff - (headerSize - 6));
+        size_t pesLength = headerSize - 6 + part;
+        pes.PES_packet_length = pesLength > 0xffff ? 0 : pesLength; // 0: unbounded
+        pes.Serialize(header);
+
+        WritePes(stream, header, headerSize, data, part, keyframe);
+        data += part;
+        size -= part;
+        pes.PTS_DTS_flags = 0;
+        keyframe = false;
+    } while (size > 0);
+    return true;
+}
+
+void MpegTsMuxer::WritePes(MuxStream *stream, const uint8_t *header, size_t headerSize, const uint8_t *data,
+                           size_t size, bool keyframe) {
+    size_t remaining = headerSize + size;
+    size_t offset = 0; // into the PES packet, header then data
+    bool first = true;
+    while (remaining > 0) {
+        // PCRs go out by output position, inside the PES if it is on the PCR PID.
+        bool pcr = PcrDue();
+        if (pcr && stream->pid != pcrPid_) {
+            WritePcr();
+            pcr = false;
+        }
+        int64_t clock = pcr ? Clock() : 0;
+
+        uint8_t *packet = NextPacket();
+        memcpy(packet, stream->header, 4);
+        packet[3] |= stream->continuityCounter;
+        stream->continuityCounter = (stream->continuityCounter + 1) & 0x0f;
+
+        uint8_t *q = packet + 4;
+        size_t space = TS_PAYLOAD_SIZE;
+        uint8_t flags = pcr ? 0x10 | (discontinuity_ ? 0x80 : 0) : 0;
+        if (first) {
+            packet[1] |= 0x40; // payload_unit_start_indicator
+            flags |= keyframe ? 0x40 : 0;
+            first = false;
+        }
+        if (flags) {
+            size_t length = 1 + (pcr ? 6 : 0);
+            size_t stuffing = remaining < space - 1 - length ? space - 1 - length - remaining : 0;
+            packet[3] |= 0x20;
+            q[0] = length + stuffing;
+            q[1] = flags;
+            if (pcr) {
+                WritePcrField(q + 2, clock);
+                lastPcr_ = clock;
+                discontinuity_ = false;
+            }
+            memset(q + 1 + length, 0xff, stuffing);
+            q += 1 + length + stuffing;
+            space -= 1 + length + stuffing;
+        }
+
+        // The last packet is padded with adaptation field stuffing.
+        if (remaining < space) {
+            size_t stuffing = space - remaining;
+            packet[3] |= 0x20;
+            q[0] = stuffing - 1;
+            if (stuffing > 1) {
+                q[1] = 0;
+                memset(q + 2, 0xff, stuffing - 2);
+            }
+            q += stuffing;
+            space = remaining;
+        }
+
+        size_t n = space;
+        if (offset < headerSize) {
+            size_t part = std::min(n, headerSize - offset);
+            memcpy(q, header + offset, part);
+            q += part;
+            offset += part;
+            n -= part;
+        }
+        if (n > 0) {
+            memcpy(q, data + offset - headerSize, n);
+            offset += n;
+        }
+        remaining -= space;
+    }
+}
+
+uint8_t *MpegTsMuxer::NextPacket() {
+    if (used_ == MUX_BUFFER_SIZE) {
+        iov_[current_] = {buffers_[current_].get(), used_};
+        current_++;
+        used_ = 0;
+        if (current_ == MUX_BUFFER_COUNT) {
+            Drain();
+        }
+    }
+
+    if (current_ == buffers_.size()) {
+        buffers_.emplace_back(new uint8_t[MUX_BUFFER_SIZE]);
+    }
+
+    uint8_t *packet = buffers_[current_].get() + used_;
+    used_ += TS_PACKET_SIZE;
+    packetCount_++;
+    return packet;
+}
+
+void MpegTsMuxer::Drain() {
+    size_t count = current_;
+    if (used_ > 0) {
+        iov_[count++] = {buffers_[current_].get(), used_};
+    }
+    if (count > 0 && callback_) {
+        callback_(iov_.data(), count);
+    }
+    current_ = 0;
+    used_ = 0;
+}
+
+void MpegTsMuxer::Flush() {
+    Drain();
+}
@@ -0,0 +1,135 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#ifndef MPEG_TS_MEDIA_SRC_MPEG_TS_MUXER_H
+#define MPEG_TS_MEDIA_SRC_MPEG_TS_MUXER_H
+
+#include "mpeg_ts.h"
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <sys/uio.h>
+#include <vector>
+
+#define MUX_BUFFER_SIZE  (TS_PACKET_SIZE * 1024)  // packets are written into buffers of this size
+#define MUX_BUFFER_COUNT 8                        // full buffers handed out together, about 1.5 MB per writev
+#define MUX_MAX_STREAMS  32                       // so that the PMT fits in one packet
+#define MUX_PSI_INTERVAL 9000                     // PAT/PMT repetition, 100 ms at 90 kHz
+#define MUX_PCR_INTERVAL (27000000LL * 25 / 1000) // 25 ms of output between PCRs, TR 101 290 allows 40
+#define MUX_PCR_DELAY    63000                    // PCR runs 700 ms behind DTS, leaving the decoder time to buffer
+#define MUX_PCR_DRIFT    (27000000LL / 10)        // VBR: how far the clock may drift from DTS before it is re-timed
+#define MUX_DEFAULT_RATE 8000000                  // VBR: bits/s assumed until the DTS of two frames tell the rate
+
+// Packs elementary stream frames (H.264/HEVC access units, ADTS frames, ...) into a single program transport
+// stream.
+//
+// Everything constant is prepared once: the 4-byte header of each stream, and the PAT and PMT packets with their
+// CRC, which only change when streams are added. Writing a frame then builds its PES header and copies the payload
+// into the output buffer packet by packet, patching in the continuity counter. Output is collected in
+// MUX_BUFFER_COUNT buffers and handed to the output callback as one iovec array, ready for writev.
+//
+// The PCR follows the position in the output: every packet moves the clock on by its size at the mux rate, and a
+// PCR goes out every MUX_PCR_INTERVAL of it, inside a PES on the PCR PID or in a packet of its own. The clock is
+// set from the DTS of the first frame on the PCR PID (of any frame if the PCR PID carries none), less
+// MUX_PCR_DELAY.
+class MpegTsMuxer {
+public:
+    // |iov| covers whole packets. The buffers are reused once the callback returns.
+    using MuxOutputCallback = std::function<void(const struct iovec *iov, size_t iovcnt)>;
+
+    MpegTsMuxer();
+
+    void SetOutputCallback(MuxOutputCallback callback) { callback_ = std::move(callback); }
+    void SetTransportStreamId(uint16_t transportStreamId);
+    void SetProgram(uint16_t programNumber, uint16_t pmtPid);
+
+    // PCR goes on |pid|, which need not carry a stream. By default it is the first video stream, or else the
+    // first stream added.
+    void SetPcrPid(uint16_t pid);
+
+    // Bits per second of the output, which becomes constant: null packets fill in while frames are ahead of their
+    // DTS. 0, the default, leaves it variable: the rate is estimated from the DTS of the frames, and only changed
+    // when the clock drifts over MUX_PCR_DRIFT away from them.
+    void SetMuxRate(uint64_t bitrate);
+
+    // Streams added after the first frame bump the PMT version. Returns false for a PID already in use or when
+    // MUX_MAX_STREAMS is reached.
+    bool AddStream(uint16_t pid, StreamType codecId);
+
+    // |pts| and |dts| are 90 kHz timestamps; |keyframe| sets random_access_indicator. Returns false if |pid| was
+    // not added.
+    bool Write(uint16_t pid, int64_t pts, int64_t dts, const uint8_t *data, size_t size, bool keyframe = false);
+
+    // Hands out the packets still buffered.
+    void Flush();
+
+    uint64_t PacketCount() const { return packetCount_; }
+
+private:
+    struct MuxStream {
+        uint16_t pid;
+        StreamType codecId;
+        uint8_t header[4]; // template: PID and payload only, PUSI and continuity counter patched per packet
+        uint8_t continuityCounter = 0;
+        TS_PES_Header pes; // PES header template
+    };
+
+    MuxStream *FindStream(uint16_t pid);
+    void UpdatePsi();
+    void WritePsi();
+    // One PES packet: |header| then |data|, with PCRs as they fall due.
+    void WritePes(MuxStream *stream, const uint8_t *header, size_t headerSize, const uint8_t *data, size_t size,
+                  bool keyframe);
+    void WritePcr();
+    void WriteNull();
+
+    // The clock, in 27 MHz ticks not wrapped at 2^33, at the start of the next packet.
+    int64_t Clock() const {
+        return clockBase_ + (int64_t)((packetCount_ * TS_PACKET_SIZE - clockPosition_) * ticksPerByte_);
+    }
+    // Before a packet that would leave the next PCR over MUX_PCR_INTERVAL away from the last.
+    bool PcrDue() const {
+        return clockBase_ >= 0 &&
+               (lastPcr_ < 0 || Clock() + TS_PACKET_SIZE * ticksPerByte_ - lastPcr_ > MUX_PCR_INTERVAL);
+    }
+    void UpdateClock(int64_t dts);
+    uint8_t *NextPacket();
+    void Drain();
+
+private:
+    MuxOutputCallback callback_;
+    TS_PAT pat_;
+    std::vector<MuxStream> streams_;
+    uint16_t pcrPid_ = PID_NULL;
+    bool pcrPidSet_ = false;
+
+    bool psiDirty_ = true;
+    std::array<uint8_t, TS_PACKET_SIZE> patPacket_;
+    std::array<uint8_t, TS_PACKET_SIZE> pmtPacket_;
+    uint8_t patCounter_ = 0;
+    uint8_t pmtCounter_ = 0;
+    int64_t lastPsi_ = -1; // DTS at the last PAT/PMT
+
+    uint64_t muxRate_ = 0; // 0: VBR
+    double ticksPerByte_ = 27000000.0 * 8 / MUX_DEFAULT_RATE;
+    int64_t clockBase_ = -1; // clock at byte |clockPosition_| of the output, -1 until the first frame
+    uint64_t clockPosition_ = 0;
+    int64_t lastDts_ = -1;    // of the last frame that timed the clock
+    int64_t target_ = 0;      // its DTS less MUX_PCR_DELAY, in clock ticks
+    int64_t firstTarget_ = 0; // the same when the clock started, with the position, for the average rate
+    uint64_t firstPosition_ = 0;
+    int64_t drift_ = 0; // VBR: target less clock when the rate was last changed
+    int64_t lastPcr_ = -1;
+    bool discontinuity_ = false; // for the next PCR
+    bool late_ = false;          // frames came faster than a constant mux rate, reported once
+
+    std::vector<std::unique_ptr<uint8_t[]>> buffers_;
+    std::array<struct iovec, MUX_BUFFER_COUNT> iov_;
+    size_t current_ = 0; // buffer being filled
+    size_t used_ = 0;    // bytes used in it
+    uint64_t packetCount_ = 0;
+};
+
+#endif // MPEG_TS_MEDIA_SRC_MPEG_TS_MUXER_H
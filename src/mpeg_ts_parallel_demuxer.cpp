@@ -0,0 +1,244 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#include "mpeg_ts_parallel_demuxer.h"
+#include "logger.h"
+#include "ts_sync.h"
+#include <algorithm>
+#include <thread>
+
+#define PARALLEL_MIN_CHUNK_SIZE (1 << 20)
+#define PARALLEL_MAX_CHUNK_SIZE (64 << 20)
+#define PARALLEL_CHUNKS_PER_THREAD 2 // chunks in flight per worker, bounds the memory held by unstitched frames
+
+static void AppendSpans(std::vector<struct iovec> &to, const struct iovec *iov, size_t iovcnt) {
+    for (size_t i = 0; i < iovcnt; i++) {
+        if (!to.empty() && (const uint8_t *)to.back().iov_base + to.back().iov_len == iov[i].iov_base) {
+            to.back().iov_len += iov[i].iov_len;
+        } else if (iov[i].iov_len > 0) {
+            to.push_back(iov[i]);
+        }
+    }
+}
+
+MpegTsParallelDemuxer::MpegTsParallelDemuxer(int threads) : threads_(threads) {
+    if (threads_ <= 0) {
+        threads_ = std::max(1u, std::thread::hardware_concurrency());
+    }
+}
+
+bool MpegTsParallelDemuxer::Demux(const uint8_t *data, size_t size) {
+    const uint8_t *sync = nullptr;
+    size_t packetSize = TsDetectPacketSize(data, size, &sync);
+    if (packetSize == 0) {
+        TS_LOGE("No MPEG-TS packets found");
+        return false;
+    }
+
+    if (chunkSize_ == 0) {
+        chunkSize_ = std::clamp(size / ((size_t)threads_ * 4), (size_t)PARALLEL_MIN_CHUNK_SIZE,
+                                (size_t)PARALLEL_MAX_CHUNK_SIZE);
+    }
+    TS_LOGI("Parallel demux: packet size %zu, %d threads, %zu byte chunks", packetSize, threads_, chunkSize_);
+
+    psi_ = std::make_unique<MpegTsDemuxer>();
+    psi_->SetPsiOnly(true);
+    psi_->SetPacketSize(packetSize);
+    chunks_.clear();
+    pending_.clear();
+    next_ = 0;
+    produced_ = false;
+
+    std::thread producer([&]() { Produce(sync, data + size - sync); });
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads_; i++) {
+        workers.emplace_back([this]() { Work(); });
+    }
+
+    // Stitch in stream order as chunks complete.
+    while (true) {
+        std::unique_ptr<Chunk> chunk;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait(lock, [this]() {
+                return (!chunks_.empty() && chunks_.front()->done) || (produced_ && chunks_.empty());
+            });
+            if (chunks_.empty()) {
+                break;
+            }
+
+            chunk = std::move(chunks_.front());
+            chunks_.pop_front();
+            next_--;
+        }
+        cond_.notify_all();
+
+        Stitch(chunk.get());
+    }
+
+    producer.join();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    // Same order as MpegTsDemuxer::Flush().
+    for (auto &program : psi_->GetPAT().programs) {
+        if (!program.pmt) {
+            continue;
+        }
+
+        for (auto &stream : program.pmt->streams) {
+            auto it = pending_.find(stream.elementary_PID);
+            if (it != pending_.end()) {
+                Emit(it->second);
+                pending_.erase(it);
+            }
+        }
+    }
+    pending_.clear();
+
+    return true;
+}
+
+void MpegTsParallelDemuxer::Produce(const uint8_t *data, size_t size) {
+    const uint8_t *end = data + size;
+    const uint8_t *p = data;
+    size_t packetSize = psi_->GetPacketSize();
+
+    while (p < end) {
+        const uint8_t *cut = end;
+        if ((size_t)(end - p) > chunkSize_ + packetSize) {
+            // Stay on the packet grid, but confirm it: past stray bytes the grid may point into a packet, and a
+            // 0x47 there would cut the packet short where the serial demuxer keeps it. An intact grid is confirmed
+            // as it stands.
+            cut = TsResync(p + std::max(chunkSize_ / packetSize, (size_t)1) * packetSize, end, packetSize);
+        }
+
+        auto chunk = std::make_unique<Chunk>();
+        chunk->data = p;
+        chunk->size = cut - p;
+        chunk->demuxer = std::make_unique<MpegTsDemuxer>();
+        chunk->demuxer->CopyPsi(*psi_);
+
+        psi_->Input(p, cut - p);
+        p = cut;
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [this]() { return chunks_.size() < (size_t)threads_ * PARALLEL_CHUNKS_PER_THREAD; });
+        chunks_.push_back(std::move(chunk));
+        cond_.notify_all();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    produced_ = true;
+    cond_.notify_all();
+}
+
+void MpegTsParallelDemuxer::Work() {
+    while (true) {
+        Chunk *chunk = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait(lock, [this]() { return next_ < chunks_.size() || (produced_ && next_ >= chunks_.size()); });
+            if (next_ >= chunks_.size()) {
+                return;
+            }
+            chunk = chunks_[next_++].get();
+        }
+
+        DemuxChunk(chunk);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            chunk->done = true;
+        }
+        cond_.notify_all();
+    }
+}
+
+void MpegTsParallelDemuxer::DemuxChunk(Chunk *chunk) {
+    MpegTsDemuxer &demuxer = *chunk->demuxer;
+    auto take = [](Frame &frame, ChunkFrame &out) {
+        out.pid = frame.pid;
+        out.codecId = frame.codecId;
+        out.pts = frame.pts;
+        out.dts = frame.dts;
+        out.iov = std::move(frame.iov);
+        out.pinned = std::move(frame.pinned);
+    };
+
+    demuxer.SetFrameMode(FRAME_MODE_IOVEC);
+    demuxer.SetDemuxFrameCallback([&](Frame &frame) {
+        chunk->frames.emplace_back();
+        take(frame, chunk->frames.back());
+    });
+    demuxer.SetDemuxOrphanCallback([&](uint16_t pid, const uint8_t *data, size_t size) {
+        if (size == 0) {
+            chunk->frames.emplace_back();
+            chunk->frames.back().pid = pid;
+            chunk->frames.back().boundary = true;
+            return;
+        }
+
+        struct iovec iov = {(void *)data, size};
+        AppendSpans(chunk->heads[pid], &iov, 1);
+    });
+
+    demuxer.Input(chunk->data, chunk->size);
+
+    demuxer.TakeOpenFrames([&](uint16_t pid, Frame &frame, bool open) {
+        chunk->tails.emplace_back();
+        take(frame, chunk->tails.back());
+        chunk->tails.back().pid = pid;
+        chunk->tails.back().open = open;
+    });
+    chunk->demuxer.reset();
+}
+
+void MpegTsParallelDemuxer::Stitch(Chunk *chunk) {
+    // Everything before the first PES packet of a stream continues the frame left open by earlier chunks, unless an
+    // invalid PES header has ended its payload.
+    for (auto &head : chunk->heads) {
+        auto it = pending_.find(head.first);
+        if (it != pending_.end() && it->second.open) {
+            AppendSpans(it->second.iov, head.second.data(), head.second.size());
+        }
+    }
+
+    for (auto &frame : chunk->frames) {
+        if (!frame.boundary) {
+            Emit(frame);
+            continue;
+        }
+
+        auto it = pending_.find(frame.pid);
+        if (it != pending_.end()) {
+            Emit(it->second);
+            pending_.erase(it);
+        }
+    }
+
+    for (auto &tail : chunk->tails) {
+        // Still pending, the chunk had only invalid PES headers for it: they end its payload, and the tail is empty.
+        auto it = pending_.find(tail.pid);
+        if (it != pending_.end()) {
+            it->second.open = false;
+        } else {
+            pending_[tail.pid] = std::move(tail);
+        }
+    }
+}
+
+void MpegTsParallelDemuxer::Emit(ChunkFrame &frame) {
+    if (frame.iov.empty()) {
+        return;
+    }
+
+    if (iovCallback_) {
+        iovCallback_(frame.codecId, frame.pts, frame.dts, frame.iov.data(), frame.iov.size());
+    } else if (callback_) {
+        IovLinearize(frame.iov.data(), frame.iov.size(), scratch_);
+        callback_(frame.codecId, frame.pts, frame.dts, (const uint8_t *)scratch_.data(), scratch_.size());
+    }
+}
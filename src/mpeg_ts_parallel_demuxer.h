@@ -0,0 +1,79 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#ifndef MPEG_TS_MEDIA_SRC_MPEG_TS_PARALLEL_DEMUXER_H
+#define MPEG_TS_MEDIA_SRC_MPEG_TS_PARALLEL_DEMUXER_H
+
+#include "mpeg_ts_demuxer.h"
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Demuxes a whole in-memory stream (usually a FileReader mapping) on several threads.
+//
+// A producer thread walks the packets once, following only PAT/PMT, and cuts the buffer into chunks at sync
+// bytes, recording the program tables in force at each cut. Workers demux the chunks independently in zero-copy
+// mode. The calling thread then stitches the frames that straddle cuts back together and delivers everything in
+// the same order, with the same bytes, as MpegTsDemuxer::Input() followed by Flush() would.
+class MpegTsParallelDemuxer {
+public:
+    explicit MpegTsParallelDemuxer(int threads = 0); // 0: one per CPU
+
+    void SetDemuxCallback(MpegTsDemuxer::DemuxCallback callback) { callback_ = std::move(callback); }
+    void SetDemuxIovCallback(MpegTsDemuxer::DemuxIovCallback callback) { iovCallback_ = std::move(callback); }
+    void SetChunkSize(size_t chunkSize) { chunkSize_ = chunkSize; }
+
+    // |data| must stay valid until Demux() returns. Callbacks run on the calling thread.
+    bool Demux(const uint8_t *data, size_t size);
+
+private:
+    struct ChunkFrame {
+        uint16_t pid = 0;
+        bool boundary = false; // first valid PES header of |pid| in the chunk: frames from earlier chunks end
+        bool open = true;      // payload at the start of the next chunk still belongs to it
+        StreamType codecId = STREAM_TYPE_RESERVED;
+        int64_t pts = 0;
+        int64_t dts = 0;
+        std::vector<struct iovec> iov;
+        std::deque<std::array<uint8_t, TS_PACKET_SIZE>> pinned;
+    };
+
+    struct Chunk {
+        const uint8_t *data = nullptr;
+        size_t size = 0;
+        std::unique_ptr<MpegTsDemuxer> demuxer; // seeded with the program tables at the start of the chunk
+        std::vector<ChunkFrame> frames;
+        std::unordered_map<uint16_t, std::vector<struct iovec>> heads; // payload before the first PES packet
+        std::vector<ChunkFrame> tails;                                  // frames still open at the end
+        bool done = false;
+    };
+
+    void Produce(const uint8_t *data, size_t size);
+    void Work();
+    void DemuxChunk(Chunk *chunk);
+    void Stitch(Chunk *chunk);
+    void Emit(ChunkFrame &frame);
+
+private:
+    int threads_;
+    size_t chunkSize_ = 0;
+    MpegTsDemuxer::DemuxCallback callback_;
+    MpegTsDemuxer::DemuxIovCallback iovCallback_;
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<std::unique_ptr<Chunk>> chunks_; // in stream order, from the oldest not yet stitched
+    size_t next_ = 0;                           // index into chunks_ of the next chunk to hand to a worker
+    bool produced_ = false;
+
+    std::unique_ptr<MpegTsDemuxer> psi_; // follows the program tables ahead of the workers
+    std::unordered_map<uint16_t, ChunkFrame> pending_;
+    data_t scratch_;
+};
+
+#endif // MPEG_TS_MEDIA_SRC_MPEG_TS_PARALLEL_DEMUXER_H
@@ -0,0 +1,214 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#include "mpeg_ts_probe.h"
+#include "logger.h"
+#include "mpeg_ts_demuxer.h"
+#include "ts_sync.h"
+#include <algorithm>
+#include <unordered_map>
+#include <utility>
+
+#define PROBE_STEP (64 * 1024) // the head is fed in steps so that probing stops as soon as it has everything
+#define PTS_WRAP   (1LL << 33)
+
+// Ticks from |first| to |last| across at most one 33-bit wrap, -1 if either is missing.
+static int64_t Elapsed(int64_t first, int64_t last) {
+    if (first < 0 || last < 0) {
+        return -1;
+    }
+    return (last - first + PTS_WRAP) % PTS_WRAP;
+}
+
+// PTS of the PES packet starting at |data|, -1 if it has none.
+static int64_t PesPts(const uint8_t *data, size_t size) {
+    if (size < 14 || data[0] != 0 || data[1] != 0 || data[2] != 0x01 || (data[6] & 0xc0) != 0x80 ||
+        !(data[7] & 0x80)) {
+        return -1;
+    }
+
+    const uint8_t *t = data + 9;
+    return ((((int64_t)t[0] >> 1) & 0x07) << 30) | ((int64_t)t[1] << 22) | (((int64_t)t[2] >> 1) << 15) |
+           ((int64_t)t[3] << 7) | (t[4] >> 1);
+}
+
+bool MpegTsProbe::Probe(const uint8_t *data, size_t size, ProbeInfo &info) {
+    info = ProbeInfo();
+    info.size = size;
+
+    // Only access unit starts are needed, so frames are collected as spans into |data| and never copied.
+    MpegTsDemuxer demuxer;
+    demuxer.SetFrameMode(FRAME_MODE_IOVEC);
+    std::unordered_map<uint16_t, int64_t> pts;                       // first PTS by PID
+    std::unordered_map<uint16_t, std::pair<int64_t, uint64_t>> pcrs; // first PCR and its offset by PID
+    demuxer.SetDemuxUnitCallback([&](const AccessUnit &unit) { pts.emplace(unit.pid, unit.pts); });
+    demuxer.SetDemuxPcrCallback(
+        [&](uint16_t pid, int64_t pcr, uint64_t offset) { pcrs.emplace(pid, std::make_pair(pcr, offset)); });
+
+    const TS_PAT &pat = demuxer.GetPAT();
+    auto complete = [&]() {
+        if (pat.programs.empty() || demuxer.GetSDT().services.empty()) {
+            return false;
+        }
+
+        for (auto &program : pat.programs) {
+            if (!program.pmt || (program.pmt->PCR_PID != PID_NULL && !pcrs.count(program.pmt->PCR_PID))) {
+                return false;
+            }
+            for (auto &stream : program.pmt->streams) {
+                if (!pts.count(stream.elementary_PID)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    };
+
+    size_t head = std::min(size, headSize_);
+    for (size_t pos = 0; pos < head && !complete(); pos += PROBE_STEP) {
+        demuxer.Input(data + pos, std::min((size_t)PROBE_STEP, head - pos));
+    }
+
+    info.packetSize = demuxer.GetPacketSize();
+    if (info.packetSize == 0 || pat.programs.empty()) {
+        TS_LOGE("No transport stream program found in the first %zu bytes", head);
+        return false;
+    }
+
+    info.transportStreamId = pat.transport_stream_id;
+    for (auto &program : pat.programs) {
+        ProbeProgram entry;
+        entry.programNumber = program.program_number;
+        entry.pmtPid = program.program_map_PID;
+        entry.pcrPid = program.pmt ? program.pmt->PCR_PID : (uint16_t)PID_NULL;
+        for (auto &service : demuxer.GetSDT().services) {
+            if (service.service_id == program.program_number) {
+                entry.providerName = service.provider_name;
+                entry.serviceName = service.service_name;
+            }
+        }
+
+        auto pcr = pcrs.find(entry.pcrPid);
+        if (pcr != pcrs.end()) {
+            entry.firstPcr = pcr->second.first;
+            entry.firstPcrOffset = pcr->second.second;
+        }
+
+        if (program.pmt) {
+            for (auto &stream : program.pmt->streams) {
+                ProbeStream probeStream;
+                probeStream.pid = stream.elementary_PID;
+                probeStream.codecId = (StreamType)stream.stream_type;
+                auto it = pts.find(stream.elementary_PID);
+                if (it != pts.end()) {
+                    probeStream.firstPts = it->second;
+                }
+                entry.streams.push_back(probeStream);
+            }
+        }
+        info.programs.push_back(std::move(entry));
+    }
+
+    ScanTail(data, size, info);
+
+    // The longest program sets the duration; the bitrate is taken between its PCRs, which leaves out whatever
+    // comes before the first and after the last one.
+    int64_t pcrSpan = 0;
+    for (auto &program : info.programs) {
+        int64_t duration = Elapsed(program.firstPcr, program.lastPcr);
+        if (duration > pcrSpan && program.lastPcrOffset > program.firstPcrOffset) {
+            pcrSpan = duration;
+            info.bitrate = (program.lastPcrOffset - program.firstPcrOffset) * 8 * 90000 / duration;
+        }
+
+        if (duration <= 0) {
+            for (auto &stream : program.streams) {
+                duration = std::max(duration, Elapsed(stream.firstPts, stream.lastPts));
+            }
+        }
+        info.duration = std::max(info.duration, duration);
+    }
+
+    if (info.bitrate == 0 && info.duration > 0) {
+        info.bitrate = size * 8 * 90000 / info.duration;
+    }
+    return true;
+}
+
+void MpegTsProbe::ScanTail(const uint8_t *data, size_t size, ProbeInfo &info) {
+    // Anchor the walk on the last packets. The grid of the head is tried first, as the parity of 204-byte packets
+    // may hold sync bytes, but it no longer fits once damaged data has shifted the packets.
+    const uint8_t *end = data + size;
+    size_t packetSize = info.packetSize;
+    const uint8_t *from = end - std::min(size, (TS_SYNC_CONFIRM_COUNT + 2) * packetSize);
+    const uint8_t *anchor = TsResync(data, end, packetSize);
+    if (from > anchor) {
+        anchor += (from - anchor + packetSize - 1) / packetSize * packetSize;
+    }
+    if (anchor >= end || TsResync(anchor, end, packetSize) != anchor) {
+        anchor = TsResync(from, end, packetSize);
+    }
+    if (end - anchor < TS_PACKET_SIZE) {
+        return;
+    }
+
+    // Programs may share a PCR PID.
+    std::unordered_map<uint16_t, std::vector<ProbeProgram *>> pcrPrograms;
+    std::unordered_map<uint16_t, ProbeStream *> streams;
+    size_t pending = 0;
+    for (auto &program : info.programs) {
+        if (program.pcrPid != PID_NULL) {
+            pcrPrograms[program.pcrPid].push_back(&program);
+            pending++;
+        }
+        for (auto &stream : program.streams) {
+            streams[stream.pid] = &stream;
+            pending++;
+        }
+    }
+
+    // Walk back from the last whole packet until every program has its last PCR and every stream its last PTS.
+    const uint8_t *low = data + (size > tailSize_ ? size - tailSize_ : 0);
+    ptrdiff_t last = (end - anchor - TS_PACKET_SIZE) / packetSize;
+    ptrdiff_t first = anchor > low ? -((anchor - low) / (ptrdiff_t)packetSize) : 0;
+    for (ptrdiff_t n = last; n >= first && pending > 0; n--) {
+        // As when demuxing, a packet only counts when the next one starts where it should. Packets before damaged
+        // data are off the grid and skipped.
+        const uint8_t *p = anchor + n * (ptrdiff_t)packetSize;
+        if (p[0] != TS_SYNC_BYTE || (p + packetSize < end && p[packetSize] != TS_SYNC_BYTE)) {
+            continue;
+        }
+
+        TSPacketHeader *tsPacket = (TSPacketHeader *)p;
+        uint16_t pid = tsPacket->GetPID();
+        size_t i = 4;
+        if (tsPacket->adaptation_field_control & 0x02) {
+            TS_Adaption adaptation;
+            if (!adaptation.Parse(p + i, TS_PACKET_SIZE - i)) {
+                continue;
+            }
+            auto it = pcrPrograms.find(pid);
+            if (adaptation.adaptation_field_length > 0 && adaptation.PCR_flag && it != pcrPrograms.end()) {
+                for (auto program : it->second) {
+                    if (program->lastPcr < 0) {
+                        program->lastPcr = adaptation.program_clock_reference_base;
+                        program->lastPcrOffset = p - data;
+                        pending--;
+                    }
+                }
+            }
+            i += adaptation.adaptation_field_length + 1;
+        }
+
+        if (!tsPacket->payload_unit_start_indicator || !(tsPacket->adaptation_field_control & 0x01)) {
+            continue;
+        }
+
+        auto it = streams.find(pid);
+        if (it != streams.end() && it->second->lastPts < 0) {
+            it->second->lastPts = PesPts(p + i, TS_PACKET_SIZE - i);
+            pending -= it->second->lastPts >= 0;
+        }
+    }
+}
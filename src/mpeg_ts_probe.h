@@ -0,0 +1,67 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#ifndef MPEG_TS_MEDIA_SRC_MPEG_TS_PROBE_H
+#define MPEG_TS_MEDIA_SRC_MPEG_TS_PROBE_H
+
+#include "mpeg_ts.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define PROBE_HEAD_SIZE (4 * 1024 * 1024) // program tables and first timestamps are looked for here
+#define PROBE_TAIL_SIZE (2 * 1024 * 1024) // last timestamps are looked for here, scanning backwards
+
+struct ProbeStream {
+    uint16_t pid;
+    StreamType codecId;
+    int64_t firstPts = -1; // 90 kHz, -1 if not found
+    int64_t lastPts = -1;
+};
+
+struct ProbeProgram {
+    uint16_t programNumber;
+    uint16_t pmtPid;
+    uint16_t pcrPid;
+    std::string providerName; // from the SDT, empty without one
+    std::string serviceName;
+    int64_t firstPcr = -1; // 90 kHz base, -1 if not found
+    int64_t lastPcr = -1;
+    uint64_t firstPcrOffset = 0;
+    uint64_t lastPcrOffset = 0;
+    std::vector<ProbeStream> streams;
+};
+
+struct ProbeInfo {
+    uint64_t size = 0;
+    size_t packetSize = 0;
+    uint16_t transportStreamId = 0;
+    std::vector<ProbeProgram> programs;
+    int64_t duration = -1; // 90 kHz, from the PCRs, or the PTSs when a program has no PCR; -1 if unknown
+    uint64_t bitrate = 0;  // bits per second
+};
+
+// Describes a stream from its first and last few megabytes, the way ffprobe does, so the cost does not depend on
+// the size of the file.
+//
+// The head is demuxed (without assembling frames) until the PAT, every PMT, the SDT and the first PCR and PTS of
+// everything have turned up. The tail is then walked backwards, packet by packet, for the last PCR and PTS.
+class MpegTsProbe {
+public:
+    void SetHeadSize(size_t headSize) { headSize_ = headSize; }
+    void SetTailSize(size_t tailSize) { tailSize_ = tailSize; }
+
+    // |data| is the whole stream, typically a FileReader mapping; only its head and tail are read.
+    bool Probe(const uint8_t *data, size_t size, ProbeInfo &info);
+
+private:
+    void ScanTail(const uint8_t *data, size_t size, ProbeInfo &info);
+
+private:
+    size_t headSize_ = PROBE_HEAD_SIZE;
+    size_t tailSize_ = PROBE_TAIL_SIZE;
+};
+
+#endif // MPEG_TS_MEDIA_SRC_MPEG_TS_PROBE_H
@@ -0,0 +1,195 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#include "nal_scanner.h"
+#include "mpeg_ts.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NAL_SCANNER_X86 1
+#endif
+
+// A byte above 1 at p[2] rules out start codes at p, p + 1 and p + 2, so most of the data is stepped over
+// three bytes at a time.
+static const uint8_t *FindStartCodeScalar(const uint8_t *p, const uint8_t *end) {
+    while (p + 3 <= end) {
+        if (p[2] > 1) {
+            p += 3;
+        } else if (p[2] == 0) {
+            p++;
+        } else if (p[0] == 0 && p[1] == 0) {
+            return p;
+        } else {
+            p += 3;
+        }
+    }
+    return end;
+}
+
+#ifdef NAL_SCANNER_X86
+__attribute__((target("sse2"))) static const uint8_t *FindStartCodeSSE2(const uint8_t *p, const uint8_t *end) {
+    if (end - p < 18) {
+        return FindStartCodeScalar(p, end);
+    }
+
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    const uint8_t *last = end - 18;
+    while (true) {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), zero);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 1)), zero);
+        __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 2)), one);
+        int mask = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(a, b), c));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        if (p == last) {
+            return end;
+        }
+        p = p + 16 < last ? p + 16 : last;
+    }
+}
+
+__attribute__((target("avx2"))) static const uint8_t *FindStartCodeAVX2(const uint8_t *p, const uint8_t *end) {
+    if (end - p < 34) {
+        return FindStartCodeSSE2(p, end);
+    }
+
+    // The last block is loaded so that it ends with the buffer, overlapping the one before, which spares a scalar
+    // tail on every packet payload. It covers the last position a start code can begin at.
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    const uint8_t *last = end - 34;
+    while (true) {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), zero);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 1)), zero);
+        __m256i c = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 2)), one);
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(a, b), c));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        if (p == last) {
+            return end;
+        }
+        p = p + 32 < last ? p + 32 : last;
+    }
+}
+#endif
+
+using FindStartCodeFunc = const uint8_t *(*)(const uint8_t *p, const uint8_t *end);
+
+static FindStartCodeFunc SelectFindStartCode() {
+#ifdef NAL_SCANNER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return FindStartCodeAVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return FindStartCodeSSE2;
+    }
+#endif
+    return FindStartCodeScalar;
+}
+
+static const FindStartCodeFunc findStartCode = SelectFindStartCode();
+
+const uint8_t *FindStartCode(const uint8_t *p, const uint8_t *end) {
+    return p < end ? findStartCode(p, end) : end;
+}
+
+bool NalScanner::Reset(uint8_t codec) {
+    codec_ = codec == STREAM_TYPE_VIDEO_H264 || codec == STREAM_TYPE_VIDEO_HEVC ? codec : 0;
+    position_ = 0;
+    zeros_ = 0;
+    needHeader_ = false;
+    open_ = false;
+    return codec_ != 0;
+}
+
+bool NalScanner::IsKeyframe(uint8_t codec, uint8_t type) {
+    if (codec == STREAM_TYPE_VIDEO_H264) {
+        return type == 5;
+    }
+    return codec == STREAM_TYPE_VIDEO_HEVC && type >= 16 && type <= 23;
+}
+
+void NalScanner::Scan(const uint8_t *data, size_t size, std::vector<NalUnit> &units, bool &keyframe) {
+    if (codec_ == 0 || size == 0) {
+        return;
+    }
+
+    const uint8_t *end = data + size;
+    if (needHeader_) {
+        needHeader_ = false;
+        SetType(data[0], units, keyframe);
+    }
+
+    // Start codes whose zero bytes ended the previous payload.
+    size_t skip = 0;
+    if (zeros_ >= 2 && data[0] == 1) {
+        skip = 1;
+    } else if (zeros_ >= 1 && size >= 2 && data[0] == 0 && data[1] == 1) {
+        skip = 2;
+    }
+    if (skip > 0) {
+        StartCode(position_ - zeros_, position_ + skip, units);
+        if (size > skip) {
+            SetType(data[skip], units, keyframe);
+        } else {
+            needHeader_ = true;
+        }
+    }
+
+    for (const uint8_t *q = FindStartCode(data, end); q < end; q = FindStartCode(q + 3, end)) {
+        // The unit before ends at the first of the zero bytes leading up to the start code.
+        const uint8_t *z = q;
+        while (z > data && z[-1] == 0) {
+            z--;
+        }
+        StartCode(position_ + (z - data) - (z == data ? zeros_ : 0), position_ + (q - data) + 3, units);
+        if (q + 3 < end) {
+            SetType(q[3], units, keyframe);
+        } else {
+            needHeader_ = true;
+        }
+    }
+
+    const uint8_t *t = end;
+    while (t > data && t[-1] == 0) {
+        t--;
+    }
+    zeros_ = t == data ? zeros_ + size : end - t;
+    position_ += size;
+}
+
+void NalScanner::Finish(std::vector<NalUnit> &units) {
+    if (needHeader_) {
+        // A start code at the very end introduces nothing.
+        units.pop_back();
+        open_ = false;
+    }
+    if (open_) {
+        NalUnit &unit = units.back();
+        unit.size = position_ - zeros_ > unit.offset ? (uint32_t)(position_ - zeros_ - unit.offset) : 0;
+    }
+    needHeader_ = false;
+    open_ = false;
+}
+
+void NalScanner::StartCode(uint64_t end, uint64_t header, std::vector<NalUnit> &units) {
+    if (open_) {
+        NalUnit &unit = units.back();
+        unit.size = end > unit.offset ? (uint32_t)(end - unit.offset) : 0;
+    }
+    units.push_back({(uint32_t)header, 0, 0});
+    open_ = true;
+}
+
+void NalScanner::SetType(uint8_t header, std::vector<NalUnit> &units, bool &keyframe) {
+    uint8_t type = codec_ == STREAM_TYPE_VIDEO_H264 ? header & 0x1f : (header >> 1) & 0x3f;
+    units.back().type = type;
+    if (IsKeyframe(codec_, type)) {
+        keyframe = true;
+    }
+}
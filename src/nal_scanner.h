@@ -0,0 +1,50 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#ifndef MPEG_TS_MEDIA_SRC_NAL_SCANNER_H
+#define MPEG_TS_MEDIA_SRC_NAL_SCANNER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct NalUnit {
+    uint32_t offset; // of the NAL unit header within the frame, just past its start code
+    uint32_t size;   // up to the next start code, without the zero bytes before it
+    uint8_t type;    // nal_unit_type
+};
+
+// Returns the first 00 00 01 in [p, end), or end. Uses AVX2 or SSE2 when the CPU has them.
+const uint8_t *FindStartCode(const uint8_t *p, const uint8_t *end);
+
+// Finds the NAL units of an H.264 or HEVC access unit (Annex B byte stream) while it is reassembled, one payload
+// at a time, so every byte is scanned while still in cache from the copy. Start codes may straddle payloads.
+class NalScanner {
+public:
+    // Starts a new access unit. Returns false, and scans nothing until the next Reset(), for other codecs.
+    bool Reset(uint8_t codec);
+
+    // |data| continues the access unit. Units are appended to |units| as their start codes turn up; |keyframe|
+    // is set once an IDR or IRAP picture does.
+    void Scan(const uint8_t *data, size_t size, std::vector<NalUnit> &units, bool &keyframe);
+
+    // Closes the last unit at the end of the access unit.
+    void Finish(std::vector<NalUnit> &units);
+
+    // IDR picture for H.264, IRAP picture for HEVC.
+    static bool IsKeyframe(uint8_t codec, uint8_t type);
+
+private:
+    void StartCode(uint64_t end, uint64_t header, std::vector<NalUnit> &units);
+    void SetType(uint8_t header, std::vector<NalUnit> &units, bool &keyframe);
+
+private:
+    uint8_t codec_ = 0;       // 0 while not scanning
+    uint64_t position_ = 0;   // bytes of the access unit scanned so far
+    uint64_t zeros_ = 0;      // zero bytes at the end of what was scanned
+    bool needHeader_ = false; // a start code ended the last payload; its NAL header byte comes next
+    bool open_ = false;       // the last unit still runs
+};
+
+#endif // MPEG_TS_MEDIA_SRC_NAL_SCANNER_H
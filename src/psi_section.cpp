@@ -0,0 +1,131 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#include "psi_section.h"
+#include "crc32.h"
+#include "logger.h"
+#include <algorithm>
+#include <cstring>
+
+#define PSI_STUFFING_BYTE 0xff
+
+static size_t SectionSize(const uint8_t *header) {
+    return PSI_SECTION_HEADER_SIZE + (((header[1] & 0x0f) << 8) | header[2]);
+}
+
+void SectionAssembler::Push(const uint8_t *payload, size_t size, bool start, uint8_t continuityCounter,
+                            const SectionCallback &callback) {
+    bool continuous = continuityCounter_ >= 0 && continuityCounter == ((continuityCounter_ + 1) & 0x0f);
+    if (continuityCounter_ >= 0 && continuityCounter == continuityCounter_) {
+        return; // duplicate packet
+    }
+    continuityCounter_ = continuityCounter;
+
+    const uint8_t *p = payload;
+    const uint8_t *end = payload + size;
+    if (!continuous && active_) {
+        TS_LOGW("PSI section dropped, continuity counter gap");
+        active_ = false;
+    }
+
+    if (!start) {
+        if (active_) {
+            Consume(p, end, callback);
+        }
+        return;
+    }
+
+    if (size == 0 || p + 1 + *p > end) {
+        active_ = false;
+        return;
+    }
+
+    // The bytes before pointer_field's target finish the previous section.
+    const uint8_t *first = p + 1 + *p;
+    if (active_) {
+        Consume(p + 1, first, callback);
+    }
+    active_ = false;
+    Consume(first, end, callback);
+}
+
+void SectionAssembler::Consume(const uint8_t *p, const uint8_t *end, const SectionCallback &callback) {
+    if (active_) {
+        if (expected_ == 0) {
+            size_t need = std::min((size_t)(PSI_SECTION_HEADER_SIZE - buffer_.size()), (size_t)(end - p));
+            buffer_.append((const char *)p, need);
+            p += need;
+            if (buffer_.size() < PSI_SECTION_HEADER_SIZE) {
+                return;
+            }
+            expected_ = SectionSize((const uint8_t *)buffer_.data());
+            if (expected_ > PSI_SECTION_MAX_SIZE) {
+                TS_LOGW("PSI section of %zu bytes dropped", expected_);
+                active_ = false;
+                return;
+            }
+        }
+
+        size_t need = std::min(expected_ - buffer_.size(), (size_t)(end - p));
+        buffer_.append((const char *)p, need);
+        p += need;
+        if (buffer_.size() < expected_) {
+            return;
+        }
+
+        active_ = false;
+        callback((const uint8_t *)buffer_.data(), buffer_.size());
+    }
+
+    // Complete sections are handed out in place; only one that runs past the packet is copied.
+    while (p < end && *p != PSI_STUFFING_BYTE) {
+        if (end - p < PSI_SECTION_HEADER_SIZE) {
+            buffer_.assign((const char *)p, end - p);
+            expected_ = 0;
+            active_ = true;
+            return;
+        }
+
+        size_t sectionSize = SectionSize(p);
+        if (sectionSize > PSI_SECTION_MAX_SIZE) {
+            TS_LOGW("PSI section of %zu bytes dropped", sectionSize);
+            return;
+        }
+
+        if ((size_t)(end - p) < sectionSize) {
+            buffer_.assign((const char *)p, end - p);
+            buffer_.reserve(sectionSize);
+            expected_ = sectionSize;
+            active_ = true;
+            return;
+        }
+
+        callback(p, sectionSize);
+        p += sectionSize;
+    }
+}
+
+SectionState SectionCache::Update(uint16_t pid, const uint8_t *section, size_t size) {
+    // Sections without the long syntax have no CRC to go by.
+    if (size < 8 + PSI_CRC_SIZE || !(section[1] & 0x80)) {
+        return SECTION_NEW;
+    }
+
+    uint8_t tableId = section[0];
+    uint16_t extension = (section[3] << 8) | section[4];
+    uint8_t sectionNumber = section[6];
+    uint64_t key = ((uint64_t)pid << 40) | ((uint64_t)tableId << 32) | ((uint64_t)extension << 16) | sectionNumber;
+    auto it = entries_.find(key);
+    if (it != entries_.end() && it->second.size() == size && memcmp(it->second.data(), section, size) == 0) {
+        return SECTION_REPEAT;
+    }
+
+    if (Crc32Mpeg2(section, size) != 0) {
+        TS_LOGW("PSI section on PID 0x%04x (table_id 0x%02x) failed its CRC check, ignored", pid, tableId);
+        return SECTION_CORRUPT;
+    }
+
+    entries_[key].assign((const char *)section, size);
+    return SECTION_NEW;
+}
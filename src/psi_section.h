@@ -0,0 +1,59 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#ifndef MPEG_TS_MEDIA_SRC_PSI_SECTION_H
+#define MPEG_TS_MEDIA_SRC_PSI_SECTION_H
+
+#include "mpeg_ts.h"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+
+#define PSI_SECTION_HEADER_SIZE 3    // table_id, section_syntax_indicator ... section_length
+#define PSI_SECTION_MAX_SIZE    4096 // private sections; PAT/PMT stay within 1024
+#define PSI_CRC_SIZE            4
+
+// Rebuilds the sections (ISO/IEC 13818-1 2.4.4) carried on one PID from its packet payloads. A section may span
+// packets and a packet may hold the end of one section and the start of others.
+class SectionAssembler {
+public:
+    // |section| covers the whole section, CRC included. It points into the packet whenever the section did not
+    // span packets, so it is only valid during the call.
+    using SectionCallback = std::function<void(const uint8_t *section, size_t size)>;
+
+    // |payload| follows the adaptation field and starts with the pointer_field when |start| (PUSI) is set.
+    // A continuity counter gap drops the section being assembled.
+    void Push(const uint8_t *payload, size_t size, bool start, uint8_t continuityCounter,
+              const SectionCallback &callback);
+
+private:
+    // Emits the complete sections at the start of [p, end) and starts assembling a partial last one.
+    void Consume(const uint8_t *p, const uint8_t *end, const SectionCallback &callback);
+
+private:
+    data_t buffer_;
+    size_t expected_ = 0; // full size of the section in |buffer_|, 0 while its header is incomplete
+    bool active_ = false;
+    int continuityCounter_ = -1;
+};
+
+enum SectionState : uint8_t {
+    SECTION_NEW = 0, // new or changed, and its CRC (if it has one) is good: to be parsed
+    SECTION_REPEAT,  // byte for byte the last good copy, so its CRC is good too
+    SECTION_CORRUPT, // failed its CRC check
+};
+
+// Keeps the last good copy of every section, so that a table repeated every 100 ms costs a memcmp instead of a CRC
+// and a parse. A repeat with any byte changed, corrupted ones included, gets the full CRC check.
+class SectionCache {
+public:
+    SectionState Update(uint16_t pid, const uint8_t *section, size_t size);
+    void Clear() { entries_.clear(); }
+
+private:
+    std::unordered_map<uint64_t, data_t> entries_; // by pid, table_id, table_id_extension, section_number
+};
+
+#endif // MPEG_TS_MEDIA_SRC_PSI_SECTION_H
@@ -0,0 +1,273 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#include "seek_index.h"
+#include "logger.h"
+#include "mpeg_ts_demuxer.h"
+#include "nal_scanner.h"
+#include <algorithm>
+#include <cstring>
+
+#define PTS_WRAP (1LL << 33)
+
+static size_t Align8(size_t size) {
+    return (size + 7) & ~(size_t)7;
+}
+
+static bool IsVideo(uint8_t codec) {
+    switch (codec) {
+        case STREAM_TYPE_VIDEO_MPEG1:
+        case STREAM_TYPE_VIDEO_MPEG2:
+        case STREAM_TYPE_VIDEO_MPEG4:
+        case STREAM_TYPE_VIDEO_H264:
+        case STREAM_TYPE_VIDEO_HEVC:
+        case STREAM_TYPE_VIDEO_CAVS:
+        case STREAM_TYPE_VIDEO_AVS2:
+        case STREAM_TYPE_VIDEO_AVS3:
+        case STREAM_TYPE_VIDEO_VC1:
+        case STREAM_TYPE_VIDEO_SVAC:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Looks at the start codes within the unit's first packet: an IDR or IRAP picture, or the parameter sets (and
+// MPEG-2 sequence header) that precede one.
+static bool StartsKeyframe(uint8_t codec, const uint8_t *data, size_t size) {
+    const uint8_t *end = data + size;
+    for (const uint8_t *p = FindStartCode(data, end); p + 3 < end; p = FindStartCode(p + 3, end)) {
+        uint8_t code = p[3];
+        switch (codec) {
+            case STREAM_TYPE_VIDEO_H264: {
+                uint8_t type = code & 0x1f;
+                if (type == 5 || type == 7) { // IDR slice, SPS
+                    return true;
+                }
+                if (type == 1) {
+                    return false;
+                }
+                break;
+            }
+            case STREAM_TYPE_VIDEO_HEVC: {
+                uint8_t type = (code >> 1) & 0x3f;
+                if ((type >= 16 && type <= 21) || type == 32 || type == 33) { // IRAP slices, VPS, SPS
+                    return true;
+                }
+                if (type < 16) {
+                    return false;
+                }
+                break;
+            }
+            case STREAM_TYPE_VIDEO_MPEG1:
+            case STREAM_TYPE_VIDEO_MPEG2:
+                if (code == 0xb3) { // sequence_header
+                    return true;
+                }
+                if (code == 0x00) { // picture_start_code
+                    return false;
+                }
+                break;
+            default:
+                return false;
+        }
+    }
+    return false;
+}
+
+std::shared_ptr<SeekIndex> SeekIndex::Open(const std::string &filename) {
+    auto file = FileReader::Open(filename);
+    if (!file) {
+        return nullptr;
+    }
+
+    const SeekIndexHeader *header = (const SeekIndexHeader *)file->data;
+    if (file->size < sizeof(SeekIndexHeader) || memcmp(header->magic, SEEK_INDEX_MAGIC, sizeof(header->magic)) ||
+        header->version != SEEK_INDEX_VERSION) {
+        TS_LOGE("Not a seek index, or one from another version");
+        return nullptr;
+    }
+
+    // Counts are checked against the file size before they are multiplied or added, so that a corrupt sidecar
+    // cannot wrap the arithmetic around and point outside the mapping.
+    size_t space = file->size - sizeof(SeekIndexHeader);
+    if (header->entryCount > space / sizeof(SeekIndexEntry) || header->keyCount > space / sizeof(uint32_t) ||
+        header->sectionOffset > file->size || header->sectionSize > file->size - header->sectionOffset) {
+        TS_LOGE("Seek index is truncated");
+        return nullptr;
+    }
+    size_t keysOffset = sizeof(SeekIndexHeader) + header->entryCount * sizeof(SeekIndexEntry);
+    if (keysOffset + header->keyCount * sizeof(uint32_t) > header->sectionOffset) {
+        TS_LOGE("Seek index is truncated");
+        return nullptr;
+    }
+
+    // Find() indexes the entries with the keys as they are.
+    const uint32_t *keys = (const uint32_t *)(file->data + keysOffset);
+    for (uint64_t i = 0; i < header->keyCount; i++) {
+        if (keys[i] >= header->entryCount) {
+            TS_LOGE("Seek index is corrupt");
+            return nullptr;
+        }
+    }
+
+    auto index = std::shared_ptr<SeekIndex>(new SeekIndex());
+    index->header_ = header;
+    index->entries_ = (const SeekIndexEntry *)(file->data + sizeof(SeekIndexHeader));
+    index->keys_ = keys;
+    index->file_ = std::move(file);
+    return index;
+}
+
+const SeekIndexEntry *SeekIndex::Find(int64_t time) const {
+    if (header_->keyCount == 0) {
+        return nullptr;
+    }
+
+    const uint32_t *end = keys_ + header_->keyCount;
+    const uint32_t *it = std::upper_bound(keys_, end, time,
+                                          [this](int64_t t, uint32_t key) { return t < entries_[key].time; });
+    return &entries_[it == keys_ ? *keys_ : *(it - 1)];
+}
+
+void SeekIndex::ForEachSection(
+    const std::function<void(uint16_t pid, const uint8_t *section, size_t size)> &callback) const {
+    const uint8_t *p = file_->data + header_->sectionOffset;
+    const uint8_t *end = p + header_->sectionSize;
+    while (p + 4 <= end) {
+        uint16_t pid;
+        uint16_t size;
+        memcpy(&pid, p, sizeof(pid));
+        memcpy(&size, p + 2, sizeof(size));
+        if (p + 4 + size > end) {
+            break;
+        }
+
+        callback(pid, p + 4, size);
+        p += Align8(4 + size);
+    }
+}
+
+SeekIndexBuilder::SeekIndexBuilder(MpegTsDemuxer &demuxer) : demuxer_(demuxer) {
+    demuxer.SetDemuxUnitCallback([this](const AccessUnit &unit) { OnUnit(unit); });
+    demuxer.SetDemuxPcrCallback([this](uint16_t pid, int64_t pcr, uint64_t) { pcrs_[pid] = pcr; });
+    demuxer.SetDemuxSectionCallback(
+        [this](uint16_t pid, const uint8_t *section, size_t size) { OnSection(pid, section, size); });
+}
+
+void SeekIndexBuilder::OnUnit(const AccessUnit &unit) {
+    Clock &clock = clocks_[unit.pid];
+    if (clock.first < 0) {
+        clock.first = unit.dts;
+    } else if (unit.dts - clock.last < -PTS_WRAP / 2) {
+        clock.wrap += PTS_WRAP;
+    }
+    clock.last = unit.dts;
+
+    SeekIndexEntry entry = {};
+    entry.offset = unit.offset;
+    entry.time = unit.dts + clock.wrap - clock.first;
+    entry.pts = unit.pts;
+    entry.dts = unit.dts;
+    entry.pcr = ProgramPcr(unit.pid);
+    entry.pid = unit.pid;
+    entry.codecId = unit.codecId;
+    if (!IsVideo(unit.codecId) || unit.randomAccess || StartsKeyframe(unit.codecId, unit.data, unit.size)) {
+        entry.flags |= SEEK_INDEX_KEYFRAME;
+    }
+    entries_.push_back(entry);
+}
+
+int64_t SeekIndexBuilder::ProgramPcr(uint16_t pid) {
+    auto it = pcrPid_.find(pid);
+    if (it == pcrPid_.end()) {
+        for (auto &program : demuxer_.GetPAT().programs) {
+            if (!program.pmt) {
+                continue;
+            }
+            for (auto &stream : program.pmt->streams) {
+                if (stream.elementary_PID == pid) {
+                    it = pcrPid_.emplace(pid, (uint16_t)program.pmt->PCR_PID).first;
+                }
+            }
+        }
+        if (it == pcrPid_.end()) {
+            return -1;
+        }
+    }
+
+    auto pcr = pcrs_.find(it->second);
+    return pcr == pcrs_.end() ? -1 : pcr->second;
+}
+
+void SeekIndexBuilder::OnSection(uint16_t pid, const uint8_t *section, size_t size) {
+    // Keep the latest version of each table; a PMT change may move the PCR PID.
+    pcrPid_.clear();
+    auto it = std::find_if(sections_.begin(), sections_.end(), [&](const Section &s) {
+        return s.pid == pid && s.data[0] == (char)section[0] && s.data.compare(3, 2, (const char *)section + 3, 2) == 0;
+    });
+    if (it == sections_.end()) {
+        sections_.push_back({pid, data_t()});
+        it = sections_.end() - 1;
+    }
+    it->data.assign((const char *)section, size);
+}
+
+bool SeekIndexBuilder::Write(const std::string &filename, uint64_t fileSize) const {
+    // Seek to video keyframes; audio-only streams are seekable at every unit.
+    bool haveVideo = std::any_of(entries_.begin(), entries_.end(),
+                                 [](const SeekIndexEntry &entry) { return IsVideo(entry.codecId); });
+    std::vector<uint32_t> keys;
+    for (size_t i = 0; i < entries_.size(); i++) {
+        if ((entries_[i].flags & SEEK_INDEX_KEYFRAME) && (!haveVideo || IsVideo(entries_[i].codecId))) {
+            keys.push_back((uint32_t)i);
+        }
+    }
+    std::stable_sort(keys.begin(), keys.end(),
+                     [this](uint32_t a, uint32_t b) { return entries_[a].time < entries_[b].time; });
+
+    data_t sections;
+    std::vector<const Section *> ordered;
+    for (auto &section : sections_) {
+        ordered.push_back(&section);
+    }
+    std::stable_sort(ordered.begin(), ordered.end(), [](const Section *a, const Section *b) {
+        return (a->pid == PID_PAT) > (b->pid == PID_PAT);
+    });
+    for (auto section : ordered) {
+        uint16_t size = section->data.size();
+        sections.append((const char *)&section->pid, sizeof(section->pid));
+        sections.append((const char *)&size, sizeof(size));
+        sections.append(section->data);
+        sections.resize(Align8(sections.size()));
+    }
+
+    SeekIndexHeader header = {};
+    memcpy(header.magic, SEEK_INDEX_MAGIC, sizeof(header.magic));
+    header.version = SEEK_INDEX_VERSION;
+    header.packetSize = demuxer_.GetPacketSize();
+    header.fileSize = fileSize;
+    header.entryCount = entries_.size();
+    header.keyCount = keys.size();
+    size_t keysSize = keys.size() * sizeof(uint32_t);
+    header.sectionOffset = sizeof(header) + entries_.size() * sizeof(SeekIndexEntry) + Align8(keysSize);
+    header.sectionSize = sections.size();
+
+    auto file = FileWriter::Open(filename);
+    if (!file) {
+        TS_LOGE("Cannot create the seek index");
+        return false;
+    }
+
+    uint8_t padding[8] = {};
+    file->Write((const uint8_t *)&header, sizeof(header));
+    file->Write((const uint8_t *)entries_.data(), entries_.size() * sizeof(SeekIndexEntry));
+    file->Write((const uint8_t *)keys.data(), keysSize);
+    file->Write(padding, Align8(keysSize) - keysSize);
+    file->Write(sections);
+    file->Close();
+
+    TS_LOGI("Seek index: %zu access units, %zu keyframes", entries_.size(), keys.size());
+    return true;
+}
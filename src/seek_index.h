@@ -0,0 +1,118 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#ifndef MPEG_TS_MEDIA_SRC_SEEK_INDEX_H
+#define MPEG_TS_MEDIA_SRC_SEEK_INDEX_H
+
+#include "file.h"
+#include "mpeg_ts.h"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Sidecar layout, host byte order, every part 8-byte aligned so the file can be used straight from its mapping:
+//
+//   SeekIndexHeader
+//   SeekIndexEntry entries[entryCount]  every access unit, in stream order
+//   uint32_t keys[keyCount]             indices of the keyframes to seek to, sorted by time
+//   sections                            {uint16_t pid, uint16_t size, section bytes}, 8-byte aligned, PAT first
+//
+#define SEEK_INDEX_MAGIC    "TSINDEX"
+#define SEEK_INDEX_VERSION  1
+#define SEEK_INDEX_KEYFRAME 0x01
+#define SEEK_INDEX_SUFFIX   ".idx"
+
+struct SeekIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t packetSize;
+    uint64_t fileSize; // of the indexed stream, to spot a stale sidecar
+    uint64_t entryCount;
+    uint64_t keyCount;
+    uint64_t sectionOffset;
+    uint64_t sectionSize;
+    uint64_t reserved;
+};
+
+struct SeekIndexEntry {
+    uint64_t offset; // of the packet holding the PES header
+    int64_t time;    // DTS in 90 kHz ticks since the first DTS of the PID, with 33-bit wraps undone
+    int64_t pts;
+    int64_t dts;
+    int64_t pcr; // last PCR of the program before the unit, 90 kHz base, -1 if none
+    uint16_t pid;
+    uint8_t codecId;
+    uint8_t flags; // SEEK_INDEX_KEYFRAME
+    uint32_t reserved;
+};
+
+// A sidecar opened for seeking. Lookups run on the mapping, nothing is loaded up front.
+class SeekIndex {
+public:
+    static std::shared_ptr<SeekIndex> Open(const std::string &filename);
+
+    // The last keyframe at or before |time|, the first keyframe if |time| comes before it, nullptr if none.
+    // O(log n) over the key table.
+    const SeekIndexEntry *Find(int64_t time) const;
+
+    size_t PacketSize() const { return header_->packetSize; }
+    uint64_t FileSize() const { return header_->fileSize; }
+    const SeekIndexEntry *Entries() const { return entries_; }
+    size_t EntryCount() const { return header_->entryCount; }
+
+    // The program tables in force at the end of the indexed stream, PAT first.
+    void ForEachSection(const std::function<void(uint16_t pid, const uint8_t *section, size_t size)> &callback) const;
+
+private:
+    SeekIndex() = default;
+
+private:
+    std::shared_ptr<FileReader> file_;
+    const SeekIndexHeader *header_ = nullptr;
+    const SeekIndexEntry *entries_ = nullptr;
+    const uint32_t *keys_ = nullptr;
+};
+
+class MpegTsDemuxer;
+struct AccessUnit;
+
+// Records every access unit |demuxer| comes across. Keyframes are taken from random_access_indicator, or from the
+// first NAL units (or MPEG-2 sequence header) of the unit when the muxer did not set it.
+class SeekIndexBuilder {
+public:
+    // Installs the unit, PCR and section callbacks of |demuxer|, which must outlive the builder.
+    explicit SeekIndexBuilder(MpegTsDemuxer &demuxer);
+
+    bool Write(const std::string &filename, uint64_t fileSize) const;
+    size_t Size() const { return entries_.size(); }
+
+private:
+    struct Clock {
+        int64_t first = -1;
+        int64_t last = 0;
+        int64_t wrap = 0;
+    };
+
+    struct Section {
+        uint16_t pid;
+        data_t data;
+    };
+
+    void OnUnit(const AccessUnit &unit);
+    void OnSection(uint16_t pid, const uint8_t *section, size_t size);
+    int64_t ProgramPcr(uint16_t pid);
+
+private:
+    MpegTsDemuxer &demuxer_;
+    std::vector<SeekIndexEntry> entries_;
+    std::unordered_map<uint16_t, Clock> clocks_;    // by elementary stream PID
+    std::unordered_map<uint16_t, int64_t> pcrs_;    // last PCR by PCR PID
+    std::unordered_map<uint16_t, uint16_t> pcrPid_; // elementary stream PID to its program's PCR PID
+    std::vector<Section> sections_;
+};
+
+#endif // MPEG_TS_MEDIA_SRC_SEEK_INDEX_H
@@ -0,0 +1,69 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#ifndef MPEG_TS_MEDIA_SRC_SPSC_RING_H
+#define MPEG_TS_MEDIA_SRC_SPSC_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+#define SPSC_CACHE_LINE 64
+
+// Bounded lock-free queue for exactly one producer thread and one consumer thread. Slots are filled and read
+// in place, so large entries are not copied through the queue.
+template <typename T>
+class SpscRing {
+public:
+    // |capacity| is rounded up to a power of two.
+    explicit SpscRing(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        slots_.reset(new T[size]);
+        mask_ = size - 1;
+    }
+
+    // Producer: the next free slot, or nullptr when full. It becomes visible to the consumer on Push().
+    T *Back() {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - cachedHead_ > mask_) {
+            cachedHead_ = head_.load(std::memory_order_acquire);
+            if (tail - cachedHead_ > mask_) {
+                return nullptr;
+            }
+        }
+        return &slots_[tail & mask_];
+    }
+    void Push() { tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    // Consumer: the oldest slot, or nullptr when empty. The producer may reuse it after Pop().
+    T *Front() {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == cachedTail_) {
+            cachedTail_ = tail_.load(std::memory_order_acquire);
+            if (head == cachedTail_) {
+                return nullptr;
+            }
+        }
+        return &slots_[head & mask_];
+    }
+    void Pop() { head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    // Either side: true once the consumer has popped everything pushed so far.
+    bool Empty() const { return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire); }
+
+private:
+    std::unique_ptr<T[]> slots_;
+    size_t mask_ = 0;
+
+    // Each side only writes its own cache line: its index and its cached copy of the other side's index.
+    alignas(SPSC_CACHE_LINE) std::atomic<size_t> head_{0}; // consumer
+    size_t cachedTail_ = 0;
+    alignas(SPSC_CACHE_LINE) std::atomic<size_t> tail_{0}; // producer
+    size_t cachedHead_ = 0;
+};
+
+#endif // MPEG_TS_MEDIA_SRC_SPSC_RING_H
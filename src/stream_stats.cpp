@@ -0,0 +1,412 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#include "stream_stats.h"
+#include "file.h"
+#include "logger.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+
+#define PCR_WRAP         ((1LL << 33) * 300) // 27 MHz ticks
+#define PCR_MAX_INTERVAL (27000000LL * 10)   // a longer gap is a discontinuity, not an interval
+
+struct StreamStats::Counters {
+    std::atomic<uint64_t> packets;
+    std::atomic<uint64_t> bytes;
+    std::atomic<uint64_t> ccErrors;
+    std::atomic<uint64_t> teiErrors;
+    std::atomic<uint64_t> scrambled;
+    std::atomic<uint64_t> pes;
+    std::atomic<uint64_t> buckets[STATS_HISTOGRAM_COUNT][STATS_MAX_BUCKETS];
+    std::atomic<uint64_t> sums[STATS_HISTOGRAM_COUNT];
+
+    // Writer side only.
+    uint8_t continuityCounter;
+    bool seen;
+    int64_t lastPcr;          // 27 MHz, -1 before the first
+    uint64_t lastPcrPacket;   // index among the packets of all PIDs
+    double pcrTicksPerPacket; // over the last PCR interval, 0 if unknown
+};
+
+// Single writer: a load and a store, which unlike fetch_add need no locked instruction.
+static inline void Bump(std::atomic<uint64_t> &counter, uint64_t n = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+const std::vector<uint64_t> &StatsBuckets(StatsHistogramType type) {
+    static const std::vector<uint64_t> buckets[STATS_HISTOGRAM_COUNT] = {
+        {256, 512, 1024, 2048, 4096, 8192, 16384, 32768, 65536, 131072, 262144, 524288, 1048576},
+        {10000, 20000, 30000, 40000, 60000, 80000, 100000, 200000, 500000},
+        {100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000},
+    };
+    return buckets[type];
+}
+
+static void Record(std::atomic<uint64_t> *buckets, std::atomic<uint64_t> &sum, StatsHistogramType type,
+                   uint64_t value) {
+    const std::vector<uint64_t> &bounds = StatsBuckets(type);
+    size_t i = 0;
+    while (i < bounds.size() && value > bounds[i]) {
+        i++;
+    }
+    Bump(buckets[i]);
+    Bump(sum, value);
+}
+
+static uint64_t SteadyNanoseconds() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+StreamStats::StreamStats(std::string input) : input_(std::move(input)), lastTime_(SteadyNanoseconds()) {}
+
+StreamStats::~StreamStats() {
+    for (auto &counters : counters_) {
+        delete counters.load(std::memory_order_relaxed);
+    }
+}
+
+void StreamStats::Packet(const uint8_t *packet, size_t size) {
+    uint16_t pid = ((packet[1] & 0x1f) << 8) | packet[2];
+    Counters *counters = counters_[pid].load(std::memory_order_relaxed);
+    if (!counters) {
+        counters = new Counters();
+        counters->lastPcr = -1;
+        counters_[pid].store(counters, std::memory_order_release);
+    }
+
+    uint64_t index = packets_.load(std::memory_order_relaxed);
+    packets_.store(index + 1, std::memory_order_relaxed);
+    Bump(counters->packets);
+    Bump(counters->bytes, size);
+    if (packet[1] & 0x80) {
+        Bump(counters->teiErrors);
+    }
+    if (packet[3] & 0xc0) {
+        Bump(counters->scrambled);
+    }
+
+    uint8_t control = (packet[3] >> 4) & 0x03;
+    uint8_t counter = packet[3] & 0x0f;
+    bool adaptation = (control & 0x02) && packet[4] > 0;
+    if (pid != PID_NULL) {
+        // The counter only moves with a payload, and a payload packet may be sent twice.
+        bool discontinuity = adaptation && (packet[5] & 0x80);
+        uint8_t last = counters->continuityCounter;
+        bool expected = control & 0x01 ? counter == ((last + 1) & 0x0f) || counter == last : counter == last;
+        if (counters->seen && !expected && !discontinuity) {
+            Bump(counters->ccErrors);
+        }
+        counters->seen = true;
+        counters->continuityCounter = counter;
+    }
+
+    if (adaptation && packet[4] >= 7 && (packet[5] & 0x10)) {
+        const uint8_t *p = packet + 6;
+        int64_t base = ((int64_t)p[0] << 25) | (p[1] << 17) | (p[2] << 9) | (p[3] << 1) | (p[4] >> 7);
+        int64_t pcr = base * 300 + (((p[4] & 0x01) << 8) | p[5]);
+        Pcr(counters, pcr, index);
+    }
+}
+
+void StreamStats::Pcr(Counters *counters, int64_t pcr, uint64_t index) {
+    if (counters->lastPcr >= 0) {
+        int64_t delta = (pcr - counters->lastPcr + PCR_WRAP) % PCR_WRAP;
+        uint64_t packets = index - counters->lastPcrPacket;
+        if (delta > 0 && delta < PCR_MAX_INTERVAL && packets > 0) {
+            Record(counters->buckets[STATS_PCR_INTERVAL], counters->sums[STATS_PCR_INTERVAL], STATS_PCR_INTERVAL,
+                   delta / 27);
+            if (counters->pcrTicksPerPacket > 0) {
+                // Where a constant bitrate since the previous PCR puts this one, in ns.
+                double error = delta - counters->pcrTicksPerPacket * packets;
+                Record(counters->buckets[STATS_PCR_JITTER], counters->sums[STATS_PCR_JITTER], STATS_PCR_JITTER,
+                       (uint64_t)((error < 0 ? -error : error) * 1000 / 27));
+            }
+            counters->pcrTicksPerPacket = (double)delta / packets;
+        } else {
+            counters->pcrTicksPerPacket = 0;
+        }
+    }
+    counters->lastPcr = pcr;
+    counters->lastPcrPacket = index;
+}
+
+void StreamStats::Frame(uint16_t pid, size_t size) {
+    Counters *counters = Get(pid);
+    if (!counters) {
+        return;
+    }
+    Bump(counters->pes);
+    Record(counters->buckets[STATS_FRAME_SIZE], counters->sums[STATS_FRAME_SIZE], STATS_FRAME_SIZE, size);
+}
+
+StatsSnapshot StreamStats::Snapshot() {
+    StatsSnapshot snapshot;
+    snapshot.input = input_;
+    snapshot.time = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::system_clock::now().time_since_epoch())
+                        .count();
+    snapshot.packets = packets_.load(std::memory_order_relaxed);
+
+    // The first snapshot covers the time since the stats were created, so a run shorter than an export interval
+    // still gets its bitrates.
+    uint64_t now = SteadyNanoseconds();
+    uint64_t elapsed = now - lastTime_;
+    lastTime_ = now;
+    if (lastBytes_.empty()) {
+        lastBytes_.resize(TS_PID_COUNT);
+    }
+
+    for (size_t pid = 0; pid < TS_PID_COUNT; pid++) {
+        Counters *counters = Get(pid);
+        if (!counters) {
+            continue;
+        }
+
+        PidStats stats = {};
+        stats.pid = pid;
+        stats.packets = counters->packets.load(std::memory_order_relaxed);
+        stats.bytes = counters->bytes.load(std::memory_order_relaxed);
+        stats.ccErrors = counters->ccErrors.load(std::memory_order_relaxed);
+        stats.teiErrors = counters->teiErrors.load(std::memory_order_relaxed);
+        stats.scrambled = counters->scrambled.load(std::memory_order_relaxed);
+        stats.pes = counters->pes.load(std::memory_order_relaxed);
+        if (elapsed > 0) {
+            stats.bitrate = (uint64_t)((stats.bytes - lastBytes_[pid]) * 8 * 1e9 / elapsed);
+        }
+        lastBytes_[pid] = stats.bytes;
+
+        for (int type = 0; type < STATS_HISTOGRAM_COUNT; type++) {
+            StatsHistogram &histogram = stats.histograms[type];
+            for (size_t i = 0; i <= StatsBuckets((StatsHistogramType)type).size(); i++) {
+                histogram.counts[i] = counters->buckets[type][i].load(std::memory_order_relaxed);
+                histogram.count += histogram.counts[i];
+            }
+            histogram.sum = counters->sums[type].load(std::memory_order_relaxed);
+        }
+        snapshot.pids.push_back(stats);
+    }
+    return snapshot;
+}
+
+static void AppendEscaped(std::string &out, const std::string &text) {
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c == '\n') {
+            out += "\\n";
+        } else if ((unsigned char)c >= 0x20) {
+            out += c;
+        }
+    }
+}
+
+static void Appendf(std::string &out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void Appendf(std::string &out, const char *fmt, ...) {
+    char buffer[256];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+    if (n > 0) {
+        out.append(buffer, std::min((size_t)n, sizeof(buffer) - 1));
+    }
+}
+
+static const char *histogramNames[STATS_HISTOGRAM_COUNT] = {"frame_size", "pcr_interval_us", "pcr_jitter_ns"};
+
+std::string StatsToJson(const std::vector<StatsSnapshot> &snapshots) {
+    std::string out = "{\n  \"buckets\": {";
+    for (int type = 0; type < STATS_HISTOGRAM_COUNT; type++) {
+        Appendf(out, "%s\"%s\": [", type ? ", " : "", histogramNames[type]);
+        const std::vector<uint64_t> &bounds = StatsBuckets((StatsHistogramType)type);
+        for (size_t i = 0; i < bounds.size(); i++) {
+            Appendf(out, "%s%lu", i ? ", " : "", bounds[i]);
+        }
+        out += "]";
+    }
+    out += "},\n  \"inputs\": [";
+
+    for (size_t n = 0; n < snapshots.size(); n++) {
+        const StatsSnapshot &snapshot = snapshots[n];
+        out += n ? ",\n    {\"input\": \"" : "\n    {\"input\": \"";
+        AppendEscaped(out, snapshot.input);
+        Appendf(out, "\", \"time\": %lu, \"packets\": %lu, \"pids\": [", snapshot.time, snapshot.packets);
+        for (size_t i = 0; i < snapshot.pids.size(); i++) {
+            const PidStats &pid = snapshot.pids[i];
+            Appendf(out,
+                    "%s\n      {\"pid\": %u, \"packets\": %lu, \"bytes\": %lu, \"cc_errors\": %lu, "
+                    "\"tei_errors\": %lu, \"scrambled\": %lu, \"pes\": %lu, \"bitrate\": %lu",
+                    i ? "," : "", pid.pid, pid.packets, pid.bytes, pid.ccErrors, pid.teiErrors, pid.scrambled,
+                    pid.pes, pid.bitrate);
+            for (int type = 0; type < STATS_HISTOGRAM_COUNT; type++) {
+                const StatsHistogram &histogram = pid.histograms[type];
+                Appendf(out, ", \"%s\": {\"count\": %lu, \"sum\": %lu, \"counts\": [", histogramNames[type],
+                        histogram.count, histogram.sum);
+                for (size_t j = 0; j <= StatsBuckets((StatsHistogramType)type).size(); j++) {
+                    Appendf(out, "%s%lu", j ? ", " : "", histogram.counts[j]);
+                }
+                out += "]}";
+            }
+            out += "}";
+        }
+        out += snapshot.pids.empty() ? "]}" : "\n    ]}";
+    }
+    out += snapshots.empty() ? "]\n}\n" : "\n  ]\n}\n";
+    return out;
+}
+
+static void AppendLabels(std::string &out, const StatsSnapshot &snapshot, uint16_t pid) {
+    out += "{input=\"";
+    AppendEscaped(out, snapshot.input);
+    Appendf(out, "\",pid=\"0x%04x\"", pid);
+}
+
+std::string StatsToPrometheus(const std::vector<StatsSnapshot> &snapshots) {
+    struct Counter {
+        const char *name;
+        const char *help;
+        const char *type;
+        uint64_t PidStats::*field;
+    };
+    static const Counter counters[] = {
+        {"ts_packets_total", "Transport stream packets.", "counter", &PidStats::packets},
+        {"ts_bytes_total", "Bytes of those packets, M2TS and Reed-Solomon bytes included.", "counter",
+         &PidStats::bytes},
+        {"ts_cc_errors_total", "Continuity counter errors.", "counter", &PidStats::ccErrors},
+        {"ts_tei_errors_total", "Packets with transport_error_indicator set.", "counter", &PidStats::teiErrors},
+        {"ts_scrambled_packets_total", "Packets with transport_scrambling_control set.", "counter",
+         &PidStats::scrambled},
+        {"ts_pes_total", "PES packets delivered as frames.", "counter", &PidStats::pes},
+        {"ts_bitrate_bits_per_second", "Bitrate since the previous export, or since the input was opened.", "gauge",
+         &PidStats::bitrate},
+    };
+
+    std::string out;
+    for (auto &counter : counters) {
+        Appendf(out, "# HELP %s %s\n# TYPE %s %s\n", counter.name, counter.help, counter.name, counter.type);
+        for (auto &snapshot : snapshots) {
+            for (auto &pid : snapshot.pids) {
+                out += counter.name;
+                AppendLabels(out, snapshot, pid.pid);
+                Appendf(out, "} %lu\n", pid.*counter.field);
+            }
+        }
+    }
+
+    // Bucket bounds and sums are exported in base units, bytes and seconds.
+    static const char *names[STATS_HISTOGRAM_COUNT] = {"ts_frame_size_bytes", "ts_pcr_interval_seconds",
+                                                       "ts_pcr_jitter_seconds"};
+    static const char *helps[STATS_HISTOGRAM_COUNT] = {"Frame sizes.", "Time between PCRs.",
+                                                       "PCR offset from a constant bitrate since the previous PCR."};
+    static const double scales[STATS_HISTOGRAM_COUNT] = {1, 1e-6, 1e-9};
+    for (int type = 0; type < STATS_HISTOGRAM_COUNT; type++) {
+        const std::vector<uint64_t> &bounds = StatsBuckets((StatsHistogramType)type);
+        Appendf(out, "# HELP %s %s\n# TYPE %s histogram\n", names[type], helps[type], names[type]);
+        for (auto &snapshot : snapshots) {
+            for (auto &pid : snapshot.pids) {
+                const StatsHistogram &histogram = pid.histograms[type];
+                if (histogram.count == 0) {
+                    continue;
+                }
+
+                uint64_t cumulative = 0;
+                for (size_t i = 0; i <= bounds.size(); i++) {
+                    cumulative += histogram.counts[i];
+                    Appendf(out, "%s_bucket", names[type]);
+                    AppendLabels(out, snapshot, pid.pid);
+                    if (i < bounds.size()) {
+                        Appendf(out, ",le=\"%g\"} %lu\n", bounds[i] * scales[type], cumulative);
+                    } else {
+                        Appendf(out, ",le=\"+Inf\"} %lu\n", cumulative);
+                    }
+                }
+                Appendf(out, "%s_sum", names[type]);
+                AppendLabels(out, snapshot, pid.pid);
+                Appendf(out, "} %g\n", histogram.sum * scales[type]);
+                Appendf(out, "%s_count", names[type]);
+                AppendLabels(out, snapshot, pid.pid);
+                Appendf(out, "} %lu\n", histogram.count);
+            }
+        }
+    }
+    return out;
+}
+
+StatsExporter::StatsExporter(std::string path, int interval) : path_(std::move(path)), interval_(interval) {
+    json_ = path_.size() >= 5 && path_.compare(path_.size() - 5, 5, ".json") == 0;
+    thread_ = std::thread(&StatsExporter::Run, this);
+}
+
+StatsExporter::~StatsExporter() { Stop(); }
+
+void StatsExporter::Add(std::shared_ptr<StreamStats> stats) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.push_back(std::move(stats));
+}
+
+void StatsExporter::Remove(const std::shared_ptr<StreamStats> &stats) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = stats_.begin(); it != stats_.end(); ++it) {
+        if (*it == stats) {
+            stats_.erase(it);
+            break;
+        }
+    }
+}
+
+void StatsExporter::Stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stop_) {
+            return;
+        }
+        stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+}
+
+void StatsExporter::Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        bool stop = cv_.wait_for(lock, std::chrono::milliseconds(interval_), [this] { return stop_; });
+        lock.unlock();
+        Export();
+        lock.lock();
+        if (stop) {
+            break;
+        }
+    }
+}
+
+bool StatsExporter::Export() {
+    std::vector<std::shared_ptr<StreamStats>> stats;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats = stats_;
+    }
+
+    std::vector<StatsSnapshot> snapshots;
+    for (auto &input : stats) {
+        snapshots.push_back(input->Snapshot());
+    }
+    std::string text = json_ ? StatsToJson(snapshots) : StatsToPrometheus(snapshots);
+
+    std::string temporary = path_ + ".tmp";
+    auto file = FileWriter::Open(temporary);
+    bool written = file && file->Write(text);
+    if (file) {
+        file->Close();
+    }
+    if (!written || rename(temporary.c_str(), path_.c_str()) != 0) {
+        TS_LOGW("Cannot write the statistics file");
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,129 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#ifndef MPEG_TS_MEDIA_SRC_STREAM_STATS_H
+#define MPEG_TS_MEDIA_SRC_STREAM_STATS_H
+
+#include "mpeg_ts.h"
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define STATS_MAX_BUCKETS     16   // per histogram, the last one unbounded
+#define STATS_EXPORT_INTERVAL 1000 // ms between metrics files
+
+enum StatsHistogramType : uint8_t {
+    STATS_FRAME_SIZE = 0, // bytes
+    STATS_PCR_INTERVAL,   // microseconds between PCRs of the PID
+    STATS_PCR_JITTER,     // nanoseconds between a PCR and where the previous PCR rate puts it
+    STATS_HISTOGRAM_COUNT,
+};
+
+struct StatsHistogram {
+    uint64_t counts[STATS_MAX_BUCKETS] = {}; // per bucket, not cumulative
+    uint64_t count = 0;
+    uint64_t sum = 0;
+};
+
+struct PidStats {
+    uint16_t pid;
+    uint64_t packets;
+    uint64_t bytes;     // of those packets, at their size on the wire: 188, 192 or 204
+    uint64_t ccErrors;  // continuity_counter gaps, discontinuity_indicator and duplicates excepted
+    uint64_t teiErrors; // transport_error_indicator set
+    uint64_t scrambled; // transport_scrambling_control set
+    uint64_t pes;       // frames delivered
+    uint64_t bitrate;   // bit/s since the previous snapshot, or since the StreamStats was created
+    StatsHistogram histograms[STATS_HISTOGRAM_COUNT];
+};
+
+struct StatsSnapshot {
+    std::string input;
+    uint64_t time;              // ms, system clock
+    uint64_t packets;           // all PIDs
+    std::vector<PidStats> pids; // those seen so far, by PID
+};
+
+// Upper bounds of the buckets of |type|, inclusive; the last bucket is unbounded.
+const std::vector<uint64_t> &StatsBuckets(StatsHistogramType type);
+
+// Per-PID counters of one input, cheap enough to keep on while demuxing.
+//
+// Every counter has a single writer: the thread that calls MpegTsDemuxer::Input() for the packet counters, and in
+// pipelined mode the worker that owns the PID for the frame counters. Writers update them with plain relaxed loads
+// and stores, no locked instructions, and any other thread can take a snapshot at any time without locking. A
+// snapshot is consistent per counter, not across counters.
+class StreamStats {
+public:
+    explicit StreamStats(std::string input = std::string());
+    ~StreamStats();
+
+    // Writer side, called by the demuxer for every packet and every frame delivered. |size| is the packet size of the
+    // input, M2TS and Reed-Solomon bytes included.
+    void Packet(const uint8_t *packet, size_t size);
+    void Frame(uint16_t pid, size_t size);
+
+    // Reader side. Bitrates are worked out from the previous snapshot, so take them from one thread only.
+    StatsSnapshot Snapshot();
+
+    const std::string &Input() const { return input_; }
+
+private:
+    struct Counters;
+
+    Counters *Get(uint16_t pid) const { return counters_[pid].load(std::memory_order_acquire); }
+    void Pcr(Counters *counters, int64_t pcr, uint64_t index);
+
+private:
+    std::string input_;
+    std::array<std::atomic<Counters *>, TS_PID_COUNT> counters_{};
+    std::atomic<uint64_t> packets_{0};
+
+    // Reader side.
+    std::vector<uint64_t> lastBytes_;
+    uint64_t lastTime_; // steady clock, ns
+};
+
+std::string StatsToJson(const std::vector<StatsSnapshot> &snapshots);
+
+// Text exposition format, one series per input and PID, as read by the Prometheus node exporter's textfile
+// collector.
+std::string StatsToPrometheus(const std::vector<StatsSnapshot> &snapshots);
+
+// Thread that snapshots the stats of any number of inputs every |interval| ms and replaces |path| with them: JSON if
+// the name ends in .json, Prometheus text otherwise. The file is written next to |path| and renamed over it, so
+// readers never see a partial one.
+class StatsExporter {
+public:
+    explicit StatsExporter(std::string path, int interval = STATS_EXPORT_INTERVAL);
+    ~StatsExporter();
+
+    void Add(std::shared_ptr<StreamStats> stats);
+    void Remove(const std::shared_ptr<StreamStats> &stats);
+
+    // Writes the file once more and stops the thread.
+    void Stop();
+
+private:
+    void Run();
+    bool Export();
+
+private:
+    std::string path_;
+    bool json_;
+    int interval_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::vector<std::shared_ptr<StreamStats>> stats_;
+    bool stop_ = false;
+    std::thread thread_;
+};
+
+#endif // MPEG_TS_MEDIA_SRC_STREAM_STATS_H
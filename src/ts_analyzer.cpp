@@ -0,0 +1,277 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#include "ts_analyzer.h"
+#include "crc32.h"
+#include <algorithm>
+
+#define PCR_WRAP ((1LL << 33) * 300)
+
+const char *TrCheckName(TrCheck check) {
+    static const char *names[TR_CHECK_COUNT] = {
+        "1.1 TS_sync_loss",
+        "1.2 Sync_byte_error",
+        "1.3 PAT_error",
+        "1.4 Continuity_count_error",
+        "1.5 PMT_error",
+        "2.1 Transport_error",
+        "2.2 CRC_error",
+        "2.3a PCR_repetition_error",
+        "2.3b PCR_discontinuity_indicator_error",
+        "2.4 PCR_accuracy_error",
+        "2.5 PTS_error",
+    };
+    return check < TR_CHECK_COUNT ? names[check] : "unknown";
+}
+
+// Difference of two PCRs, taking the shorter way around the wrap.
+static int64_t PcrDelta(int64_t pcr, int64_t last) {
+    int64_t delta = (pcr - last + PCR_WRAP) % PCR_WRAP;
+    return delta > PCR_WRAP / 2 ? delta - PCR_WRAP : delta;
+}
+
+void TsAnalyzer::Packet(const uint8_t *packet, uint64_t offset) {
+    offset_ = offset;
+    packets_++;
+
+    uint16_t pid = ((packet[1] & 0x1f) << 8) | packet[2];
+    if (packet[1] & 0x80) {
+        // The rest of the header cannot be trusted either.
+        Report(TR_TRANSPORT, pid, 0);
+        return;
+    }
+
+    PidState &state = pids_[pid];
+    bool scrambled = packet[3] & 0xc0;
+    if (scrambled && pid == PID_PAT) {
+        Report(TR_PAT, pid, -1);
+    } else if (scrambled && state.pmt) {
+        Report(TR_PMT, pid, -1);
+    }
+
+    if (pid != PID_NULL) {
+        Continuity(state, pid, packet);
+    }
+
+    uint8_t control = (packet[3] >> 4) & 0x03;
+    size_t i = 4;
+    if (control & 0x02) {
+        if (packet[4] >= 7 && packet[4] <= TS_PACKET_SIZE - 5 && (packet[5] & 0x10)) {
+            Pcr(state, pid, packet);
+        }
+        i += 1 + packet[4];
+    }
+
+    if ((control & 0x01) && (packet[1] & 0x40) && i < TS_PACKET_SIZE && !scrambled && pid != PID_PAT && !state.pmt) {
+        Pts(state, pid, packet + i, TS_PACKET_SIZE - i);
+    }
+}
+
+void TsAnalyzer::SyncLoss(size_t skipped, uint64_t offset) {
+    offset_ = offset;
+    Report(TR_SYNC_LOSS, TS_PID_COUNT, skipped);
+    Report(TR_SYNC_BYTE, TS_PID_COUNT, 0);
+}
+
+void TsAnalyzer::Section(uint16_t pid, const uint8_t *section, size_t size, bool crcChecked) {
+    uint8_t tableId = section[0];
+    if (!crcChecked && (section[1] & 0x80) && Crc32Mpeg2(section, size) != 0) {
+        Report(TR_CRC, pid, tableId);
+        return;
+    }
+
+    int64_t now = Now();
+    if (pid == PID_PAT) {
+        if (tableId != TID_PAS) {
+            Report(TR_PAT, pid, tableId);
+            return;
+        }
+        int64_t since = now - std::max<int64_t>(lastPat_, 0);
+        if (now >= 0 && !patLate_ && since > TR_PSI_PERIOD) {
+            Report(TR_PAT, pid, since);
+        }
+        lastPat_ = now;
+        patLate_ = false;
+    } else if (pids_[pid].pmt && tableId == TID_PMS) {
+        PidState &state = pids_[pid];
+        int64_t since = now - std::max<int64_t>(state.lastSeen, 0);
+        if (now >= 0 && !state.late && since > TR_PSI_PERIOD) {
+            Report(TR_PMT, pid, since);
+        }
+        state.lastSeen = now;
+        state.late = false;
+    }
+}
+
+void TsAnalyzer::Programs(const TS_PAT &pat) {
+    std::vector<uint16_t> pmtPids;
+    for (auto &program : pat.programs) {
+        // Program 0 points at the NIT.
+        if (program.program_number != 0) {
+            pmtPids.push_back(program.program_map_PID);
+        }
+    }
+
+    for (uint16_t pid : pmtPids_) {
+        pids_[pid].pmt = false;
+    }
+    for (uint16_t pid : pmtPids) {
+        PidState &state = pids_[pid];
+        if (std::find(pmtPids_.begin(), pmtPids_.end(), pid) == pmtPids_.end()) {
+            // The 0.5 s start when the program is announced.
+            state.lastSeen = Now();
+            state.late = false;
+        }
+        state.pmt = true;
+    }
+    pmtPids_.swap(pmtPids);
+}
+
+void TsAnalyzer::Report(TrCheck check, uint16_t pid, int64_t value) {
+    counts_[check]++;
+    if (callback_) {
+        TrEvent event = {check, pid, offset_, Now(), value};
+        callback_(event);
+    }
+}
+
+void TsAnalyzer::Continuity(PidState &state, uint16_t pid, const uint8_t *packet) {
+    uint8_t control = (packet[3] >> 4) & 0x03;
+    uint8_t counter = packet[3] & 0x0f;
+    bool discontinuity = (control & 0x02) && packet[4] > 0 && (packet[5] & 0x80);
+
+    if (state.seen && !discontinuity) {
+        // The counter only moves with a payload, and a payload packet may be sent twice, not three times.
+        uint8_t last = state.continuityCounter;
+        bool expected;
+        if (!(control & 0x01)) {
+            expected = counter == last;
+        } else if (counter == last) {
+            expected = !state.repeated;
+            state.repeated = true;
+        } else {
+            expected = counter == ((last + 1) & 0x0f);
+            state.repeated = false;
+        }
+        if (!expected) {
+            Report(TR_CC, pid, counter);
+        }
+    } else {
+        state.repeated = false;
+    }
+    state.seen = true;
+    state.continuityCounter = counter;
+}
+
+void TsAnalyzer::Pcr(PidState &state, uint16_t pid, const uint8_t *packet) {
+    const uint8_t *p = packet + 6;
+    int64_t base = ((int64_t)p[0] << 25) | (p[1] << 17) | (p[2] << 9) | (p[3] << 1) | (p[4] >> 7);
+    int64_t pcr = base * 300 + (((p[4] & 0x01) << 8) | p[5]);
+    bool discontinuity = packet[5] & 0x80;
+    uint64_t index = packets_ - 1;
+
+    if (clockPid_ == TS_PID_COUNT) {
+        clockPid_ = pid;
+        clockPacket_ = index;
+    } else if (pid == clockPid_) {
+        // Across a discontinuity the clock goes on at the last bitrate.
+        int64_t delta = PcrDelta(pcr, state.lastPcr);
+        uint64_t packets = index - state.lastPcrPacket;
+        if (!discontinuity && delta > 0 && delta <= TR_PCR_JUMP && packets > 0) {
+            clock_ += delta;
+            clockTicksPerPacket_ = (double)delta / packets;
+        } else {
+            clock_ = Now();
+        }
+        clockPacket_ = index;
+    }
+
+    int64_t now = Now();
+    if (state.lastPcr >= 0 && !discontinuity) {
+        int64_t delta = PcrDelta(pcr, state.lastPcr);
+        uint64_t packets = index - state.lastPcrPacket;
+        if (now - state.lastPcrTime > TR_PCR_PERIOD) {
+            Report(TR_PCR_REPETITION, pid, now - state.lastPcrTime);
+        }
+
+        if (delta <= 0 || delta > TR_PCR_JUMP) {
+            Report(TR_PCR_DISCONTINUITY, pid, delta);
+            state.pcrTicksPerPacket = 0;
+        } else {
+            if (state.pcrTicksPerPacket > 0) {
+                double error = delta - state.pcrTicksPerPacket * packets;
+                if (error > TR_PCR_TOLERANCE || error < -TR_PCR_TOLERANCE) {
+                    Report(TR_PCR_ACCURACY, pid, (int64_t)(error * 1000 / 27));
+                }
+            }
+            state.pcrTicksPerPacket = (double)delta / packets;
+        }
+    } else {
+        state.pcrTicksPerPacket = 0;
+    }
+    state.lastPcr = pcr;
+    state.lastPcrPacket = index;
+    state.lastPcrTime = now;
+
+    if (pid == clockPid_) {
+        CheckTimeouts();
+    }
+}
+
+void TsAnalyzer::Pts(PidState &state, uint16_t pid, const uint8_t *payload, size_t size) {
+    if (size < 9 || payload[0] != 0x00 || payload[1] != 0x00 || payload[2] != 0x01) {
+        return;
+    }
+
+    // Audio and video streams; others, like subtitles, may go longer without a PTS.
+    uint8_t streamId = payload[3];
+    if ((streamId & 0xe0) != 0xc0 && (streamId & 0xf0) != 0xe0) {
+        return;
+    }
+    int64_t now = Now();
+    if (!(payload[7] & 0x80) || now < 0) {
+        return;
+    }
+
+    if (state.lastSeen < 0) {
+        ptsPids_.push_back(pid);
+    } else if (!state.late && now - state.lastSeen > TR_PTS_PERIOD) {
+        Report(TR_PTS, pid, now - state.lastSeen);
+    }
+    state.lastSeen = now;
+    state.late = false;
+}
+
+void TsAnalyzer::CheckTimeouts() {
+    int64_t now = Now();
+    int64_t since = now - std::max<int64_t>(lastPat_, 0);
+    if (!patLate_ && since > TR_PSI_PERIOD) {
+        patLate_ = true;
+        Report(TR_PAT, PID_PAT, since);
+    }
+
+    for (uint16_t pid : pmtPids_) {
+        PidState &state = pids_[pid];
+        since = now - std::max<int64_t>(state.lastSeen, 0);
+        if (!state.late && since > TR_PSI_PERIOD) {
+            state.late = true;
+            Report(TR_PMT, pid, since);
+        }
+    }
+
+    for (uint16_t pid : ptsPids_) {
+        PidState &state = pids_[pid];
+        if (!state.late && now - state.lastSeen > TR_PTS_PERIOD) {
+            state.late = true;
+            Report(TR_PTS, pid, now - state.lastSeen);
+        }
+    }
+}
+
+int64_t TsAnalyzer::Now() const {
+    if (clockPid_ == TS_PID_COUNT) {
+        return -1;
+    }
+    return clock_ + (int64_t)((packets_ - 1 - clockPacket_) * clockTicksPerPacket_);
+}
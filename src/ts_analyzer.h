@@ -0,0 +1,120 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#ifndef MPEG_TS_MEDIA_SRC_TS_ANALYZER_H
+#define MPEG_TS_MEDIA_SRC_TS_ANALYZER_H
+
+#include "mpeg_ts.h"
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Limits of ETSI TR 101 290, in 27 MHz ticks.
+#define TR_PSI_PERIOD        (27000000LL / 2)         // 0.5 s between PAT and PMT sections
+#define TR_PCR_PERIOD        (27000000LL * 40 / 1000) // 40 ms
+#define TR_PCR_JUMP          (27000000LL / 10)        // 100 ms between PCRs without discontinuity_indicator
+#define TR_PCR_TOLERANCE     (27LL * 500 / 1000)      // 500 ns
+#define TR_PTS_PERIOD        (27000000LL * 7 / 10)    // 700 ms
+
+// The priority 1 and 2 checks, numbered as in the report.
+enum TrCheck : uint8_t {
+    TR_SYNC_LOSS = 0,     // 1.1: the demuxer lost packet sync; value is the bytes skipped
+    TR_SYNC_BYTE,         // 1.2: a packet without its sync byte, reported with each sync loss
+    TR_PAT,               // 1.3: no PAT for 0.5 s (value: ticks since the last), another table_id on PID 0
+                          //      (value: the table_id) or PID 0 scrambled (value: -1)
+    TR_CC,                // 1.4: continuity_counter out of order or repeated twice; value is the counter
+    TR_PMT,               // 1.5: no PMT for 0.5 s on a PMT PID (value: ticks since the last) or it is scrambled (-1)
+    TR_TRANSPORT,         // 2.1: transport_error_indicator set
+    TR_CRC,               // 2.2: a PAT, PMT or SDT section with a bad CRC_32; value is the table_id
+    TR_PCR_REPETITION,    // 2.3a: more than 40 ms between PCRs of a PID; value is the interval in ticks
+    TR_PCR_DISCONTINUITY, // 2.3b: a PCR jump over 100 ms, or back, without discontinuity_indicator; value in ticks
+    TR_PCR_ACCURACY,      // 2.4: a PCR over 500 ns off the bitrate since the previous one; value in ns
+    TR_PTS,               // 2.5: more than 700 ms between PTSs of an audio or video PID; value in ticks
+    TR_CHECK_COUNT,
+};
+
+struct TrEvent {
+    TrCheck check;
+    uint16_t pid;    // TS_PID_COUNT when not tied to a PID
+    uint64_t offset; // stream offset of the packet that showed the error
+    int64_t time;    // 27 MHz stream time from the first PCR, interpolated between PCRs; -1 before the first PCR
+    int64_t value;   // see TrCheck
+};
+
+// Number and name of |check| as in TR 101 290, e.g. "1.4 Continuity_count_error".
+const char *TrCheckName(TrCheck check);
+
+// ETSI TR 101 290 priority 1 and 2 checks run on the packets the demuxer sees (see MpegTsDemuxer::SetAnalyzer()).
+//
+// Everything is worked out incrementally, packet by packet, without buffering. Time is stream time: the first PID
+// that carries a PCR is the clock, and packets between two of its PCRs are placed by their index at the bitrate of
+// the previous interval. Missing tables and PTSs are found when the clock moves on, so they are reported at the
+// PCR after the limit. PCR accuracy assumes a constant bitrate, as the report does. CRCs are checked on the PSI
+// the demuxer follows: PAT, PMTs and SDT.
+class TsAnalyzer {
+public:
+    using EventCallback = std::function<void(const TrEvent &event)>;
+
+    TsAnalyzer() : pids_(TS_PID_COUNT) {}
+
+    // Called on the thread that calls MpegTsDemuxer::Input(), as errors are found.
+    void SetEventCallback(EventCallback callback) { callback_ = std::move(callback); }
+
+    // Errors of each check so far.
+    uint64_t Count(TrCheck check) const { return counts_[check]; }
+    uint64_t Packets() const { return packets_; }
+    // Stream time covered so far, in 27 MHz ticks.
+    int64_t Duration() const { return clockPid_ < TS_PID_COUNT ? Now() : 0; }
+
+    // Called by the demuxer.
+    void Packet(const uint8_t *packet, uint64_t offset);
+    void SyncLoss(size_t skipped, uint64_t offset);
+    // |crcChecked| when the demuxer's SectionCache has found the CRC good, or the section a repeat of one that was.
+    void Section(uint16_t pid, const uint8_t *section, size_t size, bool crcChecked);
+    // The PMT PIDs to watch, whenever the PAT changes.
+    void Programs(const TS_PAT &pat);
+
+private:
+    struct PidState {
+        uint8_t continuityCounter;
+        bool seen;
+        bool repeated; // the last payload packet was a duplicate
+        bool pmt;      // listed in the PAT
+        int64_t lastPcr = -1;
+        uint64_t lastPcrPacket;
+        int64_t lastPcrTime;
+        double pcrTicksPerPacket; // over the last interval, 0 if unknown
+        int64_t lastSeen = -1;    // time of the last PMT section, or of the last PTS of a stream
+        bool late;                // already reported for the current gap
+    };
+
+    void Report(TrCheck check, uint16_t pid, int64_t value);
+    void Continuity(PidState &state, uint16_t pid, const uint8_t *packet);
+    void Pcr(PidState &state, uint16_t pid, const uint8_t *packet);
+    void Pts(PidState &state, uint16_t pid, const uint8_t *payload, size_t size);
+    // Reports tables and PTSs that are overdue.
+    void CheckTimeouts();
+    int64_t Now() const;
+
+private:
+    EventCallback callback_;
+    std::vector<PidState> pids_;
+    std::vector<uint16_t> pmtPids_;
+    std::vector<uint16_t> ptsPids_;
+    uint64_t counts_[TR_CHECK_COUNT] = {};
+
+    uint64_t packets_ = 0;
+    uint64_t offset_ = 0;
+
+    // The clock: the last PCR of |clockPid_|, unwrapped, and the packet it came in.
+    uint16_t clockPid_ = TS_PID_COUNT;
+    int64_t clock_ = 0;
+    uint64_t clockPacket_ = 0;
+    double clockTicksPerPacket_ = 0;
+
+    int64_t lastPat_ = -1;
+    bool patLate_ = false;
+};
+
+#endif // MPEG_TS_MEDIA_SRC_TS_ANALYZER_H
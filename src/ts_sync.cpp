@@ -0,0 +1,114 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#include "ts_sync.h"
+#include "mpeg_ts.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TS_SYNC_X86 1
+#endif
+
+static const uint8_t *FindSyncScalar(const uint8_t *p, const uint8_t *end) {
+    const void *found = memchr(p, TS_SYNC_BYTE, end - p);
+    return found ? (const uint8_t *)found : end;
+}
+
+#ifdef TS_SYNC_X86
+__attribute__((target("sse2"))) static const uint8_t *FindSyncSSE2(const uint8_t *p, const uint8_t *end) {
+    const __m128i sync = _mm_set1_epi8(TS_SYNC_BYTE);
+    while (p + 16 <= end) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, sync));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+    return FindSyncScalar(p, end);
+}
+
+__attribute__((target("avx2"))) static const uint8_t *FindSyncAVX2(const uint8_t *p, const uint8_t *end) {
+    const __m256i sync = _mm256_set1_epi8(TS_SYNC_BYTE);
+    while (p + 32 <= end) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, sync));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    return FindSyncSSE2(p, end);
+}
+#endif
+
+using FindSyncFunc = const uint8_t *(*)(const uint8_t *p, const uint8_t *end);
+
+static FindSyncFunc SelectFindSync() {
+#ifdef TS_SYNC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return FindSyncAVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return FindSyncSSE2;
+    }
+#endif
+    return FindSyncScalar;
+}
+
+static const FindSyncFunc findSync = SelectFindSync();
+
+const uint8_t *TsFindSyncByte(const uint8_t *p, const uint8_t *end) {
+    return p < end ? findSync(p, end) : end;
+}
+
+// Number of sync bytes found at |packetSize| stride after |p|, up to |confirm|. Packets that run past the
+// end of the buffer are not counted against the candidate.
+static int CountSync(const uint8_t *p, const uint8_t *end, size_t packetSize, int confirm) {
+    int n = 0;
+    for (const uint8_t *q = p + packetSize; n < confirm && q < end; q += packetSize, n++) {
+        if (*q != TS_SYNC_BYTE) {
+            return -1;
+        }
+    }
+    return n;
+}
+
+const uint8_t *TsResync(const uint8_t *p, const uint8_t *end, size_t packetSize, int confirm) {
+    // A candidate without a whole packet after it has nothing to check, and is returned for the caller to complete.
+    for (p = TsFindSyncByte(p, end); p < end; p = TsFindSyncByte(p + 1, end)) {
+        if (CountSync(p, end, packetSize, confirm) >= 0) {
+            return p;
+        }
+    }
+    return end;
+}
+
+size_t TsDetectPacketSize(const uint8_t *data, size_t size, const uint8_t **sync, int confirm) {
+    static const size_t sizes[] = {TS_PACKET_SIZE, M2TS_PACKET_SIZE, TS_RS_PACKET_SIZE};
+
+    const uint8_t *end = data + size;
+    for (const uint8_t *p = TsFindSyncByte(data, end); p + TS_PACKET_SIZE <= end; p = TsFindSyncByte(p + 1, end)) {
+        // Take the size that lines up with the most packets; short buffers may only prove a few.
+        size_t best = 0;
+        int bestCount = 0;
+        for (size_t packetSize : sizes) {
+            int n = CountSync(p, end, packetSize, confirm);
+            if (n > bestCount) {
+                best = packetSize;
+                bestCount = n;
+            }
+        }
+
+        if (best) {
+            *sync = p;
+            return best;
+        }
+    }
+
+    *sync = end;
+    return 0;
+}
@@ -0,0 +1,28 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#ifndef MPEG_TS_MEDIA_SRC_TS_SYNC_H
+#define MPEG_TS_MEDIA_SRC_TS_SYNC_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Sync bytes that must line up at the packet stride before a candidate position is trusted.
+#define TS_SYNC_CONFIRM_COUNT 5
+
+// Returns the first TS_SYNC_BYTE in [p, end), or end. Uses AVX2 or SSE2 when the CPU has them.
+const uint8_t *TsFindSyncByte(const uint8_t *p, const uint8_t *end);
+
+// Finds the first sync byte in [p, end) that is followed by |confirm| more sync bytes every |packetSize| bytes.
+// Near the end of the buffer only the packets that fit are checked, so a sync byte less than a packet from the end
+// is taken as it is; a demuxer carries it over and confirms it with the next data. Returns end if there is none.
+const uint8_t *TsResync(const uint8_t *p, const uint8_t *end, size_t packetSize, int confirm = TS_SYNC_CONFIRM_COUNT);
+
+// Works out whether |data| holds 188-byte TS, 192-byte M2TS (4-byte timecode before each packet) or 204-byte
+// TS with Reed-Solomon parity. Returns the packet size and stores the first confirmed sync byte in |sync|;
+// returns 0 if no size lines up. Whatever the size, the 188 TS bytes of a packet start at its sync byte.
+size_t TsDetectPacketSize(const uint8_t *data, size_t size, const uint8_t **sync,
+                          int confirm = TS_SYNC_CONFIRM_COUNT);
+
+#endif // MPEG_TS_MEDIA_SRC_TS_SYNC_H
@@ -0,0 +1,99 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#include "work_stealing_pool.h"
+#include <algorithm>
+
+WorkStealingPool::WorkStealingPool(int threads) {
+    if (threads <= 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    for (int i = 0; i < threads; i++) {
+        queues_.push_back(std::make_unique<Queue>());
+    }
+    for (int i = 0; i < threads; i++) {
+        threads_.emplace_back(&WorkStealingPool::Run, this, i);
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    Wait();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    work_.notify_all();
+    for (auto &thread : threads_) {
+        thread.join();
+    }
+}
+
+void WorkStealingPool::Submit(Task task) {
+    Queue &queue = *queues_[next_.fetch_add(1, std::memory_order_relaxed) % queues_.size()];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+
+    // Counted under mutex_, which the threads check before they sleep, so none misses the task.
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_++;
+        queued_.fetch_add(1, std::memory_order_relaxed);
+    }
+    work_.notify_one();
+}
+
+void WorkStealingPool::Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [this] { return pending_ == 0; });
+}
+
+bool WorkStealingPool::Take(size_t index, Task &task) {
+    Queue &own = *queues_[index];
+    {
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            queued_.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+
+    for (size_t i = 1; i < queues_.size(); i++) {
+        Queue &victim = *queues_[(index + i) % queues_.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            queued_.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkStealingPool::Run(size_t index) {
+    Task task;
+    while (true) {
+        if (Take(index, task)) {
+            task();
+            task = nullptr;
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (--pending_ == 0) {
+                done_.notify_all();
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        work_.wait(lock, [this] { return stop_ || queued_.load(std::memory_order_relaxed) > 0; });
+        if (stop_ && queued_.load(std::memory_order_relaxed) == 0) {
+            break;
+        }
+    }
+}
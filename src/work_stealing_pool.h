@@ -0,0 +1,56 @@
+//
+// Copyright (c) 2023 SHAO Liming<lmshao@163.com>. All rights reserved.
+//
+
+#ifndef MPEG_TS_MEDIA_SRC_WORK_STEALING_POOL_H
+#define MPEG_TS_MEDIA_SRC_WORK_STEALING_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of threads, each with a queue of its own. Tasks are dealt round-robin; a thread runs its own queue
+// newest first and, once it is empty, steals the oldest task of another, so uneven tasks still keep every thread busy
+// until the end. Tasks must not throw.
+class WorkStealingPool {
+public:
+    using Task = std::function<void()>;
+
+    explicit WorkStealingPool(int threads = 0); // 0: one per CPU
+    // Runs what is queued, then stops the threads.
+    ~WorkStealingPool();
+
+    void Submit(Task task);
+    // Returns once every task submitted so far has run.
+    void Wait();
+
+    int Threads() const { return (int)threads_.size(); }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void Run(size_t index);
+    bool Take(size_t index, Task &task);
+
+private:
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> threads_;
+    std::atomic<size_t> next_{0};   // queue for the next task
+    std::atomic<size_t> queued_{0}; // tasks in the queues
+
+    std::mutex mutex_;
+    std::condition_variable work_;
+    std::condition_variable done_;
+    size_t pending_ = 0; // submitted and not finished
+    bool stop_ = false;
+};
+
+#endif // MPEG_TS_MEDIA_SRC_WORK_STEALING_POOL_H